@@ -0,0 +1,117 @@
+// bench.h (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Helpers shared by the benchmark programs
+
+#ifndef OIW_BENCH_H
+#define OIW_BENCH_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#define CHECK(err, op)                                         \
+  if ((err) != CL_SUCCESS)                                     \
+  {                                                            \
+    fprintf(stderr, "%s failed (%d)\n", op, (int)(err));       \
+    exit(1);                                                   \
+  }
+
+// Utility function to read a monotonic clock in nanoseconds
+static inline cl_ulong benchNow()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (cl_ulong)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Utility function to read an integer setting from the environment
+static inline long benchEnvInt(const char *name, long def)
+{
+  const char *value = getenv(name);
+  return value && *value ? strtol(value, NULL, 10) : def;
+}
+
+// Utility function to pick the platform and device to benchmark
+// OIW_BENCH_PLATFORM and OIW_BENCH_DEVICE select them by index (default 0)
+static inline cl_device_id benchDevice(cl_context *context,
+                                       cl_command_queue *queue)
+{
+  cl_int err;
+  cl_uint num;
+  cl_platform_id platforms[16];
+  err = clGetPlatformIDs(16, platforms, &num);
+  CHECK(err, "clGetPlatformIDs");
+  long p = benchEnvInt("OIW_BENCH_PLATFORM", 0);
+  if (p < 0 || p >= num)
+  {
+    fprintf(stderr, "Platform %ld not found\n", p);
+    exit(1);
+  }
+
+  cl_device_id devices[16];
+  err = clGetDeviceIDs(platforms[p], CL_DEVICE_TYPE_ALL, 16, devices, &num);
+  CHECK(err, "clGetDeviceIDs");
+  long d = benchEnvInt("OIW_BENCH_DEVICE", 0);
+  if (d < 0 || d >= num)
+  {
+    fprintf(stderr, "Device %ld not found\n", d);
+    exit(1);
+  }
+
+  *context = clCreateContext(NULL, 1, devices + d, NULL, NULL, &err);
+  CHECK(err, "clCreateContext");
+  if (queue)
+  {
+    *queue = clCreateCommandQueue(*context, devices[d], 0, &err);
+    CHECK(err, "clCreateCommandQueue");
+  }
+  return devices[d];
+}
+
+// Utility function to run a benchmark in a child process with one wrapper
+// setting in the environment, since the wrapper reads them only once
+static inline void benchVariant(const char *label, const char *name,
+                                const char *value,
+                                void (*run)(const char *label))
+{
+  fflush(stdout);
+  pid_t pid = fork();
+  if (pid == 0)
+  {
+    if (value)
+    {
+      setenv(name, value, 1);
+    }
+    else
+    {
+      unsetenv(name);
+    }
+    run(label);
+    fflush(stdout);
+    _exit(0);
+  }
+
+  int status;
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 ||
+      !WIFEXITED(status) || WEXITSTATUS(status))
+  {
+    fprintf(stderr, "%s benchmark failed\n", label);
+    exit(1);
+  }
+}
+
+#endif
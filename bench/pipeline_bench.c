@@ -0,0 +1,78 @@
+// pipeline_bench.c (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Bandwidth of large blocking transfers
+//
+// Times blocking clEnqueueWriteBuffer and clEnqueueReadBuffer calls from
+// and to pageable host memory, for transfers of 1 MiB to 256 MiB. This
+// runs once with the passthrough transfer and once with
+// OIW_PIPELINE_THRESHOLD set, which splits the transfers into chunks.
+
+#include "bench.h"
+
+#define MAX_SIZE (256<<20)
+
+static void runTransfers(const char *label)
+{
+  cl_int err;
+  cl_context context;
+  cl_command_queue queue;
+  benchDevice(&context, &queue);
+
+  size_t max = benchEnvInt("OIW_BENCH_SIZE", MAX_SIZE);
+  cl_mem buffer =
+    clCreateBuffer(context, CL_MEM_READ_WRITE, max, NULL, &err);
+  CHECK(err, "clCreateBuffer");
+  char *host = malloc(max);
+  if (!host)
+  {
+    fprintf(stderr, "Failed to allocate %zu bytes\n", max);
+    exit(1);
+  }
+  memset(host, 1, max);
+
+  unsigned iters = benchEnvInt("OIW_BENCH_ITERATIONS", 10);
+  for (size_t size = 1<<20; size <= max; size *= 4)
+  {
+    cl_ulong write = 0, read = 0;
+    for (unsigned i = 0; i < iters + 1; i++)
+    {
+      cl_ulong start = benchNow();
+      err = clEnqueueWriteBuffer(queue, buffer, CL_TRUE, 0, size, host,
+                                 0, NULL, NULL);
+      CHECK(err, "clEnqueueWriteBuffer");
+      cl_ulong middle = benchNow();
+      err = clEnqueueReadBuffer(queue, buffer, CL_TRUE, 0, size, host,
+                                0, NULL, NULL);
+      CHECK(err, "clEnqueueReadBuffer");
+
+      // The first iteration only warms up the transfer path
+      if (i)
+      {
+        write += middle - start;
+        read += benchNow() - middle;
+      }
+    }
+    printf("%s, %4zu MiB: write %7.2f GB/s, read %7.2f GB/s\n",
+           label, size>>20, (double)size*iters/write,
+           (double)size*iters/read);
+  }
+  printf("\n");
+
+  free(host);
+  clReleaseMemObject(buffer);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+}
+
+int main(int argc, char *argv[])
+{
+  benchVariant("passthrough", "OIW_PIPELINE_THRESHOLD", NULL, runTransfers);
+  benchVariant("pipelined", "OIW_PIPELINE_THRESHOLD", "1048576",
+               runTransfers);
+  return 0;
+}
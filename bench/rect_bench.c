@@ -0,0 +1,83 @@
+// rect_bench.c (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Bandwidth of rect transfers across region shapes
+//
+// Times blocking clEnqueueReadBufferRect and clEnqueueWriteBufferRect calls
+// on 1 MiB regions, from rows of 16 bytes to rows of 64 KiB. Rows are half
+// as wide as the buffer, so no region is contiguous. This runs once with
+// the implementation's rect transfers and once with OIW_RECT_SPLIT_WIDTH
+// set, which lets the wrapper use linear transfers instead.
+
+#include "bench.h"
+
+#define REGION_SIZE (1<<20)
+
+static void runShapes(const char *label)
+{
+  cl_int err;
+  cl_context context;
+  cl_command_queue queue;
+  benchDevice(&context, &queue);
+
+  cl_mem buffer =
+    clCreateBuffer(context, CL_MEM_READ_WRITE, 2*REGION_SIZE, NULL, &err);
+  CHECK(err, "clCreateBuffer");
+  char *host = malloc(REGION_SIZE);
+  if (!host)
+  {
+    fprintf(stderr, "Failed to allocate %d bytes\n", REGION_SIZE);
+    exit(1);
+  }
+  memset(host, 1, REGION_SIZE);
+
+  unsigned iters = benchEnvInt("OIW_BENCH_ITERATIONS", 20);
+  for (size_t width = 16; width <= 65536; width *= 4)
+  {
+    size_t origin[3] = {0, 0, 0};
+    size_t region[3] = {width, REGION_SIZE/width, 1};
+    cl_ulong write = 0, read = 0;
+
+    // The wrapper measures every method a few times before settling on
+    // one, so give it a head start before timing
+    for (unsigned i = 0; i < iters + 16; i++)
+    {
+      cl_ulong start = benchNow();
+      err = clEnqueueWriteBufferRect(queue, buffer, CL_TRUE, origin, origin,
+                                     region, 2*width, 0, width, 0, host,
+                                     0, NULL, NULL);
+      CHECK(err, "clEnqueueWriteBufferRect");
+      cl_ulong middle = benchNow();
+      err = clEnqueueReadBufferRect(queue, buffer, CL_TRUE, origin, origin,
+                                    region, 2*width, 0, width, 0, host,
+                                    0, NULL, NULL);
+      CHECK(err, "clEnqueueReadBufferRect");
+
+      if (i >= 16)
+      {
+        write += middle - start;
+        read += benchNow() - middle;
+      }
+    }
+    printf("%s, %5zu x %5zu: write %7.2f GB/s, read %7.2f GB/s\n",
+           label, region[0], region[1], (double)REGION_SIZE*iters/write,
+           (double)REGION_SIZE*iters/read);
+  }
+  printf("\n");
+
+  free(host);
+  clReleaseMemObject(buffer);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+}
+
+int main(int argc, char *argv[])
+{
+  benchVariant("vendor rect", "OIW_RECT_SPLIT_WIDTH", NULL, runShapes);
+  benchVariant("split rect", "OIW_RECT_SPLIT_WIDTH", "131072", runShapes);
+  return 0;
+}
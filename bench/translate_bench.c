@@ -0,0 +1,142 @@
+// translate_bench.c (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Throughput of object list translation
+//
+// Times API calls that take event, memory object and device lists of
+// increasing length, and reports the cost per list element. Lists of at
+// least 16 elements take the vectorized translation path.
+
+#include "bench.h"
+
+#define MAX_LIST 1024
+
+static const cl_uint m_lengths[] = {1, 4, 16, 64, 256, 1024};
+#define NUM_LENGTHS (sizeof(m_lengths)/sizeof(m_lengths[0]))
+
+// Utility function to pick an iteration count for a list length
+static unsigned iterations(cl_uint length)
+{
+  unsigned iters = benchEnvInt("OIW_BENCH_ELEMENTS", 1<<22) / length;
+  return iters ? iters : 1;
+}
+
+static void benchEvents(cl_context context)
+{
+  cl_int err;
+  cl_event events[MAX_LIST];
+  for (int i = 0; i < MAX_LIST; i++)
+  {
+    events[i] = clCreateUserEvent(context, &err);
+    CHECK(err, "clCreateUserEvent");
+    err = clSetUserEventStatus(events[i], CL_COMPLETE);
+    CHECK(err, "clSetUserEventStatus");
+  }
+
+  for (unsigned l = 0; l < NUM_LENGTHS; l++)
+  {
+    unsigned iters = iterations(m_lengths[l]);
+    cl_ulong start = benchNow();
+    for (unsigned i = 0; i < iters; i++)
+    {
+      err = clWaitForEvents(m_lengths[l], events);
+      CHECK(err, "clWaitForEvents");
+    }
+    cl_ulong elapsed = benchNow() - start;
+    printf("events   %5u  %8.2f ns/element  %8.2f M elements/s\n",
+           m_lengths[l], elapsed/((double)iters*m_lengths[l]),
+           iters*(double)m_lengths[l]*1e3/elapsed);
+  }
+
+  for (int i = 0; i < MAX_LIST; i++)
+  {
+    clReleaseEvent(events[i]);
+  }
+}
+
+static void benchMems(cl_context context, cl_command_queue queue)
+{
+  cl_int err;
+  cl_mem mems[MAX_LIST];
+  for (int i = 0; i < MAX_LIST; i++)
+  {
+    mems[i] = clCreateBuffer(context, CL_MEM_READ_WRITE, 64, NULL, &err);
+    CHECK(err, "clCreateBuffer");
+  }
+
+  for (unsigned l = 0; l < NUM_LENGTHS; l++)
+  {
+    unsigned iters = iterations(m_lengths[l]);
+    cl_ulong start = benchNow();
+    for (unsigned i = 0; i < iters; i++)
+    {
+      err = clEnqueueMigrateMemObjects(queue, m_lengths[l], mems,
+                                       CL_MIGRATE_MEM_OBJECT_CONTENT_UNDEFINED,
+                                       0, NULL, NULL);
+      CHECK(err, "clEnqueueMigrateMemObjects");
+    }
+    clFinish(queue);
+    cl_ulong elapsed = benchNow() - start;
+    printf("mems     %5u  %8.2f ns/element  %8.2f M elements/s\n",
+           m_lengths[l], elapsed/((double)iters*m_lengths[l]),
+           iters*(double)m_lengths[l]*1e3/elapsed);
+  }
+
+  for (int i = 0; i < MAX_LIST; i++)
+  {
+    clReleaseMemObject(mems[i]);
+  }
+}
+
+static void benchDevices(cl_device_id device)
+{
+  // Context creation dominates here, so use fewer iterations
+  cl_int err;
+  cl_device_id devices[MAX_LIST];
+  for (int i = 0; i < MAX_LIST; i++)
+  {
+    devices[i] = device;
+  }
+
+  for (unsigned l = 0; l < NUM_LENGTHS; l++)
+  {
+    unsigned iters = iterations(m_lengths[l]) / 16384;
+    iters = iters ? iters : 1;
+    cl_ulong start = benchNow();
+    for (unsigned i = 0; i < iters; i++)
+    {
+      cl_context context =
+        clCreateContext(NULL, m_lengths[l], devices, NULL, NULL, &err);
+      if (err != CL_SUCCESS)
+      {
+        printf("devices  %5u  skipped, repeated devices rejected (%d)\n",
+               m_lengths[l], err);
+        return;
+      }
+      clReleaseContext(context);
+    }
+    cl_ulong elapsed = benchNow() - start;
+    printf("devices  %5u  %8.2f ns/element  %8.2f M elements/s\n",
+           m_lengths[l], elapsed/((double)iters*m_lengths[l]),
+           iters*(double)m_lengths[l]*1e3/elapsed);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  cl_context context;
+  cl_command_queue queue;
+  cl_device_id device = benchDevice(&context, &queue);
+
+  benchEvents(context);
+  benchMems(context, queue);
+  benchDevices(device);
+
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+  return 0;
+}
@@ -0,0 +1,167 @@
+// wait_bench.c (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Latency of waiting for short commands
+//
+// Enqueues a tiny kernel, waits for it with clWaitForEvents or clFinish,
+// and builds a histogram of the time from enqueue to the wait returning.
+// This runs once with the passthrough wait and once with OIW_SPIN_WAIT=1.
+
+#include "bench.h"
+
+// Histogram buckets are powers of two in microseconds, from <1us upwards
+#define NUM_BUCKETS 18
+
+static const char *m_source =
+  "kernel void inc(global int *data)\n"
+  "{\n"
+  "  data[get_global_id(0)]++;\n"
+  "}\n";
+
+struct histogram
+{
+  unsigned counts[NUM_BUCKETS];
+  cl_ulong *samples;
+  unsigned num;
+};
+
+// Utility function to add a latency sample to a histogram
+static void addSample(struct histogram *hist, cl_ulong ns)
+{
+  unsigned bucket = 0;
+  for (cl_ulong us = ns / 1000; us && bucket < NUM_BUCKETS-1; us >>= 1)
+  {
+    bucket++;
+  }
+  hist->counts[bucket]++;
+  hist->samples[hist->num++] = ns;
+}
+
+static int compareSamples(const void *a, const void *b)
+{
+  cl_ulong x = *(const cl_ulong*)a;
+  cl_ulong y = *(const cl_ulong*)b;
+  return x < y ? -1 : x > y;
+}
+
+static void printHistogram(const char *label, const char *wait,
+                           struct histogram *hist)
+{
+  qsort(hist->samples, hist->num, sizeof(cl_ulong), compareSamples);
+  printf("%s, %s: p50 %.1f us, p99 %.1f us, max %.1f us\n", label, wait,
+         hist->samples[hist->num/2]/1e3,
+         hist->samples[(hist->num*99)/100]/1e3,
+         hist->samples[hist->num-1]/1e3);
+
+  unsigned max = 0;
+  for (unsigned b = 0; b < NUM_BUCKETS; b++)
+  {
+    max = hist->counts[b] > max ? hist->counts[b] : max;
+  }
+  for (unsigned b = 0; b < NUM_BUCKETS; b++)
+  {
+    if (!hist->counts[b])
+    {
+      continue;
+    }
+    char bar[51];
+    unsigned len = (hist->counts[b]*50 + max - 1) / max;
+    memset(bar, '#', len);
+    bar[len] = '\0';
+    if (b == 0)
+    {
+      printf("  %10s %8u %s\n", "<1us", hist->counts[b], bar);
+    }
+    else
+    {
+      char range[32];
+      if (b < NUM_BUCKETS-1)
+      {
+        snprintf(range, sizeof(range), "<%luus", 1UL << b);
+      }
+      else
+      {
+        snprintf(range, sizeof(range), ">=%luus", 1UL << (b-1));
+      }
+      printf("  %10s %8u %s\n", range, hist->counts[b], bar);
+    }
+  }
+  printf("\n");
+}
+
+static void runWaits(const char *label)
+{
+  cl_int err;
+  cl_context context;
+  cl_command_queue queue;
+  cl_device_id device = benchDevice(&context, &queue);
+
+  cl_program program =
+    clCreateProgramWithSource(context, 1, &m_source, NULL, &err);
+  CHECK(err, "clCreateProgramWithSource");
+  err = clBuildProgram(program, 1, &device, "", NULL, NULL);
+  CHECK(err, "clBuildProgram");
+  cl_kernel kernel = clCreateKernel(program, "inc", &err);
+  CHECK(err, "clCreateKernel");
+  cl_mem buffer =
+    clCreateBuffer(context, CL_MEM_READ_WRITE, 64*sizeof(cl_int), NULL, &err);
+  CHECK(err, "clCreateBuffer");
+  err = clSetKernelArg(kernel, 0, sizeof(cl_mem), &buffer);
+  CHECK(err, "clSetKernelArg");
+
+  unsigned iters = benchEnvInt("OIW_BENCH_ITERATIONS", 10000);
+  size_t global = 64;
+  struct histogram events = {{0}, malloc(iters*sizeof(cl_ulong)), 0};
+  struct histogram finish = {{0}, malloc(iters*sizeof(cl_ulong)), 0};
+
+  // Warm up the device before timing
+  for (unsigned i = 0; i < 100; i++)
+  {
+    clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, NULL,
+                           0, NULL, NULL);
+  }
+  clFinish(queue);
+
+  for (unsigned i = 0; i < iters; i++)
+  {
+    cl_event event;
+    cl_ulong start = benchNow();
+    err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, NULL,
+                                 0, NULL, &event);
+    CHECK(err, "clEnqueueNDRangeKernel");
+    err = clWaitForEvents(1, &event);
+    CHECK(err, "clWaitForEvents");
+    addSample(&events, benchNow() - start);
+    clReleaseEvent(event);
+
+    start = benchNow();
+    err = clEnqueueNDRangeKernel(queue, kernel, 1, NULL, &global, NULL,
+                                 0, NULL, NULL);
+    CHECK(err, "clEnqueueNDRangeKernel");
+    err = clFinish(queue);
+    CHECK(err, "clFinish");
+    addSample(&finish, benchNow() - start);
+  }
+
+  printHistogram(label, "clWaitForEvents", &events);
+  printHistogram(label, "clFinish", &finish);
+
+  free(events.samples);
+  free(finish.samples);
+  clReleaseMemObject(buffer);
+  clReleaseKernel(kernel);
+  clReleaseProgram(program);
+  clReleaseCommandQueue(queue);
+  clReleaseContext(context);
+}
+
+int main(int argc, char *argv[])
+{
+  benchVariant("passthrough", "OIW_SPIN_WAIT", NULL, runWaits);
+  benchVariant("spin wait", "OIW_SPIN_WAIT", "1", runWaits);
+  return 0;
+}
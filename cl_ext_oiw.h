@@ -0,0 +1,248 @@
+// cl_ext_oiw.h (ocl_icd_wrapper)
+// Copyright (c) 2014, James Price
+// All rights reserved.
+//
+// This program is provided under a two-clause BSD license. For full license
+// terms please see the LICENSE file distributed with this source.
+//
+// Extensions implemented by the wrapper itself. Entry points should be
+// obtained with clGetExtensionFunctionAddressForPlatform.
+
+#ifndef _CL_EXT_OIW_H_
+#define _CL_EXT_OIW_H_
+
+#ifdef __APPLE__
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * cl_oiw_command_graph
+ *
+ * Records the commands enqueued to a command queue between
+ * clBeginCommandGraphRecordingOIW and clEndCommandGraphRecordingOIW into a
+ * graph object. Recorded commands still execute as normal. The graph can then
+ * be resubmitted with clEnqueueCommandGraphOIW, which skips the per-command
+ * handle translation and kernel argument processing.
+ *
+ * Supported commands are buffer reads, writes, copies and fills, NDRange
+ * kernels, tasks, markers and barriers. Enqueuing any other command while
+ * recording causes clEndCommandGraphRecordingOIW to fail with
+ * CL_INVALID_OPERATION.
+ *
+ * Kernel arguments are captured when each launch is recorded. The graph
+ * keeps the memory objects it uses alive until it is released. Host pointers
+ * are captured by address, so they must stay valid for as long as the graph
+ * is used. A graph can only be enqueued to command queues of the device it
+ * was recorded on. Replays never block; wait on the returned event instead.
+ */
+#define cl_oiw_command_graph 1
+
+typedef struct _cl_command_graph_oiw * cl_command_graph_oiw;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clBeginCommandGraphRecordingOIW_fn)(
+  cl_command_queue command_queue);
+
+typedef CL_API_ENTRY cl_command_graph_oiw
+(CL_API_CALL *clEndCommandGraphRecordingOIW_fn)(
+  cl_command_queue command_queue,
+  cl_int *         errcode_ret);
+
+// Memory objects in patch_src are replaced by the corresponding objects in
+// patch_dst for this submission only.
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clEnqueueCommandGraphOIW_fn)(
+  cl_command_queue     command_queue,
+  cl_command_graph_oiw graph,
+  cl_uint              num_patches,
+  const cl_mem *       patch_src,
+  const cl_mem *       patch_dst,
+  cl_uint              num_events_in_wait_list,
+  const cl_event *     event_wait_list,
+  cl_event *           event);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clReleaseCommandGraphOIW_fn)(
+  cl_command_graph_oiw graph);
+
+/*
+ * cl_oiw_admission_control
+ *
+ * Limits the number of commands a command queue may have in flight on the
+ * device. Once the limit is reached, further enqueue calls either block
+ * until a command completes, spin until one completes, or fail with
+ * CL_COMMAND_QUEUE_FULL_OIW. A limit of zero disables admission control.
+ * The initial limit and policy of every queue are read from the
+ * OIW_MAX_IN_FLIGHT and OIW_BACKPRESSURE environment variables.
+ */
+#define cl_oiw_admission_control 1
+
+#define CL_COMMAND_QUEUE_FULL_OIW       -9100
+
+typedef cl_uint cl_backpressure_oiw;
+
+#define CL_BACKPRESSURE_BLOCK_OIW       0
+#define CL_BACKPRESSURE_SPIN_OIW        1
+#define CL_BACKPRESSURE_ERROR_OIW       2
+
+typedef struct _cl_command_queue_stats_oiw
+{
+  cl_ulong  commands;       // commands admitted
+  cl_ulong  throttled;      // enqueue calls that hit the limit
+  cl_uint   in_flight;      // commands currently in flight
+  cl_uint   peak_in_flight; // largest number of commands in flight
+  cl_double mean_in_flight; // moving average of the queue depth
+} cl_command_queue_stats_oiw;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clSetCommandQueueInFlightLimitOIW_fn)(
+  cl_command_queue    command_queue,
+  cl_uint             max_in_flight,
+  cl_backpressure_oiw backpressure);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clGetCommandQueueStatsOIW_fn)(
+  cl_command_queue             command_queue,
+  cl_command_queue_stats_oiw * stats);
+
+/*
+ * cl_oiw_event_notifier
+ *
+ * Exposes event completion through a file descriptor, so that it can be
+ * integrated into epoll, poll or kqueue based event loops without a thread
+ * blocking in clWaitForEvents. The descriptor becomes readable whenever one
+ * of the events added to the notifier completes.
+ *
+ * On Linux the descriptor is an eventfd, and reading it returns the number
+ * of events that completed since the last read. On other platforms it is
+ * the read end of a pipe, which receives one byte per completed event.
+ * The descriptor is owned by the notifier and is closed when the notifier
+ * is released.
+ */
+#define cl_oiw_event_notifier 1
+
+typedef struct _cl_event_notifier_oiw * cl_event_notifier_oiw;
+
+typedef CL_API_ENTRY cl_event_notifier_oiw
+(CL_API_CALL *clCreateEventNotifierOIW_fn)(
+  cl_context context,
+  cl_int *   errcode_ret);
+
+typedef CL_API_ENTRY int
+(CL_API_CALL *clGetEventNotifierFdOIW_fn)(
+  cl_event_notifier_oiw notifier);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clAddEventsToNotifierOIW_fn)(
+  cl_event_notifier_oiw notifier,
+  cl_uint               num_events,
+  const cl_event *      event_list);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clReleaseEventNotifierOIW_fn)(
+  cl_event_notifier_oiw notifier);
+
+/*
+ * cl_oiw_callback_dispatch
+ *
+ * Event, memory object destructor and program build callbacks are passed
+ * the wrapper objects rather than the implementation's own handles, and run
+ * on a pool of OIW_CALLBACK_THREADS wrapper threads (default 2) instead of
+ * the thread the implementation fires them on. Each thread takes up to 8
+ * ready callbacks at a time and runs them as a batch. The wrapper's own
+ * completion work runs on a separate thread, so slow callbacks don't delay
+ * it. With zero threads, callbacks run on the implementation's thread as
+ * before.
+ *
+ * clGetCallbackStatsOIW reports how long callbacks waited to be run.
+ */
+#define cl_oiw_callback_dispatch 1
+
+typedef struct _cl_callback_stats_oiw
+{
+  cl_ulong  callbacks;       // callbacks run
+  cl_ulong  batches;         // batches the callbacks were run in
+  cl_uint   threads;         // worker threads
+  cl_double mean_latency_ns; // mean time between firing and running
+  cl_ulong  max_latency_ns;  // longest time between firing and running
+} cl_callback_stats_oiw;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clGetCallbackStatsOIW_fn)(
+  cl_platform_id          platform,
+  cl_callback_stats_oiw * stats);
+
+/*
+ * cl_oiw_split_queue
+ *
+ * A split command queue targets one device, but also owns an in-order
+ * queue on every other device in its context. NDRange launches of kernels
+ * marked splittable with clSetKernelSplittableOIW are partitioned along
+ * their largest dimension using global_work_offset, in proportion to the
+ * compute units of each device, and run on all of the devices at once.
+ * Every other command runs on the queue's own device as normal.
+ *
+ * A split launch still obeys the queue's ordering, and the event it returns
+ * completes once every part has completed. Marking a kernel splittable
+ * asserts that its work-items can run on separate devices, which on most
+ * implementations means that no two devices may write to the same buffer.
+ */
+#define cl_oiw_split_queue 1
+
+typedef CL_API_ENTRY cl_command_queue
+(CL_API_CALL *clCreateSplitCommandQueueOIW_fn)(
+  cl_context                  context,
+  cl_device_id                device,
+  cl_command_queue_properties properties,
+  cl_int *                    errcode_ret);
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clSetKernelSplittableOIW_fn)(
+  cl_kernel kernel,
+  cl_bool   splittable);
+
+/*
+ * cl_oiw_queue_priority
+ *
+ * Adds priority hints to the properties accepted by clCreateCommandQueue.
+ * Low priority commands beyond OIW_LOW_PRIORITY_IN_FLIGHT per device are
+ * held in a backlog by the wrapper until an outstanding low priority command
+ * completes, so a high priority command never queues behind more than that
+ * many of them. Queues without a hint are not affected.
+ *
+ * clGetPriorityStatsOIW reports, per device and priority, how long commands
+ * took from being enqueued to completing.
+ */
+#define cl_oiw_queue_priority 1
+
+typedef cl_command_queue_properties cl_queue_priority_oiw;
+
+#define CL_QUEUE_PRIORITY_NORMAL_OIW    0
+#define CL_QUEUE_PRIORITY_LOW_OIW       (1 << 29)
+#define CL_QUEUE_PRIORITY_HIGH_OIW      (1 << 30)
+
+typedef struct _cl_priority_stats_oiw
+{
+  cl_ulong  commands;        // commands enqueued
+  cl_ulong  backlogged;      // commands held in the backlog
+  cl_double mean_latency_ns; // mean time between enqueue and completion
+  cl_ulong  max_latency_ns;  // longest time between enqueue and completion
+} cl_priority_stats_oiw;
+
+typedef CL_API_ENTRY cl_int
+(CL_API_CALL *clGetPriorityStatsOIW_fn)(
+  cl_device_id            device,
+  cl_queue_priority_oiw   priority,
+  cl_priority_stats_oiw * stats);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif // _CL_EXT_OIW_H_
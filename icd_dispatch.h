@@ -64,6 +64,10 @@
 #include <CL/cl_ext.h>
 #endif
 
+#include "cl_ext_oiw.h"
+
+#include <pthread.h>
+
 // dx headers
 #ifdef _WIN32
 #include <windows.h>
@@ -1264,6 +1268,13 @@ struct _cl_context
     cl_uint numDevices;
     cl_context_properties *properties;
     cl_uint numProperties;
+    cl_program scatterProgram;
+    pthread_mutex_t stagingLock;
+    struct stagingBuffer *staging;
+    size_t stagingIdle;
+    size_t stagingInUse;
+    size_t stagingPeak;
+    struct hostRegion *hostRegions;
 };
 
 struct _cl_command_queue
@@ -1272,6 +1283,58 @@ struct _cl_command_queue
     cl_command_queue queue;
     cl_context context;
     cl_device_id device;
+    cl_command_queue_properties properties;
+    cl_uint refCount;
+    cl_command_queue *queues;
+    cl_uint numQueues;
+    cl_uint nextQueue;
+    cl_command_graph_oiw graph;
+
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    cl_bool trackInFlight;
+    cl_uint maxInFlight;
+    cl_backpressure_oiw backpressure;
+    cl_uint inFlight;
+    cl_uint peakInFlight;
+    cl_ulong commands;
+    cl_ulong throttled;
+    cl_double meanInFlight;
+
+    cl_bool combineWrites;
+    cl_bool combineTransfers;
+    pthread_mutex_t batchLock;
+    struct writeBatch *batch;
+    struct transferRun *run;
+    cl_bool combineLaunches;
+    struct launchRun *launches;
+    cl_uint pendingCommands;
+    cl_kernel scatterKernel;
+    size_t scatterWidth;
+    cl_bool hostCommands;
+    cl_bool trackResidency;
+    cl_bool inferDeps;
+    cl_bool untrackedSince;
+    cl_bool barrierOwed;
+    cl_bool dualQueue;
+
+    cl_command_queue *splitQueues;
+    cl_uint *splitUnits;
+    cl_uint numSplitQueues;
+    struct splitScheduler *scheduler;
+    cl_command_queue feederQueue;
+
+    cl_bool perThread;
+    cl_uint maxQueues;
+    pthread_t *threads;
+    pthread_mutex_t orderLock;
+    struct orderLink *lastLink;
+
+    char *deviceName;
+
+    cl_queue_priority_oiw priority;
+    struct priorityLane *lane;
+    pthread_mutex_t priorityLock;
 };
 
 struct _cl_mem
@@ -1281,6 +1344,20 @@ struct _cl_mem
     cl_context context;
     cl_mem parent;
     cl_mem imgBuffer;
+    size_t size;
+    struct mappedRegion *mapCache;
+    cl_mem_flags flags;
+    cl_device_id device;
+    cl_uint refCount;
+    cl_event lastUse;
+    cl_uint useCount;
+    cl_uint trackedUse;
+    cl_event prefetch;
+    cl_command_queue _prefetchQueue;
+    cl_event lastWrite;
+    cl_event *reads;
+    cl_uint numReads;
+    cl_uint maxReads;
 };
 
 struct _cl_program
@@ -1288,6 +1365,17 @@ struct _cl_program
     KHRicdVendorDispatch *dispatch;
     cl_program program;
     cl_context context;
+    cl_bool fromSource;
+    char *source;
+};
+
+struct kernelArg
+{
+    size_t size;
+    void *value;
+    cl_mem mem;
+    cl_bool isSet;
+    cl_bool readOnly;
 };
 
 struct _cl_kernel
@@ -1295,6 +1383,15 @@ struct _cl_kernel
     KHRicdVendorDispatch *dispatch;
     cl_kernel kernel;
     cl_program program;
+    struct kernelArg *args;
+    cl_uint numArgs;
+    cl_command_queue queue;
+    cl_command_queue _queue;
+    cl_bool splittable;
+    char *name;
+    cl_bool guarded;
+    cl_ulong guardBound[4];
+    cl_command_queue heldQueue;
 };
 
 struct _cl_event
@@ -1303,6 +1400,14 @@ struct _cl_event
     cl_event event;
     cl_context context;
     cl_command_queue queue;
+    cl_command_queue submitQueue;
+    cl_int status;
+    cl_int mirror;
+    cl_bool profilingCached;
+    cl_ulong profiling[4];
+    cl_command_queue pendingQueue;
+    cl_int pendingRefs;
+    cl_command_type commandType;
 };
 
 struct _cl_sampler
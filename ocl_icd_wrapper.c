@@ -5,17 +5,311 @@
 // This program is provided under a two-clause BSD license. For full license
 // terms please see the LICENSE file distributed with this source.
 
+#include <ctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stddef.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #include "icd_dispatch.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define HAVE_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__)
+#define PREFETCH(ptr) __builtin_prefetch(ptr)
+#else
+#define PREFETCH(ptr)
+#endif
+
+#ifdef HAVE_X86_SIMD
+#define CPU_RELAX() _mm_pause()
+#else
+#define CPU_RELAX() sched_yield()
+#endif
+
 // Platform wrapper object
 static cl_platform_id m_platform = NULL;
 
+// Function to configure hybrid spin-then-block waits
+void initWaitEngine();
+
+// Function to start the application callback dispatcher
+void initCallbackDispatcher();
+
+// Whether mappings of buffers are kept alive across unmaps
+static cl_bool m_mapCache = CL_FALSE;
+
+// Function to really unmap the cached mappings of a memory object
+void releaseMappings(cl_mem mem, cl_command_queue _queue);
+
+// Write combining settings
+static size_t m_writeCombineSize = 0;
+static size_t m_writeCombineBatch = 0;
+
+// Narrowest rect rows that are always left to the implementation
+static size_t m_rectSplitWidth = 0;
+
+// Blocking transfers of at least this many bytes are pipelined in chunks
+static size_t m_pipelineThreshold = 0;
+
+// Transfers of at least this many bytes are staged through pinned memory
+static size_t m_stagingThreshold = 0;
+
+// Whether fills and copies of host-resident buffers are done on the host
+static cl_bool m_hostCommands = CL_FALSE;
+
+// Whether buffers bound to kernels are migrated ahead of their launch
+static cl_bool m_prefetch = CL_FALSE;
+static pthread_mutex_t m_residencyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to migrate a newly bound kernel argument ahead of its launch
+void prefetchMem(cl_kernel kernel, cl_mem mem);
+
+// Whether split launches are scheduled dynamically, how long each chunk
+// of work should take, and where learned kernel rates are kept between runs
+static cl_bool m_workStealing = CL_FALSE;
+static cl_ulong m_stealChunkNs = 0;
+static char *m_rateDb = NULL;
+
+// Function to load previously learned kernel rates
+void initKernelRates();
+
+// Function to stop the feeder threads of a split queue
+void destroySplitScheduler(struct splitScheduler *sched);
+
+// Most real queues a queue may have when each submitting thread gets one
+static cl_uint m_perThreadQueues = 0;
+
+// Whether in-order queues get a second real queue for buffer transfers
+static cl_bool m_transferQueue = CL_FALSE;
+
+// Function to synchronize the real queues backing a queue
+cl_int enqueueJoin(cl_command_queue queue,
+                   cl_bool barrier,
+                   cl_uint num_events,
+                   const cl_event *_wait_list,
+                   cl_event *_event);
+
+// Most low priority commands each device may have outstanding
+static cl_uint m_lowPriorityInFlight = 0;
+
+// Number of launches sampled by the local size tuner, and where its
+// results are kept between runs
+static cl_uint m_autotuneLaunches = 0;
+static char *m_autotuneDb = NULL;
+
+// Function to load previously tuned local sizes
+void initAutotune();
+
+// Function to drop the accesses recorded for a memory object
+void forgetAccesses(cl_mem mem);
+
+// Whether kernels are rebuilt with a guard so that global sizes can be
+// padded to a whole number of work-groups
+static cl_bool m_padGlobal = CL_FALSE;
+
+// Function to start the threads used for large host copies
+void initCopyThreads();
+
+// Transfer coalescing settings
+static cl_uint m_coalesceWindow = 0;
+static size_t m_coalesceSplitSize = 0;
+
+// Most adjacent kernel launches merged into one
+static cl_uint m_launchCoalesceWindow = 0;
+
+// Whether out-of-order queues derive dependencies from the memory each
+// command uses, and whether their barriers are left to those dependencies
+static cl_bool m_inferDependencies = CL_FALSE;
+static cl_bool m_downgradeBarriers = CL_FALSE;
+static pthread_mutex_t m_dependencyLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Chunk size of pipelined transfers, which adapts to the bandwidth achieved
+#define MIN_CHUNK_SIZE (256<<10)
+#define MAX_CHUNK_SIZE (64<<20)
+static size_t m_chunkSize;
+static cl_double m_chunkBandwidth = 0;
+static int m_chunkDirection = 1;
+static pthread_mutex_t m_chunkLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Function to submit the commands a queue is holding back
+void flushPending(cl_command_queue queue);
+
+// Functions that held back kernel launches are submitted through
+struct memAccess;
+struct tuneSample;
+void CL_CALLBACK commandComplete(cl_event _event, cl_int status,
+                                 void *user_data);
+struct memAccess* getKernelAccesses(cl_command_queue queue, cl_kernel kernel,
+                                    cl_uint *num_accesses);
+cl_event* inferDependencies(cl_command_queue queue, cl_uint num_accesses,
+                            const struct memAccess *accesses,
+                            cl_uint *num_events, cl_event *_wait_list);
+void recordAccesses(cl_command_queue queue, cl_command_queue _queue,
+                    cl_uint num_accesses, const struct memAccess *accesses,
+                    cl_int err, cl_event *_event);
+const size_t* selectLocalSize(cl_command_queue queue, cl_kernel kernel,
+                              cl_uint work_dim, const size_t *global_work_size,
+                              size_t *local, struct tuneSample **sample);
+void CL_CALLBACK recordTuneSample(cl_event _event, cl_int status,
+                                  void *user_data);
+
+// Every wrapper object stores its real handle directly after the dispatch
+// table pointer, which lets a single routine translate lists of any type
+#define CHECK_HANDLE_OFFSET(type, field)                          \
+  typedef char check_##type##_##field[                            \
+    offsetof(struct type, field) == sizeof(void*) ? 1 : -1]
+CHECK_HANDLE_OFFSET(_cl_device_id, device);
+CHECK_HANDLE_OFFSET(_cl_mem, mem);
+CHECK_HANDLE_OFFSET(_cl_program, program);
+CHECK_HANDLE_OFFSET(_cl_event, event);
+
+// How many objects ahead of the current one to prefetch
+#define TRANSLATE_PREFETCH_DISTANCE 16
+
+// Scalar handle translation, used for short lists and as a fallback
+static void translateHandlesScalar(cl_uint num, void *const *list, void **result)
+{
+  for (cl_uint i = 0; i < num; i++)
+  {
+    if (i + TRANSLATE_PREFETCH_DISTANCE < num)
+    {
+      PREFETCH(list[i + TRANSLATE_PREFETCH_DISTANCE]);
+    }
+    result[i] = ((void**)list[i])[1];
+  }
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void translateHandlesAVX2(cl_uint num, void *const *list, void **result)
+{
+  const __m256i offset = _mm256_set1_epi64x(sizeof(void*));
+  cl_uint i = 0;
+  for (; i + 4 <= num; i += 4)
+  {
+    if (i + TRANSLATE_PREFETCH_DISTANCE + 4 <= num)
+    {
+      void *const *ahead = list + i + TRANSLATE_PREFETCH_DISTANCE;
+      PREFETCH(ahead[0]);
+      PREFETCH(ahead[1]);
+      PREFETCH(ahead[2]);
+      PREFETCH(ahead[3]);
+    }
+
+    // Gather the handle field from four wrapper objects at once
+    __m256i ptrs = _mm256_loadu_si256((const __m256i*)(list + i));
+    ptrs = _mm256_add_epi64(ptrs, offset);
+    __m256i handles = _mm256_i64gather_epi64(NULL, ptrs, 1);
+    _mm256_storeu_si256((__m256i*)(result + i), handles);
+  }
+  translateHandlesScalar(num - i, list + i, result + i);
+}
+
+__attribute__((target("avx512f")))
+static void translateHandlesAVX512(cl_uint num, void *const *list, void **result)
+{
+  const __m512i offset = _mm512_set1_epi64(sizeof(void*));
+  cl_uint i = 0;
+  for (; i + 8 <= num; i += 8)
+  {
+    if (i + TRANSLATE_PREFETCH_DISTANCE + 8 <= num)
+    {
+      void *const *ahead = list + i + TRANSLATE_PREFETCH_DISTANCE;
+      for (int j = 0; j < 8; j++)
+      {
+        PREFETCH(ahead[j]);
+      }
+    }
+
+    // Gather the handle field from eight wrapper objects at once
+    __m512i ptrs = _mm512_loadu_si512((const void*)(list + i));
+    ptrs = _mm512_add_epi64(ptrs, offset);
+    __m512i handles = _mm512_i64gather_epi64(ptrs, NULL, 1);
+    _mm512_storeu_si512((void*)(result + i), handles);
+  }
+  translateHandlesScalar(num - i, list + i, result + i);
+}
+#endif
+
+// Handle translation routine, selected at platform initialization
+static void (*m_translateHandles)(cl_uint, void *const *, void **) =
+  translateHandlesScalar;
+
+// Lists shorter than this are not worth the vector setup cost
+#define TRANSLATE_SIMD_THRESHOLD 16
+
+// Select the fastest handle translation routine supported by this CPU
+static void initTranslateHandles()
+{
+#ifdef HAVE_X86_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f"))
+  {
+    m_translateHandles = translateHandlesAVX512;
+  }
+  else if (__builtin_cpu_supports("avx2"))
+  {
+    m_translateHandles = translateHandlesAVX2;
+  }
+#endif
+}
+
+// Utility function to translate a list of wrapper objects into real objects
+static void translateHandles(cl_uint num, void *const *list, void **result)
+{
+  if (num < TRANSLATE_SIMD_THRESHOLD)
+  {
+    translateHandlesScalar(num, list, result);
+  }
+  else
+  {
+    m_translateHandles(num, list, result);
+  }
+}
+
 // Function to initialize the dispatch table
 KHRicdVendorDispatch* createDispatchTable();
 
+// Function to look up extension functions implemented by the wrapper
+void* getExtensionFunction(const char *funcname);
+
+// Extensions implemented by the wrapper
+static const char *m_extensions =
+  "cl_oiw_command_graph cl_oiw_admission_control cl_oiw_event_notifier "
+  "cl_oiw_callback_dispatch cl_oiw_split_queue cl_oiw_queue_priority";
+
+// Utility function to get a monotonic timestamp in nanoseconds
+cl_ulong getTimeNs()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (cl_ulong)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+// Utility function to read an integer setting from the environment
+long getEnvInt(const char *name, long def)
+{
+  const char *value = getenv(name);
+  if (!value || !*value)
+  {
+    return def;
+  }
+  return strtol(value, NULL, 0);
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 clIcdGetPlatformIDsKHR(cl_uint num_entries,
                        cl_platform_id *platforms,
@@ -32,6 +326,93 @@ clIcdGetPlatformIDsKHR(cl_uint num_entries,
       return err;
     }
 
+    // Select list translation routine for this CPU
+    initTranslateHandles();
+
+    // Configure hybrid waits
+    initWaitEngine();
+
+    // Start callback worker threads
+    initCallbackDispatcher();
+
+    // Configure mapping cache
+    m_mapCache = getEnvInt("OIW_MAP_CACHE", 0) > 0;
+
+    // Configure write combining
+    m_writeCombineSize = getEnvInt("OIW_WRITE_COMBINE_SIZE", 0);
+    m_writeCombineBatch = getEnvInt("OIW_WRITE_COMBINE_BATCH", 1<<20);
+
+    // Configure pipelined transfers
+    m_pipelineThreshold = getEnvInt("OIW_PIPELINE_THRESHOLD", 0);
+    m_chunkSize = getEnvInt("OIW_PIPELINE_CHUNK", 4<<20);
+    if (m_chunkSize < MIN_CHUNK_SIZE)
+    {
+      m_chunkSize = MIN_CHUNK_SIZE;
+    }
+    if (m_chunkSize > MAX_CHUNK_SIZE)
+    {
+      m_chunkSize = MAX_CHUNK_SIZE;
+    }
+
+    // Configure pinned staging
+    m_stagingThreshold = getEnvInt("OIW_STAGING_THRESHOLD", 0);
+
+    // Configure prefetching of kernel arguments
+    m_prefetch = getEnvInt("OIW_PREFETCH", 0) > 0;
+
+    // Configure dynamic scheduling of split launches
+    m_workStealing = getEnvInt("OIW_WORK_STEALING", 0) > 0;
+    m_stealChunkNs = getEnvInt("OIW_STEAL_CHUNK_US", 2000) * 1000;
+    if (m_workStealing)
+    {
+      initKernelRates();
+    }
+
+    // Configure per-thread real queues
+    m_perThreadQueues = getEnvInt("OIW_PER_THREAD_QUEUES", 0);
+
+    // Configure separate transfer queues
+    m_transferQueue = getEnvInt("OIW_TRANSFER_QUEUE", 0) > 0;
+
+    // Configure priority queues
+    m_lowPriorityInFlight = getEnvInt("OIW_LOW_PRIORITY_IN_FLIGHT", 2);
+    if (m_lowPriorityInFlight < 1)
+    {
+      m_lowPriorityInFlight = 1;
+    }
+
+    // Configure local size tuning
+    m_autotuneLaunches = getEnvInt("OIW_AUTOTUNE", 0);
+    if (m_autotuneLaunches)
+    {
+      initAutotune();
+    }
+
+    // Configure global size padding
+    m_padGlobal = getEnvInt("OIW_PAD_GLOBAL", 0) ? CL_TRUE : CL_FALSE;
+
+    // Configure host execution of fills and copies
+    m_hostCommands = getEnvInt("OIW_HOST_COMMANDS", 0) > 0;
+
+    if (m_stagingThreshold || m_pipelineThreshold || m_hostCommands)
+    {
+      initCopyThreads();
+    }
+
+    // Configure rect transfer decomposition
+    m_rectSplitWidth = getEnvInt("OIW_RECT_SPLIT_WIDTH", 0);
+
+    // Configure transfer coalescing
+    m_coalesceWindow = getEnvInt("OIW_COALESCE_WINDOW", 0);
+    m_coalesceSplitSize = getEnvInt("OIW_COALESCE_SPLIT_SIZE", 65536);
+    m_launchCoalesceWindow = getEnvInt("OIW_LAUNCH_COALESCE_WINDOW", 0);
+
+    // Configure dependency inference
+    m_inferDependencies =
+      getEnvInt("OIW_INFER_DEPENDENCIES", 0) ? CL_TRUE : CL_FALSE;
+    m_downgradeBarriers =
+      getEnvInt("OIW_DOWNGRADE_BARRIERS", 0) ? CL_TRUE : CL_FALSE;
+
     // Create dispatch table
     KHRicdVendorDispatch *table = createDispatchTable(&table);
     if (!table)
@@ -67,7 +448,7 @@ clGetExtensionFunctionAddress(const char *funcname) CL_API_SUFFIX__VERSION_1_2
   }
   else
   {
-    return NULL;
+    return getExtensionFunction(funcname);
   }
 }
 
@@ -96,6 +477,57 @@ _clGetPlatformInfo_(cl_platform_id    platform,
     }
     return CL_SUCCESS;
   }
+  else if (param_name == CL_PLATFORM_EXTENSIONS)
+  {
+    // Append the extensions implemented by the wrapper
+    size_t _len;
+    cl_int err = clGetPlatformInfo(
+      platform->platform,
+      CL_PLATFORM_EXTENSIONS,
+      0,
+      NULL,
+      &_len
+    );
+    if (err != CL_SUCCESS)
+    {
+      return err;
+    }
+    char *extensions = malloc(_len + strlen(m_extensions) + 1);
+    err = clGetPlatformInfo(
+      platform->platform,
+      CL_PLATFORM_EXTENSIONS,
+      _len,
+      extensions,
+      NULL
+    );
+    if (err != CL_SUCCESS)
+    {
+      free(extensions);
+      return err;
+    }
+    if (extensions[0])
+    {
+      strcat(extensions, " ");
+    }
+    strcat(extensions, m_extensions);
+
+    size_t len = strlen(extensions) + 1;
+    if (param_value_size && param_value_size < len)
+    {
+      free(extensions);
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, extensions, len);
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = len;
+    }
+    free(extensions);
+    return CL_SUCCESS;
+  }
   else
   {
     return clGetPlatformInfo(
@@ -217,10 +649,7 @@ cl_device_id* createDeviceList(cl_uint num, const cl_device_id *list)
   if (list && num)
   {
     devices = malloc(num*sizeof(cl_device_id));
-    for (int i = 0; i < num; i++)
-    {
-      devices[i] = list[i]->device;
-    }
+    translateHandles(num, (void*const*)list, (void**)devices);
   }
   return devices;
 }
@@ -298,6 +727,13 @@ _clCreateContext_(const cl_context_properties * properties,
     context = malloc(sizeof(struct _cl_context));
     context->dispatch = devices[0]->dispatch;
     context->context = _context;
+    context->scatterProgram = NULL;
+    pthread_mutex_init(&context->stagingLock, NULL);
+    context->staging = NULL;
+    context->stagingIdle = 0;
+    context->stagingInUse = 0;
+    context->stagingPeak = 0;
+    context->hostRegions = NULL;
     context->platform = devices[0]->platform;
     context->numDevices = num_devices;
     context->devices = malloc(num_devices*sizeof(struct _cl_device_id));
@@ -373,6 +809,13 @@ _clCreateContextFromType_(const cl_context_properties * properties,
     context = malloc(sizeof(struct _cl_context));
     context->dispatch = m_platform->dispatch;
     context->context = _context;
+    context->scatterProgram = NULL;
+    pthread_mutex_init(&context->stagingLock, NULL);
+    context->staging = NULL;
+    context->stagingIdle = 0;
+    context->stagingInUse = 0;
+    context->stagingPeak = 0;
+    context->hostRegions = NULL;
     context->platform = m_platform;
 
     if (properties)
@@ -488,20 +931,140 @@ _clGetContextInfo_(cl_context         context,
   }
 }
 
+// Queue properties that only the wrapper understands
+#define PRIORITY_PROPERTIES \
+  (CL_QUEUE_PRIORITY_LOW_OIW | CL_QUEUE_PRIORITY_HIGH_OIW)
+
+// Utility function to get the properties real queues are created with
+cl_command_queue_properties getRealProperties(
+  cl_command_queue_properties properties)
+{
+  properties &= ~PRIORITY_PROPERTIES;
+  if (m_autotuneLaunches)
+  {
+    // The local size tuner times launches with profiling events
+    properties |= CL_QUEUE_PROFILING_ENABLE;
+  }
+  return properties;
+}
+
+// Command submitted to a queue with a priority hint
+struct priorityCommand
+{
+  struct priorityLane *lane;
+  cl_uint level;
+  cl_ulong startNs;
+  cl_command_queue _queue;
+  cl_event _gate;
+  cl_bool admitted;
+  cl_bool failed;
+  struct priorityCommand *next;
+  struct priorityCommand *nextInFlight;
+};
+
+// Commands of the prioritized queues of one device. Low priority commands
+// beyond the in-flight limit wait in a backlog, behind a barrier on a user
+// event that is set once one of the outstanding commands completes.
+struct priorityLane
+{
+  cl_device_id _device;
+  pthread_mutex_t lock;
+  cl_uint lowInFlight;
+  struct priorityCommand *inFlight;
+  struct priorityCommand *head;
+  struct priorityCommand *tail;
+  cl_ulong commands[2];
+  cl_ulong backlogged[2];
+  cl_ulong totalLatencyNs[2];
+  cl_ulong maxLatencyNs[2];
+  struct priorityLane *next;
+};
+static struct priorityLane *m_lanes = NULL;
+static pthread_mutex_t m_laneLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Command this thread is in the middle of submitting
+static __thread struct priorityCommand *m_priorityCommand = NULL;
+
+// Utility function to find the priority lane of a device
+struct priorityLane* getPriorityLane(cl_device_id _device)
+{
+  pthread_mutex_lock(&m_laneLock);
+  struct priorityLane *lane = m_lanes;
+  while (lane && lane->_device != _device)
+  {
+    lane = lane->next;
+  }
+  if (!lane)
+  {
+    lane = calloc(1, sizeof(struct priorityLane));
+    lane->_device = _device;
+    pthread_mutex_init(&lane->lock, NULL);
+    lane->next = m_lanes;
+    m_lanes = lane;
+  }
+  pthread_mutex_unlock(&m_laneLock);
+  return lane;
+}
+
 CL_API_ENTRY cl_command_queue CL_API_CALL
 _clCreateCommandQueue_(cl_context                     context,
                        cl_device_id                   device,
                        cl_command_queue_properties    properties,
                        cl_int *                       errcode_ret) CL_API_SUFFIX__VERSION_1_0
 {
+  // Decide whether to emulate out-of-order execution with a pool of
+  // in-order queues, which allows independent commands to overlap on
+  // implementations that ignore the out-of-order property
+  cl_uint numQueues = 1;
+  cl_command_queue_properties _properties = getRealProperties(properties);
+  if (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)
+  {
+    cl_command_queue_properties supported = 0;
+    clGetDeviceInfo(
+      device->device,
+      CL_DEVICE_QUEUE_PROPERTIES,
+      sizeof(supported),
+      &supported,
+      NULL
+    );
+    long emulate = getEnvInt("OIW_EMULATE_OUT_OF_ORDER", -1);
+    if (emulate > 0 ||
+        (emulate < 0 && !(supported & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE)))
+    {
+      long num = getEnvInt("OIW_OUT_OF_ORDER_QUEUES", 4);
+      numQueues = num > 1 ? num : 1;
+      _properties &= ~CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE;
+    }
+  }
+
+  // In-order queues may instead get a real queue for each thread that
+  // submits to them, created as threads first appear
+  cl_bool perThread = m_perThreadQueues > 1 && numQueues == 1 &&
+    !(properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+
+  // In-order queues may instead be backed by a compute queue and a transfer
+  // queue, which are kept in order by the memory each command uses
+  cl_bool dualQueue = m_transferQueue && numQueues == 1 && !perThread &&
+    !(properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+  if (dualQueue)
+  {
+    numQueues = 2;
+  }
+  cl_uint maxQueues = perThread ? m_perThreadQueues : numQueues;
+
   // Call original function
-  cl_int err;
-  cl_command_queue _queue = clCreateCommandQueue(
-    context->context,
-    device->device,
-    properties,
-    &err
-  );
+  cl_int err = CL_SUCCESS;
+  cl_command_queue *_queues = malloc(maxQueues*sizeof(cl_command_queue));
+  cl_uint i;
+  for (i = 0; i < numQueues && err == CL_SUCCESS; i++)
+  {
+    _queues[i] = clCreateCommandQueue(
+      context->context,
+      device->device,
+      _properties,
+      &err
+    );
+  }
 
   // Create wrapper object
   cl_command_queue queue = NULL;
@@ -509,9 +1072,115 @@ _clCreateCommandQueue_(cl_context                     context,
   {
     queue = malloc(sizeof(struct _cl_command_queue));
     queue->dispatch = context->dispatch;
-    queue->queue = _queue;
+    queue->queue = _queues[0];
     queue->context = context;
     queue->device = device;
+    queue->properties = properties;
+    queue->refCount = 1;
+    queue->queues = _queues;
+    queue->numQueues = numQueues;
+    queue->nextQueue = 0;
+    queue->graph = NULL;
+
+    // Admission control
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->cond, NULL);
+    queue->maxInFlight = getEnvInt("OIW_MAX_IN_FLIGHT", 0);
+    queue->trackInFlight = queue->maxInFlight > 0;
+    queue->backpressure =
+      getEnvInt("OIW_BACKPRESSURE", CL_BACKPRESSURE_BLOCK_OIW);
+    queue->inFlight = 0;
+    queue->peakInFlight = 0;
+    queue->commands = 0;
+    queue->throttled = 0;
+    queue->meanInFlight = 0;
+
+    // Write combining and transfer coalescing
+    queue->combineWrites =
+      m_writeCombineSize && numQueues == 1 && !perThread &&
+      !(properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+    queue->combineTransfers =
+      m_coalesceWindow > 1 && numQueues == 1 && !perThread &&
+      !(properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+    queue->combineLaunches =
+      m_launchCoalesceWindow > 1 && numQueues == 1 && !perThread &&
+      !(properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE);
+    pthread_mutex_init(&queue->batchLock, NULL);
+    queue->batch = NULL;
+    queue->run = NULL;
+    queue->launches = NULL;
+    queue->pendingCommands = 0;
+    queue->scatterKernel = NULL;
+
+    // Host execution needs a device that shares memory with the host
+    queue->hostCommands = CL_FALSE;
+    if (m_hostCommands)
+    {
+      cl_device_type type = 0;
+      cl_bool unified = CL_FALSE;
+      clGetDeviceInfo(device->device, CL_DEVICE_TYPE,
+                      sizeof(type), &type, NULL);
+      clGetDeviceInfo(device->device, CL_DEVICE_HOST_UNIFIED_MEMORY,
+                      sizeof(unified), &unified, NULL);
+      queue->hostCommands = (type & CL_DEVICE_TYPE_CPU) || unified;
+    }
+
+    // Dependencies only need inferring where commands may be reordered
+    queue->dualQueue = dualQueue;
+    queue->inferDeps = dualQueue || (m_inferDependencies &&
+      (properties & CL_QUEUE_OUT_OF_ORDER_EXEC_MODE_ENABLE));
+    queue->untrackedSince = CL_FALSE;
+    queue->barrierOwed = CL_FALSE;
+
+    // Residency is only worth tracking with several devices to move between
+    queue->trackResidency = m_prefetch && context->numDevices > 1;
+
+    // Only split queues own queues on other devices
+    queue->splitQueues = NULL;
+    queue->splitUnits = NULL;
+    queue->numSplitQueues = 0;
+    queue->scheduler = NULL;
+    queue->feederQueue = NULL;
+
+    // Per-thread real queues
+    queue->perThread = perThread;
+    queue->maxQueues = maxQueues;
+    queue->threads = malloc(maxQueues*sizeof(pthread_t));
+    queue->threads[0] = pthread_self();
+    pthread_mutex_init(&queue->orderLock, NULL);
+    queue->lastLink = NULL;
+
+    // Device name that tuned local sizes are stored under
+    queue->deviceName = NULL;
+    if (m_autotuneLaunches)
+    {
+      size_t sz = 0;
+      clGetDeviceInfo(device->device, CL_DEVICE_NAME, 0, NULL, &sz);
+      queue->deviceName = calloc(sz + 1, 1);
+      clGetDeviceInfo(device->device, CL_DEVICE_NAME, sz,
+                      queue->deviceName, NULL);
+    }
+
+    // Queues with a priority hint share a lane with the device's other
+    // prioritized queues
+    queue->priority = CL_QUEUE_PRIORITY_NORMAL_OIW;
+    queue->lane = NULL;
+    pthread_mutex_init(&queue->priorityLock, NULL);
+    if (properties & PRIORITY_PROPERTIES)
+    {
+      queue->priority = properties & CL_QUEUE_PRIORITY_HIGH_OIW ?
+        CL_QUEUE_PRIORITY_HIGH_OIW : CL_QUEUE_PRIORITY_LOW_OIW;
+      queue->lane = getPriorityLane(device->device);
+    }
+  }
+  else
+  {
+    // Release any queues created before the failure
+    for (cl_uint j = 0; j + 1 < i; j++)
+    {
+      clReleaseCommandQueue(_queues[j]);
+    }
+    free(_queues);
   }
 
   if (errcode_ret)
@@ -533,13 +1202,81 @@ _clSetCommandQueueProperty_(cl_command_queue               command_queue ,
 CL_API_ENTRY cl_int CL_API_CALL
 _clRetainCommandQueue_(cl_command_queue command_queue) CL_API_SUFFIX__VERSION_1_0
 {
-  return clRetainCommandQueue(command_queue->queue);
+  // Per-thread queues created meanwhile copy the count, so it must change
+  // together with the references on the real queues
+  pthread_mutex_lock(&command_queue->orderLock);
+  cl_int err = CL_SUCCESS;
+  for (cl_uint i = 0; i < command_queue->numQueues && err == CL_SUCCESS; i++)
+  {
+    err = clRetainCommandQueue(command_queue->queues[i]);
+  }
+  for (cl_uint i = 0; i < command_queue->numSplitQueues && err == CL_SUCCESS; i++)
+  {
+    err = clRetainCommandQueue(command_queue->splitQueues[i]);
+  }
+  if (command_queue->feederQueue && err == CL_SUCCESS)
+  {
+    err = clRetainCommandQueue(command_queue->feederQueue);
+  }
+  if (err == CL_SUCCESS)
+  {
+    __atomic_add_fetch(&command_queue->refCount, 1, __ATOMIC_ACQ_REL);
+  }
+  pthread_mutex_unlock(&command_queue->orderLock);
+  return err;
+}
+
+// Utility function to release the real queues behind a command queue
+cl_int releaseRealQueues(cl_command_queue command_queue)
+{
+  cl_int err = CL_SUCCESS;
+  for (cl_uint i = 0; i < command_queue->numQueues && err == CL_SUCCESS; i++)
+  {
+    err = clReleaseCommandQueue(command_queue->queues[i]);
+  }
+  for (cl_uint i = 0; i < command_queue->numSplitQueues && err == CL_SUCCESS; i++)
+  {
+    err = clReleaseCommandQueue(command_queue->splitQueues[i]);
+  }
+  if (command_queue->feederQueue && err == CL_SUCCESS)
+  {
+    err = clReleaseCommandQueue(command_queue->feederQueue);
+  }
+  return err;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
 _clReleaseCommandQueue_(cl_command_queue command_queue) CL_API_SUFFIX__VERSION_1_0
 {
-  return clReleaseCommandQueue(command_queue->queue);
+  flushPending(command_queue);
+
+  // The wrapper counts the application's references itself, since the real
+  // queues also carry references held by the wrapper and the
+  // implementation. Per-thread queues created meanwhile copy the count, so
+  // it must change together with the references on the real queues.
+  pthread_mutex_lock(&command_queue->orderLock);
+  cl_uint refs =
+    __atomic_sub_fetch(&command_queue->refCount, 1, __ATOMIC_ACQ_REL);
+  if (refs)
+  {
+    cl_int err = releaseRealQueues(command_queue);
+    pthread_mutex_unlock(&command_queue->orderLock);
+    return err;
+  }
+  pthread_mutex_unlock(&command_queue->orderLock);
+
+  // Stop the feeder threads before the last reference goes away, once the
+  // launches they still hold can make progress
+  if (command_queue->scheduler)
+  {
+    for (cl_uint i = 0; i < command_queue->numQueues; i++)
+    {
+      clFlush(command_queue->queues[i]);
+    }
+    destroySplitScheduler(command_queue->scheduler);
+    command_queue->scheduler = NULL;
+  }
+  return releaseRealQueues(command_queue);
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -549,7 +1286,26 @@ _clGetCommandQueueInfo_(cl_command_queue       command_queue ,
                         void *                 param_value ,
                         size_t *               param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  if (param_name == CL_QUEUE_CONTEXT)
+  if (param_name == CL_QUEUE_REFERENCE_COUNT)
+  {
+    // Leave out the references held by the wrapper
+    if (param_value_size && param_value_size < sizeof(cl_uint))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      cl_uint refs =
+        __atomic_load_n(&command_queue->refCount, __ATOMIC_ACQUIRE);
+      memcpy(param_value, &refs, sizeof(cl_uint));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_uint);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_QUEUE_CONTEXT)
   {
     if (param_value_size && param_value_size < sizeof(cl_context))
     {
@@ -581,6 +1337,23 @@ _clGetCommandQueueInfo_(cl_command_queue       command_queue ,
     }
     return CL_SUCCESS;
   }
+  else if (param_name == CL_QUEUE_PROPERTIES)
+  {
+    size_t sz = sizeof(cl_command_queue_properties);
+    if (param_value_size && param_value_size < sz)
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &command_queue->properties, sz);
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sz;
+    }
+    return CL_SUCCESS;
+  }
   else
   {
     return clGetCommandQueueInfo(
@@ -593,6 +1366,76 @@ _clGetCommandQueueInfo_(cl_command_queue       command_queue ,
   }
 }
 
+// Host memory that the implementation already owns or has pinned
+struct hostRegion
+{
+  cl_mem mem;
+  const char *ptr;
+  size_t size;
+  struct hostRegion *next;
+};
+
+// Utility function to remember a region of host memory backing a buffer
+void addHostRegion(cl_mem mem, const void *ptr, size_t size)
+{
+  struct hostRegion *region = malloc(sizeof(struct hostRegion));
+  region->mem = mem;
+  region->ptr = ptr;
+  region->size = size;
+
+  cl_context context = mem->context;
+  pthread_mutex_lock(&context->stagingLock);
+  region->next = context->hostRegions;
+  context->hostRegions = region;
+  pthread_mutex_unlock(&context->stagingLock);
+}
+
+// Utility function to forget a host region of a buffer
+// Forgets every region of the buffer if 'ptr' is NULL.
+void removeHostRegion(cl_mem mem, const void *ptr)
+{
+  cl_context context = mem->context;
+  pthread_mutex_lock(&context->stagingLock);
+  struct hostRegion **prev = &context->hostRegions;
+  while (*prev)
+  {
+    struct hostRegion *region = *prev;
+    if (region->mem == mem && (!ptr || region->ptr == ptr))
+    {
+      *prev = region->next;
+      free(region);
+      if (ptr)
+      {
+        break;
+      }
+    }
+    else
+    {
+      prev = &region->next;
+    }
+  }
+  pthread_mutex_unlock(&context->stagingLock);
+}
+
+// Utility function to check whether host memory overlaps a known region
+cl_bool isHostRegion(cl_context context, const void *ptr, size_t size)
+{
+  cl_bool found = CL_FALSE;
+  const char *start = ptr;
+  pthread_mutex_lock(&context->stagingLock);
+  for (struct hostRegion *region = context->hostRegions; region;
+       region = region->next)
+  {
+    if (start < region->ptr + region->size && region->ptr < start + size)
+    {
+      found = CL_TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&context->stagingLock);
+  return found;
+}
+
 CL_API_ENTRY cl_mem CL_API_CALL
 _clCreateBuffer_(cl_context    context ,
                  cl_mem_flags  flags ,
@@ -620,6 +1463,24 @@ _clCreateBuffer_(cl_context    context ,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = size;
+    buffer->mapCache = NULL;
+    buffer->flags = flags;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
+    if (flags & CL_MEM_USE_HOST_PTR)
+    {
+      addHostRegion(buffer, host_ptr, size);
+    }
   }
 
   if (errcode_ret)
@@ -656,6 +1517,25 @@ _clCreateSubBuffer_(cl_mem                    buffer ,
     subbuffer->context = buffer->context;
     subbuffer->parent = buffer;
     subbuffer->imgBuffer = NULL;
+    subbuffer->size = 0;
+    if (buffer_create_type == CL_BUFFER_CREATE_TYPE_REGION)
+    {
+      subbuffer->size = ((const cl_buffer_region*)buffer_create_info)->size;
+    }
+    subbuffer->mapCache = NULL;
+    subbuffer->flags = flags |
+      (buffer->flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR));
+    subbuffer->device = NULL;
+    subbuffer->lastUse = NULL;
+    subbuffer->lastWrite = NULL;
+    subbuffer->reads = NULL;
+    subbuffer->numReads = 0;
+    subbuffer->maxReads = 0;
+    subbuffer->refCount = 1;
+    subbuffer->useCount = 0;
+    subbuffer->prefetch = NULL;
+    subbuffer->_prefetchQueue = NULL;
+    subbuffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -700,6 +1580,20 @@ _clCreateImage_(cl_context              context,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
     if (image_desc->image_type == CL_MEM_OBJECT_IMAGE1D_BUFFER)
     {
       buffer->imgBuffer = image_desc->buffer;
@@ -784,12 +1678,43 @@ _clCreateImage3D_(cl_context              context,
 CL_API_ENTRY cl_int CL_API_CALL
 _clRetainMemObject_(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
 {
-  return clRetainMemObject(memobj->mem);
-}
+  cl_int err = clRetainMemObject(memobj->mem);
+  if (err == CL_SUCCESS)
+  {
+    __atomic_add_fetch(&memobj->refCount, 1, __ATOMIC_ACQ_REL);
+  }
+  return err;
+}
 
 CL_API_ENTRY cl_int CL_API_CALL
 _clReleaseMemObject_(cl_mem memobj) CL_API_SUFFIX__VERSION_1_0
 {
+  // Unmap cached mappings and drop the last recorded use when the
+  // application releases its last reference. The wrapper counts these
+  // itself, since the implementation's count includes the references the
+  // wrapper holds for held back commands.
+  if (!__atomic_sub_fetch(&memobj->refCount, 1, __ATOMIC_ACQ_REL))
+  {
+    releaseMappings(memobj, NULL);
+
+    pthread_mutex_lock(&m_residencyLock);
+    cl_event _old = memobj->lastUse;
+    cl_event _prefetch = memobj->prefetch;
+    memobj->lastUse = NULL;
+    memobj->prefetch = NULL;
+    pthread_mutex_unlock(&m_residencyLock);
+    if (_old)
+    {
+      clReleaseEvent(_old);
+    }
+    if (_prefetch)
+    {
+      clReleaseEvent(_prefetch);
+    }
+
+    forgetAccesses(memobj);
+    removeHostRegion(memobj, NULL);
+  }
   return clReleaseMemObject(memobj->mem);
 }
 
@@ -818,7 +1743,25 @@ _clGetMemObjectInfo_(cl_mem            memobj ,
                      void *            param_value ,
                      size_t *          param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  if (param_name == CL_MEM_CONTEXT)
+  if (param_name == CL_MEM_REFERENCE_COUNT)
+  {
+    // Leave out the references held by the wrapper
+    if (param_value_size && param_value_size < sizeof(cl_uint))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      cl_uint refs = __atomic_load_n(&memobj->refCount, __ATOMIC_ACQUIRE);
+      memcpy(param_value, &refs, sizeof(cl_uint));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_uint);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_MEM_CONTEXT)
   {
     if (param_value_size && param_value_size < sizeof(cl_context))
     {
@@ -897,16 +1840,307 @@ _clGetImageInfo_(cl_mem            image ,
   }
 }
 
+// Types of callback. Internal callbacks do the wrapper's own completion
+// work and are invoked like event callbacks.
+#define CALLBACK_EVENT    0
+#define CALLBACK_MEM      1
+#define CALLBACK_PROGRAM  2
+#define CALLBACK_INTERNAL 3
+
+// Callback waiting to be invoked with a wrapper object
+struct callbackJob
+{
+  cl_uint type;
+  void *object;
+  union
+  {
+    void (CL_CALLBACK *event)(cl_event, cl_int, void*);
+    void (CL_CALLBACK *mem)(cl_mem, void*);
+    void (CL_CALLBACK *program)(cl_program, void*);
+  } notify;
+  void *user_data;
+  cl_int status;
+  cl_uint arrivals;
+  cl_ulong queuedNs;
+  struct callbackJob *next;
+};
+
+// Triggered callbacks waiting for one of a lane's worker threads
+struct callbackLane
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  struct callbackJob *head;
+  struct callbackJob *tail;
+  cl_uint numThreads;
+};
+
+// Application callbacks are run on a small pool of wrapper threads, so
+// slow callbacks do not stall the thread the implementation fires them on.
+// Internal callbacks have a lane of their own, so that slow application
+// callbacks can't hold up the completion of wrapper commands.
+static struct callbackLane m_appLane =
+{
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+};
+static struct callbackLane m_internalLane =
+{
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+};
+
+// Application callback statistics
+static struct
+{
+  pthread_mutex_t lock;
+  cl_ulong callbacks;
+  cl_ulong batches;
+  cl_ulong totalLatencyNs;
+  cl_ulong maxLatencyNs;
+} m_callbacks =
+{
+  PTHREAD_MUTEX_INITIALIZER,
+};
+
+// Maximum number of callbacks a worker thread takes at once, leaving the
+// rest to other workers
+#define CALLBACK_BATCH 8
+
+// Utility function to invoke an application callback
+void runCallback(struct callbackJob *job)
+{
+  switch (job->type)
+  {
+  case CALLBACK_EVENT:
+  case CALLBACK_INTERNAL:
+    job->notify.event(job->object, job->status, job->user_data);
+    break;
+  case CALLBACK_MEM:
+    job->notify.mem(job->object, job->user_data);
+    break;
+  case CALLBACK_PROGRAM:
+    job->notify.program(job->object, job->user_data);
+    break;
+  }
+}
+
+// Worker thread that runs the callbacks of one lane in batches
+void* callbackWorker(void *arg)
+{
+  struct callbackLane *lane = arg;
+  while (1)
+  {
+    // Take a bounded batch of pending callbacks, and wake another worker
+    // if any are left
+    pthread_mutex_lock(&lane->lock);
+    while (!lane->head)
+    {
+      pthread_cond_wait(&lane->cond, &lane->lock);
+    }
+    struct callbackJob *job = lane->head;
+    struct callbackJob *last = job;
+    for (cl_uint n = 1; n < CALLBACK_BATCH && last->next; n++)
+    {
+      last = last->next;
+    }
+    lane->head = last->next;
+    last->next = NULL;
+    if (lane->head)
+    {
+      pthread_cond_signal(&lane->cond);
+    }
+    else
+    {
+      lane->tail = NULL;
+    }
+    pthread_mutex_unlock(&lane->lock);
+
+    cl_ulong count = 0, total = 0, max = 0;
+    while (job)
+    {
+      struct callbackJob *next = job->next;
+      cl_ulong latency = getTimeNs() - job->queuedNs;
+      total += latency;
+      max = latency > max ? latency : max;
+      count++;
+
+      runCallback(job);
+      free(job);
+      job = next;
+    }
+    if (lane == &m_internalLane)
+    {
+      continue;
+    }
+
+    pthread_mutex_lock(&m_callbacks.lock);
+    m_callbacks.callbacks += count;
+    m_callbacks.batches++;
+    m_callbacks.totalLatencyNs += total;
+    if (max > m_callbacks.maxLatencyNs)
+    {
+      m_callbacks.maxLatencyNs = max;
+    }
+    pthread_mutex_unlock(&m_callbacks.lock);
+  }
+  return NULL;
+}
+
+// Utility function to start the worker threads of a callback lane
+void startCallbackWorkers(struct callbackLane *lane, long threads)
+{
+  for (long i = 0; i < threads; i++)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, callbackWorker, lane) != 0)
+    {
+      break;
+    }
+    pthread_detach(thread);
+    lane->numThreads++;
+  }
+}
+
+void initCallbackDispatcher()
+{
+  long threads = getEnvInt("OIW_CALLBACK_THREADS", 2);
+  startCallbackWorkers(&m_appLane, threads);
+  if (m_appLane.numThreads)
+  {
+    startCallbackWorkers(&m_internalLane, 1);
+  }
+}
+
+// Utility function to create a callback job
+// The job is dispatched once it has been triggered 'arrivals' times
+struct callbackJob* createCallbackJob(cl_uint type, void *object,
+                                      void *notify, void *user_data,
+                                      cl_uint arrivals)
+{
+  struct callbackJob *job = malloc(sizeof(struct callbackJob));
+  job->type = type;
+  job->object = object;
+  job->notify.event = notify;
+  job->user_data = user_data;
+  job->status = CL_COMPLETE;
+  job->arrivals = arrivals;
+  job->next = NULL;
+  return job;
+}
+
+// Utility function to hand a triggered callback job to the worker threads
+void dispatchCallback(struct callbackJob *job)
+{
+  if (__atomic_sub_fetch(&job->arrivals, 1, __ATOMIC_ACQ_REL) > 0)
+  {
+    return;
+  }
+
+  struct callbackLane *lane =
+    job->type == CALLBACK_INTERNAL ? &m_internalLane : &m_appLane;
+  if (!lane->numThreads)
+  {
+    // No worker threads, so run on the calling thread
+    cl_bool internal = job->type == CALLBACK_INTERNAL;
+    runCallback(job);
+    free(job);
+    if (internal)
+    {
+      return;
+    }
+
+    pthread_mutex_lock(&m_callbacks.lock);
+    m_callbacks.callbacks++;
+    m_callbacks.batches++;
+    pthread_mutex_unlock(&m_callbacks.lock);
+    return;
+  }
+
+  job->queuedNs = getTimeNs();
+  pthread_mutex_lock(&lane->lock);
+  if (lane->tail)
+  {
+    lane->tail->next = job;
+  }
+  else
+  {
+    lane->head = job;
+  }
+  lane->tail = job;
+  pthread_cond_signal(&lane->cond);
+  pthread_mutex_unlock(&lane->lock);
+}
+
+// Callbacks registered with the implementation, which forward to the
+// dispatcher
+void CL_CALLBACK dispatchEventCallback(cl_event _event,
+                                       cl_int status,
+                                       void *user_data)
+{
+  struct callbackJob *job = user_data;
+  job->status = status;
+  dispatchCallback(job);
+}
+
+void CL_CALLBACK dispatchMemCallback(cl_mem _mem, void *user_data)
+{
+  dispatchCallback(user_data);
+}
+
+void CL_CALLBACK dispatchProgramCallback(cl_program _program,
+                                         void *user_data)
+{
+  dispatchCallback(user_data);
+}
+
+// Utility function to account for the implementation's side of a program
+// callback once a build or compile call has returned. The job is created
+// with two arrivals: one for the implementation's callback and one for this
+// call. The callback only fires when the call succeeds or the build itself
+// fails; any other error means it was never registered, so the job is
+// discarded.
+void finishProgramCallback(struct callbackJob *job, cl_int err)
+{
+  if (!job)
+  {
+    return;
+  }
+  switch (err)
+  {
+  case CL_SUCCESS:
+  case CL_BUILD_PROGRAM_FAILURE:
+  case CL_COMPILE_PROGRAM_FAILURE:
+    dispatchCallback(job);
+    break;
+  default:
+    free(job);
+    break;
+  }
+}
+
 CL_API_ENTRY cl_int CL_API_CALL
 _clSetMemObjectDestructorCallback_(cl_mem  memobj ,
                                    void (CL_CALLBACK * pfn_notify)(cl_mem  memobj , void* user_data),
                                    void * user_data)             CL_API_SUFFIX__VERSION_1_1
 {
-  return clSetMemObjectDestructorCallback(
+  if (!pfn_notify)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  struct callbackJob *job =
+    createCallbackJob(CALLBACK_MEM, memobj, pfn_notify, user_data, 1);
+  cl_int err = clSetMemObjectDestructorCallback(
     memobj->mem,
-    pfn_notify,
-    user_data
+    dispatchMemCallback,
+    job
   );
+  if (err != CL_SUCCESS)
+  {
+    free(job);
+  }
+  return err;
 }
 
 CL_API_ENTRY cl_sampler CL_API_CALL
@@ -1015,6 +2249,8 @@ _clCreateProgramWithSource_(cl_context         context ,
     program->dispatch = context->dispatch;
     program->program = _program;
     program->context = context;
+    program->fromSource = CL_TRUE;
+    program->source = NULL;
   }
 
   if (errcode_ret)
@@ -1055,6 +2291,8 @@ _clCreateProgramWithBinary_(cl_context                      context ,
     program->dispatch = context->dispatch;
     program->program = _program;
     program->context = context;
+    program->fromSource = CL_FALSE;
+    program->source = NULL;
   }
 
   if (_devices)
@@ -1095,6 +2333,8 @@ _clCreateProgramWithBuiltInKernels_(cl_context             context ,
     program->dispatch = context->dispatch;
     program->program = _program;
     program->context = context;
+    program->fromSource = CL_FALSE;
+    program->source = NULL;
   }
 
   if (_devices)
@@ -1117,398 +2357,731 @@ _clRetainProgram_(cl_program  program) CL_API_SUFFIX__VERSION_1_0
 CL_API_ENTRY cl_int CL_API_CALL
 _clReleaseProgram_(cl_program  program) CL_API_SUFFIX__VERSION_1_0
 {
+  // Free the original source of a guarded program with its last reference
+  if (program->source)
+  {
+    cl_uint refs = 0;
+    clGetProgramInfo(program->program, CL_PROGRAM_REFERENCE_COUNT,
+                     sizeof(cl_uint), &refs, NULL);
+    if (refs == 1)
+    {
+      free(program->source);
+      program->source = NULL;
+    }
+  }
   return clReleaseProgram(program->program);
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clBuildProgram_(cl_program            program ,
-                 cl_uint               num_devices ,
-                 const cl_device_id *  device_list ,
-                 const char *          options ,
-                 void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
-                 void *                user_data) CL_API_SUFFIX__VERSION_1_0
-{
-  cl_device_id *_devices = createDeviceList(num_devices, device_list);
-
-  const char *_options = options ? options : "";
-  size_t sz = strlen(_options) + strlen("-cl-kernel-arg-info") + 2;
-  char *buildOptions = malloc(sz);
-  sprintf(buildOptions, "%s -cl-kernel-arg-info", _options);
-  cl_uint err = clBuildProgram(
-    program->program,
-    num_devices,
-    _devices,
-    buildOptions,
-    pfn_notify,
-    user_data
-  );
-  free(buildOptions);
+// Name of the hidden argument holding the bounds of a padded launch
+#define GUARD_ARG_NAME "__oiw_global_bound"
 
-  if (_devices)
+// Utility function to append text to a growing string
+void appendText(char **buf, size_t *len, size_t *cap,
+                const char *text, size_t n)
+{
+  if (*len + n + 1 > *cap)
   {
-    free(_devices);
+    *cap = (*len + n + 1)*2;
+    *buf = realloc(*buf, *cap);
   }
-  return err;
-}
-
-CL_API_ENTRY cl_int CL_API_CALL
-_clUnloadCompiler_(void) CL_API_SUFFIX__VERSION_1_0
-{
-  return clUnloadCompiler();
+  memcpy(*buf + *len, text, n);
+  *len += n;
+  (*buf)[*len] = '\0';
 }
 
-cl_program* createProgramList(cl_uint num, const cl_program *list)
+// Utility function to step over a comment or literal starting at src[i]
+// Returns the index after it, or i if there isn't one
+size_t skipNonCode(const char *src, size_t i)
 {
-  cl_program *programs = NULL;
-  if (list && num)
+  if (src[i] == '/' && src[i+1] == '/')
   {
-    programs = malloc(num*sizeof(cl_program));
-    for (int i = 0; i < num; i++)
+    while (src[i] && src[i] != '\n')
     {
-      programs[i] = list[i]->program;
+      i++;
     }
   }
-  return programs;
-}
-
-CL_API_ENTRY cl_int CL_API_CALL
-_clCompileProgram_(cl_program            program ,
-                   cl_uint               num_devices ,
-                   const cl_device_id *  device_list ,
-                   const char *          options ,
-                   cl_uint               num_input_headers ,
-                   const cl_program *    input_headers,
-                   const char **         header_include_names ,
-                   void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
-                   void *                user_data) CL_API_SUFFIX__VERSION_1_2
-{
-  cl_device_id *_devices = createDeviceList(num_devices, device_list);
-  cl_program *_headers = createProgramList(num_input_headers, input_headers);
-
-  // Call original function
-  const char *_options = options ? options : "";
-  size_t sz = strlen(_options) + strlen("-cl-kernel-arg-info") + 2;
-  char *buildOptions = malloc(sz);
-  cl_int err = clCompileProgram(
-    program->program,
-    num_devices,
-    _devices,
-    buildOptions,
-    num_input_headers,
-    _headers,
-    header_include_names,
-    pfn_notify,
-    user_data
-  );
-  free(buildOptions);
-
-  if (_devices)
+  else if (src[i] == '/' && src[i+1] == '*')
   {
-    free(_devices);
+    i += 2;
+    while (src[i] && !(src[i] == '*' && src[i+1] == '/'))
+    {
+      i++;
+    }
+    i += src[i] ? 2 : 0;
   }
-  if (_headers)
+  else if (src[i] == '"' || src[i] == '\'')
   {
-    free(_headers);
+    char quote = src[i++];
+    while (src[i] && src[i] != quote)
+    {
+      i += (src[i] == '\\' && src[i+1]) ? 2 : 1;
+    }
+    i += src[i] ? 1 : 0;
   }
-  return err;
+  return i;
 }
 
-CL_API_ENTRY cl_program CL_API_CALL
-_clLinkProgram_(cl_context            context ,
-                cl_uint               num_devices ,
-                const cl_device_id *  device_list ,
-                const char *          options ,
-                cl_uint               num_input_programs ,
-                const cl_program *    input_programs ,
-                void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
-                void *                user_data ,
-                cl_int *              errcode_ret) CL_API_SUFFIX__VERSION_1_2
+// Utility function to find the bracket closing the one at src[i]
+// Returns the index of the closing bracket, or 0 if there isn't one
+size_t findClosing(const char *src, size_t i)
 {
-  cl_device_id *_devices = createDeviceList(num_devices, device_list);
-  cl_program *_programs = createProgramList(num_input_programs, input_programs);
-
-  // Call original function
-  cl_int err;
-  cl_program _program = clLinkProgram(
-    context->context,
-    num_devices,
-    _devices,
-    options,
-    num_input_programs,
-    _programs,
-    pfn_notify,
-    user_data,
-    &err
-  );
-
-  // Create wrapper object
-  cl_program program = NULL;
-  if (err == CL_SUCCESS)
+  char open = src[i];
+  char close = open == '(' ? ')' : '}';
+  int depth = 0;
+  while (src[i])
   {
-    program = malloc(sizeof(struct _cl_program));
-    program->dispatch = context->dispatch;
-    program->program = _program;
-    program->context = context;
+    size_t next = skipNonCode(src, i);
+    if (next != i)
+    {
+      i = next;
+      continue;
+    }
+    if (src[i] == open)
+    {
+      depth++;
+    }
+    else if (src[i] == close && --depth == 0)
+    {
+      return i;
+    }
+    i++;
   }
+  return 0;
+}
 
-  if (_devices)
-  {
-    free(_devices);
-  }
-  if (_programs)
-  {
-    free(_programs);
-  }
-  if (errcode_ret)
+// Function or macro defined in a program's source
+struct sourceDefinition
+{
+  size_t name;
+  size_t nameLen;
+  size_t body;
+  size_t bodyEnd;
+};
+
+// Utility function to add a definition to a growing list
+void addDefinition(struct sourceDefinition **defs, cl_uint *num, cl_uint *max,
+                   size_t name, size_t nameLen, size_t body, size_t bodyEnd)
+{
+  if (*num == *max)
   {
-    *errcode_ret = err;
+    *max = *max ? *max*2 : 16;
+    *defs = realloc(*defs, *max*sizeof(struct sourceDefinition));
   }
-  return program;
+  (*defs)[*num].name = name;
+  (*defs)[*num].nameLen = nameLen;
+  (*defs)[*num].body = body;
+  (*defs)[*num].bodyEnd = bodyEnd;
+  (*num)++;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clUnloadPlatformCompiler_(cl_platform_id  platform) CL_API_SUFFIX__VERSION_1_2
+// Utility function to find the functions and macros defined in a program's
+// source, so that everything a kernel can reach is checked
+// Returns the number of definitions found.
+cl_uint findDefinitions(const char *src, struct sourceDefinition **defs)
 {
-  return clUnloadPlatformCompiler(platform->platform);
-}
+  cl_uint num = 0, max = 0;
+  *defs = NULL;
+  size_t i = 0;
+  while (src[i])
+  {
+    size_t next = skipNonCode(src, i);
+    if (next != i)
+    {
+      i = next;
+      continue;
+    }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clGetProgramInfo_(cl_program          program ,
-                   cl_program_info     param_name ,
-                   size_t              param_value_size ,
-                   void *              param_value ,
-                   size_t *            param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+    if (src[i] == '#')
+    {
+      // Directives run to the end of the line, including continuations
+      size_t end = i;
+      while (src[end] && src[end] != '\n')
+      {
+        end += (src[end] == '\\' && src[end+1]) ? 2 : 1;
+      }
+      size_t j = i + 1;
+      while (src[j] == ' ' || src[j] == '\t')
+      {
+        j++;
+      }
+      if (!strncmp(src + j, "define", 6) && isspace(src[j+6]))
+      {
+        j += 6;
+        while (src[j] == ' ' || src[j] == '\t')
+        {
+          j++;
+        }
+        size_t name = j;
+        while (isalnum(src[j]) || src[j] == '_')
+        {
+          j++;
+        }
+        if (j > name)
+        {
+          addDefinition(defs, &num, &max, name, j - name, j, end);
+        }
+      }
+      i = end;
+      continue;
+    }
+
+    if (src[i] == '{')
+    {
+      // Step over type definitions and initializers
+      size_t end = findClosing(src, i);
+      if (!end)
+      {
+        break;
+      }
+      i = end + 1;
+      continue;
+    }
+
+    if (!isalpha(src[i]) && src[i] != '_')
+    {
+      i++;
+      continue;
+    }
+
+    // A name followed by a parameter list and a body defines a function
+    size_t name = i;
+    while (isalnum(src[i]) || src[i] == '_')
+    {
+      i++;
+    }
+    size_t nameLen = i - name;
+    size_t params = i;
+    while (isspace(src[params]))
+    {
+      params++;
+    }
+    if (src[params] != '(')
+    {
+      continue;
+    }
+    size_t paramsEnd = findClosing(src, params);
+    if (!paramsEnd)
+    {
+      break;
+    }
+    size_t body = paramsEnd + 1;
+    while (isspace(src[body]))
+    {
+      body++;
+    }
+    i = paramsEnd + 1;
+    if (src[body] != '{')
+    {
+      continue;
+    }
+    size_t bodyEnd = findClosing(src, body);
+    if (!bodyEnd)
+    {
+      break;
+    }
+    addDefinition(defs, &num, &max, name, nameLen, body, bodyEnd);
+    i = bodyEnd + 1;
+  }
+  return num;
+}
+
+// Utility function to check whether code relies on every work-item of a
+// work-group running, or on the size of the NDRange, either of which an
+// early return for padding work-items would break. The functions and
+// macros the code uses are checked as well, each only once.
+cl_bool isGuardSafe(const char *src,
+                    size_t body,
+                    size_t bodyEnd,
+                    const struct sourceDefinition *defs,
+                    cl_uint numDefs,
+                    cl_bool *checked)
 {
-  if (param_name == CL_PROGRAM_CONTEXT)
+  static const char *unsafe[] =
   {
-    if (param_value_size && param_value_size < sizeof(cl_context))
+    "barrier", "mem_fence", "read_mem_fence", "write_mem_fence",
+    "get_global_size", "get_num_groups", "get_enqueued_local_size",
+  };
+  for (size_t i = body; i < bodyEnd;)
+  {
+    size_t next = skipNonCode(src, i);
+    if (next != i)
     {
-      return CL_INVALID_VALUE;
+      i = next;
+      continue;
     }
-    if (param_value)
+    if (!isalpha(src[i]) && src[i] != '_')
     {
-      memcpy(param_value, &program->context, sizeof(cl_context));
+      i++;
+      continue;
     }
-    if (param_value_size_ret)
+    size_t start = i;
+    while (i < bodyEnd && (isalnum(src[i]) || src[i] == '_'))
     {
-      *param_value_size_ret = sizeof(cl_context);
+      i++;
+    }
+    size_t n = i - start;
+    if ((n > 11 && !strncmp(src + start, "work_group_", 11)) ||
+        (n > 10 && !strncmp(src + start, "sub_group_", 10)))
+    {
+      return CL_FALSE;
+    }
+    for (size_t u = 0; u < sizeof(unsafe)/sizeof(unsafe[0]); u++)
+    {
+      if (strlen(unsafe[u]) == n && !strncmp(src + start, unsafe[u], n))
+      {
+        return CL_FALSE;
+      }
+    }
+    for (cl_uint d = 0; d < numDefs; d++)
+    {
+      if (!checked[d] && defs[d].nameLen == n &&
+          !strncmp(src + defs[d].name, src + start, n))
+      {
+        checked[d] = CL_TRUE;
+        if (!isGuardSafe(src, defs[d].body, defs[d].bodyEnd,
+                         defs, numDefs, checked))
+        {
+          return CL_FALSE;
+        }
+      }
     }
-    return CL_SUCCESS;
   }
-  else if (param_name == CL_PROGRAM_DEVICES)
-  {
-    size_t sz = program->context->numDevices * sizeof(cl_device_id);
-    if (param_value_size && param_value_size < sz)
+  return CL_TRUE;
+}
+
+// Utility function to add a hidden bounds argument to every kernel that can
+// safely return early, and a guard that returns from work-items outside the
+// bounds. Insertions are kept on existing lines so build logs still match
+// the application's source. Returns NULL if no kernel was changed.
+char* createGuardedSource(const char *src)
+{
+  static const char guardCode[] =
+    " if (get_global_id(0) >= " GUARD_ARG_NAME ".s0 ||"
+    " get_global_id(1) >= " GUARD_ARG_NAME ".s1 ||"
+    " get_global_id(2) >= " GUARD_ARG_NAME ".s2) return;";
+
+  struct sourceDefinition *defs;
+  cl_uint numDefs = findDefinitions(src, &defs);
+  cl_bool *checked = malloc((numDefs + 1)*sizeof(cl_bool));
+
+  size_t len = 0, cap = 0;
+  char *out = NULL;
+  cl_uint guarded = 0;
+  size_t copied = 0;
+  size_t i = 0;
+  while (src[i])
+  {
+    size_t next = skipNonCode(src, i);
+    if (next != i)
     {
-      return CL_INVALID_VALUE;
+      i = next;
+      continue;
     }
-    if (param_value)
+    if (!isalpha(src[i]) && src[i] != '_')
     {
-      memcpy(param_value, program->context->devices, sz);
+      i++;
+      continue;
     }
-    if (param_value_size_ret)
+
+    // Look for the kernel qualifier
+    size_t start = i;
+    while (isalnum(src[i]) || src[i] == '_')
     {
-      *param_value_size_ret = sz;
+      i++;
     }
-    return CL_SUCCESS;
+    size_t n = i - start;
+    if (!(n == 6 && !strncmp(src + start, "kernel", 6)) &&
+        !(n == 8 && !strncmp(src + start, "__kernel", 8)))
+    {
+      continue;
+    }
+
+    // Find the parameter list, stepping over any attributes
+    size_t params = 0;
+    for (size_t j = i; src[j] && src[j] != ';' && src[j] != '{';)
+    {
+      size_t next = skipNonCode(src, j);
+      if (next != j)
+      {
+        j = next;
+      }
+      else if (!strncmp(src + j, "__attribute__", 13))
+      {
+        j += 13;
+        while (isspace(src[j]))
+        {
+          j++;
+        }
+        size_t end = src[j] == '(' ? findClosing(src, j) : 0;
+        if (!end)
+        {
+          break;
+        }
+        j = end + 1;
+      }
+      else if (src[j] == '(')
+      {
+        params = j;
+        break;
+      }
+      else
+      {
+        j++;
+      }
+    }
+    size_t paramsEnd = params ? findClosing(src, params) : 0;
+    if (!paramsEnd)
+    {
+      continue;
+    }
+
+    // Find the body, skipping declarations
+    size_t body = paramsEnd + 1;
+    while (src[body] && src[body] != '{' && src[body] != ';')
+    {
+      size_t next = skipNonCode(src, body);
+      body = next != body ? next : body + 1;
+    }
+    size_t bodyEnd = src[body] == '{' ? findClosing(src, body) : 0;
+    i = paramsEnd + 1;
+    if (!bodyEnd)
+    {
+      continue;
+    }
+    memset(checked, 0, (numDefs + 1)*sizeof(cl_bool));
+    if (!isGuardSafe(src, body, bodyEnd, defs, numDefs, checked))
+    {
+      continue;
+    }
+
+    // Add the hidden argument, replacing an empty or void parameter list
+    size_t p = params + 1;
+    while (isspace(src[p]))
+    {
+      p++;
+    }
+    cl_bool empty = p == paramsEnd;
+    if (!strncmp(src + p, "void", 4))
+    {
+      size_t q = p + 4;
+      while (isspace(src[q]))
+      {
+        q++;
+      }
+      empty = empty || q == paramsEnd;
+    }
+    appendText(&out, &len, &cap, src + copied,
+               (empty ? params + 1 : paramsEnd) - copied);
+    if (!empty)
+    {
+      appendText(&out, &len, &cap, ", ", 2);
+    }
+    appendText(&out, &len, &cap, "ulong4 " GUARD_ARG_NAME,
+               strlen("ulong4 " GUARD_ARG_NAME));
+
+    // Return early from work-items in the padding
+    appendText(&out, &len, &cap, src + paramsEnd, body + 1 - paramsEnd);
+    appendText(&out, &len, &cap, guardCode, strlen(guardCode));
+    copied = body + 1;
+    i = body + 1;
+    guarded++;
   }
-  else
+
+  free(defs);
+  free(checked);
+  if (!guarded)
   {
-    return clGetProgramInfo(
-      program->program,
-      param_name,
-      param_value_size,
-      param_value,
-      param_value_size_ret
-    );
+    free(out);
+    return NULL;
   }
+  appendText(&out, &len, &cap, src + copied, strlen(src + copied));
+  return out;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clGetProgramBuildInfo_(cl_program             program ,
-                        cl_device_id           device ,
-                        cl_program_build_info  param_name ,
-                        size_t                 param_value_size ,
-                        void *                 param_value ,
-                        size_t *               param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+// Utility function to build a copy of a program with guarded kernels
+// Returns NULL if there is nothing to guard or the copy fails to build.
+// Otherwise the original source is stored in *source.
+cl_program buildGuardedProgram(cl_program program,
+                               cl_uint num_devices,
+                               const cl_device_id *_devices,
+                               const char *options,
+                               char **source)
 {
-  return clGetProgramBuildInfo(
-    program->program,
-    device->device,
-    param_name,
-    param_value_size,
-    param_value,
-    param_value_size_ret
-  );
-}
+  size_t sz = 0;
+  if (clGetProgramInfo(program->program, CL_PROGRAM_SOURCE,
+                       0, NULL, &sz) != CL_SUCCESS || sz <= 1)
+  {
+    return NULL;
+  }
+  char *src = malloc(sz);
+  clGetProgramInfo(program->program, CL_PROGRAM_SOURCE, sz, src, NULL);
+  char *guardedSrc = createGuardedSource(src);
+  if (!guardedSrc)
+  {
+    free(src);
+    return NULL;
+  }
 
-CL_API_ENTRY cl_kernel CL_API_CALL
-_clCreateKernel_(cl_program       program ,
-                 const char *     kernel_name ,
-                 cl_int *         errcode_ret) CL_API_SUFFIX__VERSION_1_0
-{
-  // Call original function
   cl_int err;
-  cl_kernel _kernel = clCreateKernel(
-    program->program,
-    kernel_name,
-    &err
-  );
-
-  // Create wrapper object
-  cl_kernel kernel = NULL;
-  if (err == CL_SUCCESS)
+  const char *strings = guardedSrc;
+  cl_program _program = clCreateProgramWithSource(
+    program->context->context, 1, &strings, NULL, &err);
+  free(guardedSrc);
+  if (err != CL_SUCCESS)
   {
-    kernel = malloc(sizeof(struct _cl_kernel));
-    kernel->dispatch = program->dispatch;
-    kernel->kernel = _kernel;
-    kernel->program = program;
+    free(src);
+    return NULL;
   }
-
-  if (errcode_ret)
+  err = clBuildProgram(_program, num_devices, _devices, options, NULL, NULL);
+  if (err != CL_SUCCESS)
   {
-    *errcode_ret = err;
+    clReleaseProgram(_program);
+    free(src);
+    return NULL;
   }
-  return kernel;
+  *source = src;
+  return _program;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clCreateKernelsInProgram_(cl_program      program ,
-                           cl_uint         num_kernels ,
-                           cl_kernel *     kernels ,
-                           cl_uint *       num_kernels_ret) CL_API_SUFFIX__VERSION_1_0
+_clBuildProgram_(cl_program            program ,
+                 cl_uint               num_devices ,
+                 const cl_device_id *  device_list ,
+                 const char *          options ,
+                 void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
+                 void *                user_data) CL_API_SUFFIX__VERSION_1_0
 {
-  cl_kernel *_kernels = NULL;
-  if (kernels)
+  cl_device_id *_devices = createDeviceList(num_devices, device_list);
+
+  const char *_options = options ? options : "";
+  size_t sz = strlen(_options) + strlen("-cl-kernel-arg-info") + 2;
+  char *buildOptions = malloc(sz);
+  sprintf(buildOptions, "%s -cl-kernel-arg-info", _options);
+  struct callbackJob *job = NULL;
+  if (pfn_notify)
   {
-    _kernels = malloc(num_kernels*sizeof(cl_kernel));
+    job = createCallbackJob(CALLBACK_PROGRAM, program,
+                            pfn_notify, user_data, 2);
   }
 
-  // Call original function
-  cl_uint num;
-  cl_int err = clCreateKernelsInProgram(
-    program->program,
-    num_kernels,
-    _kernels,
-    &num
-  );
+  // Build kernels with a guard against padding work-items where possible,
+  // which can only be done before any kernels exist
+  cl_program _guarded = NULL;
+  char *source = NULL;
+  if (m_padGlobal && program->fromSource)
+  {
+    _guarded = buildGuardedProgram(program, num_devices, _devices,
+                                   buildOptions, &source);
+  }
+  program->fromSource = CL_FALSE;
 
-  // Create wrapper objects
-  if (err == CL_SUCCESS && kernels)
+  cl_uint err;
+  if (_guarded)
   {
-    for (int i = 0; i < num; i++)
+    // Move the application's references over to the guarded program
+    cl_uint refs = 1;
+    clGetProgramInfo(program->program, CL_PROGRAM_REFERENCE_COUNT,
+                     sizeof(cl_uint), &refs, NULL);
+    for (cl_uint i = 1; i < refs; i++)
     {
-      kernels[i] = malloc(sizeof(struct _cl_kernel));
-      kernels[i]->dispatch = program->dispatch;
-      kernels[i]->kernel = _kernels[i];
-      kernels[i]->program = program;
+      clRetainProgram(_guarded);
+    }
+    cl_program _original = program->program;
+    program->program = _guarded;
+    program->source = source;
+    for (cl_uint i = 0; i < refs; i++)
+    {
+      clReleaseProgram(_original);
+    }
+    err = CL_SUCCESS;
+    if (job)
+    {
+      // Stand in for the callback of the build that was skipped
+      dispatchCallback(job);
     }
   }
-
-  if (_kernels)
+  else
   {
-    free(_kernels);
+    // Call original function
+    err = clBuildProgram(
+      program->program,
+      num_devices,
+      _devices,
+      buildOptions,
+      job ? dispatchProgramCallback : NULL,
+      job
+    );
   }
-  if (num_kernels_ret)
+  free(buildOptions);
+  finishProgramCallback(job, err);
+
+  if (_devices)
   {
-    *num_kernels_ret = num;
+    free(_devices);
   }
   return err;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clRetainKernel_(cl_kernel     kernel) CL_API_SUFFIX__VERSION_1_0
+_clUnloadCompiler_(void) CL_API_SUFFIX__VERSION_1_0
 {
-  return clRetainKernel(kernel->kernel);
+  return clUnloadCompiler();
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clReleaseKernel_(cl_kernel    kernel) CL_API_SUFFIX__VERSION_1_0
+cl_program* createProgramList(cl_uint num, const cl_program *list)
 {
-  return clReleaseKernel(kernel->kernel);
+  cl_program *programs = NULL;
+  if (list && num)
+  {
+    programs = malloc(num*sizeof(cl_program));
+    translateHandles(num, (void*const*)list, (void**)programs);
+  }
+  return programs;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clSetKernelArg_(cl_kernel     kernel ,
-                 cl_uint       arg_index ,
-                 size_t        arg_size ,
-                 const void *  arg_value) CL_API_SUFFIX__VERSION_1_0
+_clCompileProgram_(cl_program            program ,
+                   cl_uint               num_devices ,
+                   const cl_device_id *  device_list ,
+                   const char *          options ,
+                   cl_uint               num_input_headers ,
+                   const cl_program *    input_headers,
+                   const char **         header_include_names ,
+                   void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
+                   void *                user_data) CL_API_SUFFIX__VERSION_1_2
 {
-  // Get argument address qualifier to determine if it's a memory object
-  cl_kernel_arg_address_qualifier address;
-  cl_int err = clGetKernelArgInfo(
-    kernel->kernel,
-    arg_index,
-    CL_KERNEL_ARG_ADDRESS_QUALIFIER,
-    sizeof(address),
-    &address,
-    NULL
-  );
-  if (err != CL_SUCCESS)
+  cl_device_id *_devices = createDeviceList(num_devices, device_list);
+  cl_program *_headers = createProgramList(num_input_headers, input_headers);
+
+  // Call original function
+  const char *_options = options ? options : "";
+  size_t sz = strlen(_options) + strlen("-cl-kernel-arg-info") + 2;
+  char *buildOptions = malloc(sz);
+  sprintf(buildOptions, "%s -cl-kernel-arg-info", _options);
+  struct callbackJob *job = NULL;
+  if (pfn_notify)
   {
-    return err;
+    job = createCallbackJob(CALLBACK_PROGRAM, program,
+                            pfn_notify, user_data, 2);
   }
-
-  // Get argument type name to determine if it's a sampler
-  size_t sz;
-  clGetKernelArgInfo(
-    kernel->kernel,
-    arg_index,
-    CL_KERNEL_ARG_TYPE_NAME,
-    0,
-    NULL,
-    &sz
+  cl_int err = clCompileProgram(
+    program->program,
+    num_devices,
+    _devices,
+    buildOptions,
+    num_input_headers,
+    _headers,
+    header_include_names,
+    job ? dispatchProgramCallback : NULL,
+    job
   );
-  char *type = malloc(++sz);
-  clGetKernelArgInfo(
-    kernel->kernel,
-    arg_index,
-    CL_KERNEL_ARG_TYPE_NAME,
-    sz,
-    type,
-    NULL
+  free(buildOptions);
+  finishProgramCallback(job, err);
+
+  if (_devices)
+  {
+    free(_devices);
+  }
+  if (_headers)
+  {
+    free(_headers);
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_program CL_API_CALL
+_clLinkProgram_(cl_context            context ,
+                cl_uint               num_devices ,
+                const cl_device_id *  device_list ,
+                const char *          options ,
+                cl_uint               num_input_programs ,
+                const cl_program *    input_programs ,
+                void (CL_CALLBACK *   pfn_notify)(cl_program  program , void *  user_data),
+                void *                user_data ,
+                cl_int *              errcode_ret) CL_API_SUFFIX__VERSION_1_2
+{
+  cl_device_id *_devices = createDeviceList(num_devices, device_list);
+  cl_program *_programs = createProgramList(num_input_programs, input_programs);
+
+  // The link may complete before the wrapper object exists, so the callback
+  // is only dispatched once it has fired and the wrapper has been created
+  struct callbackJob *job = NULL;
+  if (pfn_notify)
+  {
+    job = createCallbackJob(CALLBACK_PROGRAM, NULL,
+                            pfn_notify, user_data, 2);
+  }
+
+  // Call original function
+  cl_int err;
+  cl_program _program = clLinkProgram(
+    context->context,
+    num_devices,
+    _devices,
+    options,
+    num_input_programs,
+    _programs,
+    job ? dispatchProgramCallback : NULL,
+    job,
+    &err
   );
 
-  // If global/constant memory or sampler, get real object
-  const void *value = arg_value;
-  if (strcmp(type, "sampler_t") == 0)
+  // Create wrapper object
+  // A program is also returned when linking fails, so that its build log
+  // can be queried
+  cl_program program = NULL;
+  if (_program)
   {
-    value = &(*(cl_sampler*)arg_value)->sampler;
+    program = malloc(sizeof(struct _cl_program));
+    program->dispatch = context->dispatch;
+    program->program = _program;
+    program->context = context;
+    program->fromSource = CL_FALSE;
+    program->source = NULL;
   }
-  else if (arg_value && (
-      address == CL_KERNEL_ARG_ADDRESS_GLOBAL ||
-      address == CL_KERNEL_ARG_ADDRESS_CONSTANT))
+
+  if (job)
   {
-    cl_mem buffer = *(cl_mem*)arg_value;
-    if (buffer)
+    if (program)
     {
-      value = &(buffer->mem);
+      job->object = program;
+      dispatchCallback(job);
     }
     else
     {
-      value = NULL;
+      free(job);
     }
   }
 
-  // Call original function
-  err = clSetKernelArg(
-    kernel->kernel,
-    arg_index,
-    arg_size,
-    value
-  );
+  if (_devices)
+  {
+    free(_devices);
+  }
+  if (_programs)
+  {
+    free(_programs);
+  }
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return program;
+}
 
-  return err;
+CL_API_ENTRY cl_int CL_API_CALL
+_clUnloadPlatformCompiler_(cl_platform_id  platform) CL_API_SUFFIX__VERSION_1_2
+{
+  return clUnloadPlatformCompiler(platform->platform);
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clGetKernelInfo_(cl_kernel        kernel ,
-                  cl_kernel_info   param_name ,
-                  size_t           param_value_size ,
-                  void *           param_value ,
-                  size_t *         param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+_clGetProgramInfo_(cl_program          program ,
+                   cl_program_info     param_name ,
+                   size_t              param_value_size ,
+                   void *              param_value ,
+                   size_t *            param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  if (param_name == CL_KERNEL_CONTEXT)
+  if (param_name == CL_PROGRAM_CONTEXT)
   {
     if (param_value_size && param_value_size < sizeof(cl_context))
     {
@@ -1516,7 +3089,7 @@ _clGetKernelInfo_(cl_kernel        kernel ,
     }
     if (param_value)
     {
-      memcpy(param_value, &(kernel->program->context), sizeof(cl_context));
+      memcpy(param_value, &program->context, sizeof(cl_context));
     }
     if (param_value_size_ret)
     {
@@ -1524,26 +3097,45 @@ _clGetKernelInfo_(cl_kernel        kernel ,
     }
     return CL_SUCCESS;
   }
-  else if (param_name == CL_KERNEL_PROGRAM)
+  else if (param_name == CL_PROGRAM_DEVICES)
   {
-    if (param_value_size && param_value_size < sizeof(cl_program))
+    size_t sz = program->context->numDevices * sizeof(cl_device_id);
+    if (param_value_size && param_value_size < sz)
     {
       return CL_INVALID_VALUE;
     }
     if (param_value)
     {
-      memcpy(param_value, &kernel->program, sizeof(cl_program));
+      memcpy(param_value, program->context->devices, sz);
     }
     if (param_value_size_ret)
     {
-      *param_value_size_ret = sizeof(cl_program);
+      *param_value_size_ret = sz;
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_PROGRAM_SOURCE && program->source)
+  {
+    // Guarded programs report the application's source
+    size_t sz = strlen(program->source) + 1;
+    if (param_value_size && param_value_size < sz)
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, program->source, sz);
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sz;
     }
     return CL_SUCCESS;
   }
   else
   {
-    return clGetKernelInfo(
-      kernel->kernel,
+    return clGetProgramInfo(
+      program->program,
       param_name,
       param_value_size,
       param_value,
@@ -1553,16 +3145,16 @@ _clGetKernelInfo_(cl_kernel        kernel ,
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clGetKernelArgInfo_(cl_kernel        kernel ,
-                     cl_uint          arg_indx ,
-                     cl_kernel_arg_info   param_name ,
-                     size_t           param_value_size ,
-                     void *           param_value ,
-                     size_t *         param_value_size_ret) CL_API_SUFFIX__VERSION_1_2
+_clGetProgramBuildInfo_(cl_program             program ,
+                        cl_device_id           device ,
+                        cl_program_build_info  param_name ,
+                        size_t                 param_value_size ,
+                        void *                 param_value ,
+                        size_t *               param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  return clGetKernelArgInfo(
-    kernel->kernel,
-    arg_indx,
+  return clGetProgramBuildInfo(
+    program->program,
+    device->device,
     param_name,
     param_value_size,
     param_value,
@@ -1570,86 +3162,351 @@ _clGetKernelArgInfo_(cl_kernel        kernel ,
   );
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clGetKernelWorkGroupInfo_(cl_kernel                   kernel ,
-                           cl_device_id                device ,
-                           cl_kernel_work_group_info   param_name ,
-                           size_t                      param_value_size ,
-                           void *                      param_value ,
-                           size_t *                    param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+// Utility function to initialize shadow copies of kernel arguments
+void initKernelArgs(cl_kernel kernel)
 {
-  return clGetKernelWorkGroupInfo(
+  cl_uint num = 0;
+  clGetKernelInfo(
     kernel->kernel,
-    device->device,
-    param_name,
-    param_value_size,
-    param_value,
-    param_value_size_ret
+    CL_KERNEL_NUM_ARGS,
+    sizeof(cl_uint),
+    &num,
+    NULL
   );
-}
 
-// Utility function to convert event list into real event list
-cl_event* createEventList(cl_uint num, const cl_event *list)
-{
-  cl_event *result = NULL;
-  if (num > 0 && list)
+  // Hide the bounds argument of guarded kernels, which is last. Programs
+  // created from the binaries of a guarded program have it too.
+  kernel->guarded = CL_FALSE;
+  if (num)
   {
-    result = malloc(num*sizeof(cl_event));
-    for (int i = 0; i < num; i++)
+    char name[sizeof(GUARD_ARG_NAME)] = "";
+    clGetKernelArgInfo(kernel->kernel, num - 1, CL_KERNEL_ARG_NAME,
+                       sizeof(name), name, NULL);
+    if (!strcmp(name, GUARD_ARG_NAME))
     {
-      result[i] = list[i]->event;
+      kernel->guarded = CL_TRUE;
+      num--;
+      for (cl_uint d = 0; d < 4; d++)
+      {
+        kernel->guardBound[d] = (cl_ulong)-1;
+      }
+      clSetKernelArg(kernel->kernel, num,
+                     sizeof(kernel->guardBound), kernel->guardBound);
     }
   }
-  return result;
+
+  kernel->numArgs = num;
+  kernel->args = num ? calloc(num, sizeof(struct kernelArg)) : NULL;
+
+  // Note which arguments the kernel cannot write to
+  for (cl_uint i = 0; i < num; i++)
+  {
+    cl_kernel_arg_address_qualifier address = 0;
+    cl_kernel_arg_access_qualifier access = 0;
+    cl_kernel_arg_type_qualifier type = 0;
+    clGetKernelArgInfo(kernel->kernel, i, CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+                       sizeof(address), &address, NULL);
+    clGetKernelArgInfo(kernel->kernel, i, CL_KERNEL_ARG_ACCESS_QUALIFIER,
+                       sizeof(access), &access, NULL);
+    clGetKernelArgInfo(kernel->kernel, i, CL_KERNEL_ARG_TYPE_QUALIFIER,
+                       sizeof(type), &type, NULL);
+    kernel->args[i].readOnly =
+      address == CL_KERNEL_ARG_ADDRESS_CONSTANT ||
+      access == CL_KERNEL_ARG_ACCESS_READ_ONLY ||
+      (type & CL_KERNEL_ARG_TYPE_CONST);
+  }
+  kernel->_queue = NULL;
+  kernel->queue = NULL;
+  kernel->splittable = CL_FALSE;
+  kernel->name = NULL;
+  kernel->heldQueue = NULL;
 }
 
-// Utility function to convert mem list into real mem list
-cl_mem* createMemList(cl_uint num, const cl_mem *list)
+CL_API_ENTRY cl_kernel CL_API_CALL
+_clCreateKernel_(cl_program       program ,
+                 const char *     kernel_name ,
+                 cl_int *         errcode_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  cl_mem *result = NULL;
-  if (num > 0 && list)
+  // Call original function
+  cl_int err;
+  cl_kernel _kernel = clCreateKernel(
+    program->program,
+    kernel_name,
+    &err
+  );
+
+  // Create wrapper object
+  cl_kernel kernel = NULL;
+  if (err == CL_SUCCESS)
   {
-    result = malloc(num*sizeof(cl_mem));
-    for (int i = 0; i < num; i++)
-    {
-      result[i] = list[i]->mem;
-    }
+    kernel = malloc(sizeof(struct _cl_kernel));
+    kernel->dispatch = program->dispatch;
+    kernel->kernel = _kernel;
+    kernel->program = program;
+    initKernelArgs(kernel);
   }
-  return result;
+
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return kernel;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clWaitForEvents_(cl_uint              num_events ,
-                  const cl_event *     event_list) CL_API_SUFFIX__VERSION_1_0
+_clCreateKernelsInProgram_(cl_program      program ,
+                           cl_uint         num_kernels ,
+                           cl_kernel *     kernels ,
+                           cl_uint *       num_kernels_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  if (num_events == 0)
+  cl_kernel *_kernels = NULL;
+  if (kernels)
   {
-    return CL_SUCCESS;
+    _kernels = malloc(num_kernels*sizeof(cl_kernel));
   }
 
   // Call original function
-  cl_event *_events = createEventList(num_events, event_list);
-  cl_int err = clWaitForEvents(num_events, _events);
-  free(_events);
-  return err;
-}
+  cl_uint num;
+  cl_int err = clCreateKernelsInProgram(
+    program->program,
+    num_kernels,
+    _kernels,
+    &num
+  );
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clGetEventInfo_(cl_event          event ,
-                 cl_event_info     param_name ,
-                 size_t            param_value_size ,
-                 void *            param_value ,
-                 size_t *          param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
-{
-  if (param_name == CL_EVENT_CONTEXT)
+  // Create wrapper objects
+  if (err == CL_SUCCESS && kernels)
   {
-    if (param_value_size && param_value_size < sizeof(cl_context))
-    {
-      return CL_INVALID_VALUE;
-    }
-    if (param_value)
+    for (int i = 0; i < num; i++)
     {
-      memcpy(param_value, &(event->context), sizeof(cl_context));
+      kernels[i] = malloc(sizeof(struct _cl_kernel));
+      kernels[i]->dispatch = program->dispatch;
+      kernels[i]->kernel = _kernels[i];
+      kernels[i]->program = program;
+      initKernelArgs(kernels[i]);
+    }
+  }
+
+  if (_kernels)
+  {
+    free(_kernels);
+  }
+  if (num_kernels_ret)
+  {
+    *num_kernels_ret = num;
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clRetainKernel_(cl_kernel     kernel) CL_API_SUFFIX__VERSION_1_0
+{
+  return clRetainKernel(kernel->kernel);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clReleaseKernel_(cl_kernel    kernel) CL_API_SUFFIX__VERSION_1_0
+{
+  // Let go of the prefetch queue before the last reference goes away
+  if (kernel->_queue)
+  {
+    cl_uint refs = 0;
+    clGetKernelInfo(kernel->kernel, CL_KERNEL_REFERENCE_COUNT,
+                    sizeof(cl_uint), &refs, NULL);
+    if (refs == 1)
+    {
+      pthread_mutex_lock(&m_residencyLock);
+      cl_command_queue _old = kernel->_queue;
+      kernel->_queue = NULL;
+      kernel->queue = NULL;
+      pthread_mutex_unlock(&m_residencyLock);
+      if (_old)
+      {
+        clReleaseCommandQueue(_old);
+      }
+    }
+  }
+  return clReleaseKernel(kernel->kernel);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clSetKernelArg_(cl_kernel     kernel ,
+                 cl_uint       arg_index ,
+                 size_t        arg_size ,
+                 const void *  arg_value) CL_API_SUFFIX__VERSION_1_0
+{
+  // The bounds argument of guarded kernels is set by the wrapper
+  if (kernel->guarded && arg_index >= kernel->numArgs)
+  {
+    return CL_INVALID_ARG_INDEX;
+  }
+
+  // Submit a held back launch before its arguments change
+  cl_command_queue held =
+    __atomic_load_n(&kernel->heldQueue, __ATOMIC_ACQUIRE);
+  if (held)
+  {
+    flushPending(held);
+  }
+
+  // Get argument address qualifier to determine if it's a memory object
+  cl_kernel_arg_address_qualifier address;
+  cl_int err = clGetKernelArgInfo(
+    kernel->kernel,
+    arg_index,
+    CL_KERNEL_ARG_ADDRESS_QUALIFIER,
+    sizeof(address),
+    &address,
+    NULL
+  );
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Get argument type name to determine if it's a sampler
+  size_t sz;
+  clGetKernelArgInfo(
+    kernel->kernel,
+    arg_index,
+    CL_KERNEL_ARG_TYPE_NAME,
+    0,
+    NULL,
+    &sz
+  );
+  char *type = malloc(++sz);
+  clGetKernelArgInfo(
+    kernel->kernel,
+    arg_index,
+    CL_KERNEL_ARG_TYPE_NAME,
+    sz,
+    type,
+    NULL
+  );
+
+  // If global/constant memory or sampler, get real object
+  const void *value = arg_value;
+  cl_mem mem = NULL;
+  if (strcmp(type, "sampler_t") == 0)
+  {
+    value = &(*(cl_sampler*)arg_value)->sampler;
+  }
+  else if (arg_value && (
+      address == CL_KERNEL_ARG_ADDRESS_GLOBAL ||
+      address == CL_KERNEL_ARG_ADDRESS_CONSTANT))
+  {
+    cl_mem buffer = *(cl_mem*)arg_value;
+    if (buffer)
+    {
+      value = &(buffer->mem);
+      mem = buffer;
+    }
+    else
+    {
+      value = NULL;
+    }
+  }
+
+  // Call original function
+  err = clSetKernelArg(
+    kernel->kernel,
+    arg_index,
+    arg_size,
+    value
+  );
+  free(type);
+
+  // Update shadow copy of argument
+  if (err == CL_SUCCESS && arg_index < kernel->numArgs)
+  {
+    struct kernelArg *arg = kernel->args + arg_index;
+    if (value)
+    {
+      arg->value = realloc(arg->value, arg_size);
+      memcpy(arg->value, value, arg_size);
+    }
+    else
+    {
+      free(arg->value);
+      arg->value = NULL;
+    }
+    arg->size = arg_size;
+    arg->mem = mem;
+    arg->isSet = CL_TRUE;
+  }
+
+  // Start moving the buffer to where the kernel will probably run next
+  if (err == CL_SUCCESS && mem && m_prefetch)
+  {
+    prefetchMem(kernel, mem);
+  }
+
+  return err;
+}
+
+// Utility function to create a new real kernel with the current arguments
+cl_kernel createKernelClone(cl_kernel kernel)
+{
+  size_t sz;
+  cl_int err = clGetKernelInfo(
+    kernel->kernel,
+    CL_KERNEL_FUNCTION_NAME,
+    0,
+    NULL,
+    &sz
+  );
+  if (err != CL_SUCCESS)
+  {
+    return NULL;
+  }
+  char *name = malloc(sz);
+  clGetKernelInfo(
+    kernel->kernel,
+    CL_KERNEL_FUNCTION_NAME,
+    sz,
+    name,
+    NULL
+  );
+
+  cl_kernel _kernel = clCreateKernel(kernel->program->program, name, &err);
+  free(name);
+  if (err != CL_SUCCESS)
+  {
+    return NULL;
+  }
+
+  for (cl_uint i = 0; i < kernel->numArgs; i++)
+  {
+    struct kernelArg *arg = kernel->args + i;
+    if (arg->isSet)
+    {
+      clSetKernelArg(_kernel, i, arg->size, arg->value);
+    }
+  }
+  if (kernel->guarded)
+  {
+    clSetKernelArg(_kernel, kernel->numArgs,
+                   sizeof(kernel->guardBound), kernel->guardBound);
+  }
+  return _kernel;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetKernelInfo_(cl_kernel        kernel ,
+                  cl_kernel_info   param_name ,
+                  size_t           param_value_size ,
+                  void *           param_value ,
+                  size_t *         param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+{
+  if (param_name == CL_KERNEL_CONTEXT)
+  {
+    if (param_value_size && param_value_size < sizeof(cl_context))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &(kernel->program->context), sizeof(cl_context));
     }
     if (param_value_size_ret)
     {
@@ -1657,26 +3514,43 @@ _clGetEventInfo_(cl_event          event ,
     }
     return CL_SUCCESS;
   }
-  else if (param_name == CL_EVENT_COMMAND_QUEUE)
+  else if (param_name == CL_KERNEL_PROGRAM)
   {
-    if (param_value_size && param_value_size < sizeof(cl_command_queue))
+    if (param_value_size && param_value_size < sizeof(cl_program))
     {
       return CL_INVALID_VALUE;
     }
     if (param_value)
     {
-      memcpy(param_value, &event->queue, sizeof(cl_command_queue));
+      memcpy(param_value, &kernel->program, sizeof(cl_program));
     }
     if (param_value_size_ret)
     {
-      *param_value_size_ret = sizeof(cl_command_queue);
+      *param_value_size_ret = sizeof(cl_program);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_KERNEL_NUM_ARGS && kernel->guarded)
+  {
+    // Leave out the hidden bounds argument
+    if (param_value_size && param_value_size < sizeof(cl_uint))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &kernel->numArgs, sizeof(cl_uint));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_uint);
     }
     return CL_SUCCESS;
   }
   else
   {
-    return clGetEventInfo(
-      event->event,
+    return clGetKernelInfo(
+      kernel->kernel,
       param_name,
       param_value_size,
       param_value,
@@ -1685,258 +3559,6033 @@ _clGetEventInfo_(cl_event          event ,
   }
 }
 
-CL_API_ENTRY cl_event CL_API_CALL
-_clCreateUserEvent_(cl_context     context ,
-                    cl_int *       errcode_ret) CL_API_SUFFIX__VERSION_1_1
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetKernelArgInfo_(cl_kernel        kernel ,
+                     cl_uint          arg_indx ,
+                     cl_kernel_arg_info   param_name ,
+                     size_t           param_value_size ,
+                     void *           param_value ,
+                     size_t *         param_value_size_ret) CL_API_SUFFIX__VERSION_1_2
 {
-  // Call original function
-  cl_int err;
-  cl_event _event = clCreateUserEvent(
-    context->context,
-    &err
-  );
-
-  // Create wrapper object
-  cl_event event = NULL;
-  if (err == CL_SUCCESS)
-  {
-    event = malloc(sizeof(struct _cl_event));
-    event->dispatch = context->dispatch;
-    event->event = _event;
-    event->context = context;
-    event->queue = NULL;
-  }
-
-  if (errcode_ret)
+  if (kernel->guarded && arg_indx >= kernel->numArgs)
   {
-    *errcode_ret = err;
+    return CL_INVALID_ARG_INDEX;
   }
-  return event;
+  return clGetKernelArgInfo(
+    kernel->kernel,
+    arg_indx,
+    param_name,
+    param_value_size,
+    param_value,
+    param_value_size_ret
+  );
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clRetainEvent_(cl_event  event) CL_API_SUFFIX__VERSION_1_0
+_clGetKernelWorkGroupInfo_(cl_kernel                   kernel ,
+                           cl_device_id                device ,
+                           cl_kernel_work_group_info   param_name ,
+                           size_t                      param_value_size ,
+                           void *                      param_value ,
+                           size_t *                    param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
 {
-  return clRetainEvent(event->event);
+  return clGetKernelWorkGroupInfo(
+    kernel->kernel,
+    device->device,
+    param_name,
+    param_value_size,
+    param_value,
+    param_value_size_ret
+  );
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clReleaseEvent_(cl_event  event) CL_API_SUFFIX__VERSION_1_0
+// States of the event status mirror
+#define MIRROR_NONE          0
+#define MIRROR_REGISTERING   1
+#define MIRROR_TERMINAL_ONLY 2
+#define MIRROR_ALL           3
+
+// Utility function to create a wrapper object for an event
+cl_event createEvent(cl_context context,
+                     cl_command_queue queue,
+                     cl_command_queue _queue,
+                     cl_event _event)
 {
-  return clReleaseEvent(event->event);
+  cl_event event = malloc(sizeof(struct _cl_event));
+  event->dispatch = context->dispatch;
+  event->event = _event;
+  event->context = context;
+  event->queue = queue;
+  event->submitQueue = _queue;
+  event->status = CL_QUEUED;
+  event->mirror = MIRROR_NONE;
+  event->profilingCached = CL_FALSE;
+  event->pendingQueue = NULL;
+  event->pendingRefs = 0;
+  event->commandType = 0;
+  return event;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clSetUserEventStatus_(cl_event    event ,
-                       cl_int      execution_status) CL_API_SUFFIX__VERSION_1_1
+// Utility function to check whether a command needs a real event even if
+// the application did not ask for one
+cl_bool needsEvent(cl_command_queue queue)
 {
-  return clSetUserEventStatus(event->event, execution_status);
+  return queue->trackInFlight || queue->trackResidency ||
+         queue->perThread || queue->lane || queue->inferDeps;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clSetEventCallback_(cl_event     event ,
-                     cl_int       command_exec_callback_type ,
-                     void (CL_CALLBACK *  pfn_notify)(cl_event, cl_int, void *),
-                     void *       user_data) CL_API_SUFFIX__VERSION_1_1
+// Region of a buffer whose real mapping is kept alive after being unmapped
+struct mappedRegion
 {
-  return clSetEventCallback(
+  size_t offset;
+  size_t size;
+  cl_map_flags flags;
+  void *ptr;
+  cl_uint maps;
+  cl_command_queue _queue;
+  struct mappedRegion *next;
+};
+static pthread_mutex_t m_mapLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Utility function to reduce map flags to the accesses they allow
+cl_map_flags getMapAccess(cl_map_flags flags)
+{
+  cl_map_flags access = flags & (CL_MAP_READ | CL_MAP_WRITE);
+  if (flags & CL_MAP_WRITE_INVALIDATE_REGION)
+  {
+    access |= CL_MAP_WRITE;
+  }
+  return access;
+}
+
+// Utility function to find a cached mapping covering a region
+// The mapping is counted as mapped again if one is found
+void* findMapping(cl_mem mem, cl_map_flags flags, size_t offset, size_t cb)
+{
+  if (!mem->mapCache)
+  {
+    return NULL;
+  }
+
+  void *ptr = NULL;
+  cl_map_flags access = getMapAccess(flags);
+  pthread_mutex_lock(&m_mapLock);
+  for (struct mappedRegion *region = mem->mapCache; region;
+       region = region->next)
+  {
+    if (offset >= region->offset &&
+        offset + cb <= region->offset + region->size &&
+        (access & region->flags) == access)
+    {
+      region->maps++;
+      ptr = (char*)region->ptr + (offset - region->offset);
+      break;
+    }
+  }
+  pthread_mutex_unlock(&m_mapLock);
+  return ptr;
+}
+
+// Utility function to add a real mapping to the cache of a buffer
+void addMapping(cl_mem mem, cl_command_queue _queue, cl_map_flags flags,
+                size_t offset, size_t cb, void *ptr)
+{
+  struct mappedRegion *region = malloc(sizeof(struct mappedRegion));
+  region->offset = offset;
+  region->size = cb;
+  region->flags = getMapAccess(flags);
+  region->ptr = ptr;
+  region->maps = 1;
+  region->_queue = _queue;
+
+  pthread_mutex_lock(&m_mapLock);
+  region->next = mem->mapCache;
+  mem->mapCache = region;
+  pthread_mutex_unlock(&m_mapLock);
+}
+
+// Utility function to unmap a cached mapping without a real unmap
+// Returns CL_FALSE if the pointer does not belong to a cached mapping
+cl_bool unmapCached(cl_mem mem, void *ptr)
+{
+  if (!mem->mapCache)
+  {
+    return CL_FALSE;
+  }
+
+  cl_bool found = CL_FALSE;
+  pthread_mutex_lock(&m_mapLock);
+  for (struct mappedRegion *region = mem->mapCache; region;
+       region = region->next)
+  {
+    if ((char*)ptr >= (char*)region->ptr &&
+        (char*)ptr < (char*)region->ptr + region->size && region->maps)
+    {
+      region->maps--;
+      found = CL_TRUE;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&m_mapLock);
+  return found;
+}
+
+// Utility function to find the buffer that owns a sub-buffer's memory
+static cl_mem getRootBuffer(cl_mem buffer)
+{
+  while (buffer->parent)
+  {
+    buffer = buffer->parent;
+  }
+  return buffer;
+}
+
+// Utility function to order a use of a memory object on another queue after
+// a prefetch migration that is still running
+void waitForPrefetch(cl_mem mem, cl_command_queue _queue)
+{
+  pthread_mutex_lock(&m_residencyLock);
+  cl_event _prefetch = mem->prefetch;
+  if (!_prefetch || mem->_prefetchQueue == _queue)
+  {
+    pthread_mutex_unlock(&m_residencyLock);
+    return;
+  }
+  cl_int status = CL_QUEUED;
+  clGetEventInfo(_prefetch, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                 sizeof(cl_int), &status, NULL);
+  if (status <= CL_COMPLETE)
+  {
+    // Nothing left to wait for
+    mem->prefetch = NULL;
+    mem->_prefetchQueue = NULL;
+    pthread_mutex_unlock(&m_residencyLock);
+    clReleaseEvent(_prefetch);
+    return;
+  }
+  clRetainEvent(_prefetch);
+  pthread_mutex_unlock(&m_residencyLock);
+
+  if (clEnqueueBarrierWithWaitList(_queue, 1, &_prefetch, NULL) != CL_SUCCESS)
+  {
+    clWaitForEvents(1, &_prefetch);
+  }
+  clReleaseEvent(_prefetch);
+}
+
+// Utility function to really unmap the cached mappings of a memory object
+// before the device uses it. Mappings still held by the application are
+// left alone. If no queue is given, each mapping is unmapped on the queue
+// it was created on.
+void releaseMappings(cl_mem mem, cl_command_queue _queue)
+{
+  // Count every use, so prefetching can tell if it missed one
+  __atomic_add_fetch(&mem->useCount, 1, __ATOMIC_RELAXED);
+
+  // Uses on other queues must not race with a prefetch
+  if (_queue && mem->prefetch)
+  {
+    waitForPrefetch(mem, _queue);
+  }
+
+  if (mem->mapCache)
+  {
+    struct mappedRegion *idle = NULL;
+    pthread_mutex_lock(&m_mapLock);
+    struct mappedRegion **prev = &mem->mapCache;
+    while (*prev)
+    {
+      struct mappedRegion *region = *prev;
+      if (region->maps)
+      {
+        prev = &region->next;
+        continue;
+      }
+      *prev = region->next;
+      region->next = idle;
+      idle = region;
+    }
+    pthread_mutex_unlock(&m_mapLock);
+
+    while (idle)
+    {
+      struct mappedRegion *next = idle->next;
+      clEnqueueUnmapMemObject(_queue ? _queue : idle->_queue,
+                              mem->mem, idle->ptr, 0, NULL, NULL);
+      free(idle);
+      idle = next;
+    }
+  }
+
+  // Memory objects can be used through the objects they alias
+  if (mem->parent)
+  {
+    releaseMappings(mem->parent, _queue);
+  }
+  if (mem->imgBuffer)
+  {
+    releaseMappings(mem->imgBuffer, _queue);
+  }
+}
+
+// Utility function to release cached mappings of kernel arguments
+void releaseKernelMappings(cl_kernel kernel, cl_command_queue _queue)
+{
+  for (cl_uint i = 0; i < kernel->numArgs; i++)
+  {
+    if (kernel->args[i].mem)
+    {
+      releaseMappings(kernel->args[i].mem, _queue);
+    }
+  }
+}
+
+// Utility function to record that a memory object now lives on a device,
+// and which command used it last
+void setResidency(cl_mem mem, cl_device_id device, cl_event _event)
+{
+  cl_mem root = getRootBuffer(mem);
+  clRetainEvent(_event);
+  pthread_mutex_lock(&m_residencyLock);
+  cl_event _old = mem->lastUse;
+  mem->device = device;
+  mem->lastUse = _event;
+  mem->trackedUse = __atomic_load_n(&root->useCount, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&m_residencyLock);
+  if (_old)
+  {
+    clReleaseEvent(_old);
+  }
+}
+
+// Utility function to update residency after a kernel launch, and remember
+// the queue the kernel's next arguments should be prefetched to
+void updateResidency(cl_command_queue queue,
+                     cl_kernel kernel,
+                     cl_int err,
+                     cl_event *_event)
+{
+  if (!queue->trackResidency || err != CL_SUCCESS)
+  {
+    return;
+  }
+
+  for (cl_uint i = 0; i < kernel->numArgs; i++)
+  {
+    if (kernel->args[i].mem)
+    {
+      setResidency(kernel->args[i].mem, queue->device, *_event);
+    }
+  }
+
+  // Keep the real queue alive while the kernel may prefetch to it
+  pthread_mutex_lock(&m_residencyLock);
+  cl_command_queue _old = NULL;
+  if (kernel->queue != queue)
+  {
+    _old = kernel->_queue;
+    clRetainCommandQueue(queue->queue);
+    kernel->_queue = queue->queue;
+    kernel->queue = queue;
+  }
+  pthread_mutex_unlock(&m_residencyLock);
+  if (_old)
+  {
+    clReleaseCommandQueue(_old);
+  }
+}
+
+// Utility function to start migrating a buffer that was just bound to a
+// kernel to the device the kernel was last launched on. Only buffers whose
+// every use since the last recorded one is known are moved, and the
+// migration waits for that use to complete. Later uses of the buffer on
+// other queues wait for the migration.
+void prefetchMem(cl_kernel kernel, cl_mem mem)
+{
+  cl_mem root = getRootBuffer(mem);
+  pthread_mutex_lock(&m_residencyLock);
+  cl_command_queue queue = kernel->queue;
+  if (!queue || !mem->lastUse || mem->device == queue->device ||
+      mem->trackedUse != __atomic_load_n(&root->useCount, __ATOMIC_RELAXED) ||
+      mem->mapCache || root->mapCache)
+  {
+    pthread_mutex_unlock(&m_residencyLock);
+    return;
+  }
+
+  cl_event _wait = mem->lastUse;
+  cl_event _migrate;
+  cl_int err = clEnqueueMigrateMemObjects(kernel->_queue, 1, &mem->mem, 0,
+                                          1, &_wait, &_migrate);
+  cl_event _prefetch = NULL;
+  if (err == CL_SUCCESS)
+  {
+    mem->device = queue->device;
+    mem->lastUse = _migrate;
+    clRetainEvent(_migrate);
+    _prefetch = root->prefetch;
+    root->prefetch = _migrate;
+    root->_prefetchQueue = kernel->_queue;
+    clFlush(kernel->_queue);
+  }
+  pthread_mutex_unlock(&m_residencyLock);
+  if (err == CL_SUCCESS)
+  {
+    clReleaseEvent(_wait);
+  }
+  if (_prefetch)
+  {
+    clReleaseEvent(_prefetch);
+  }
+}
+
+// Maximum number of buffers a write batch can hold at once
+#define MAX_WRITE_TARGETS 8
+
+// Number of unbound wrapper events, which are resolved before use
+static cl_uint m_pendingEvents = 0;
+
+// Kernel that copies combined writes from a staging buffer to their
+// destinations. Each work-group handles one record of the table.
+static const char *m_scatterSource =
+"__kernel void oiw_scatter(__global uchar *dst,\n"
+"                          __global const uchar *staging,\n"
+"                          ulong table, ulong data)\n"
+"{\n"
+"  __global const ulong *record =\n"
+"    (__global const ulong*)(staging + table) + 3*get_group_id(0);\n"
+"  __global const uchar *src = staging + data + record[1];\n"
+"  for (ulong i = get_local_id(0); i < record[2]; i += get_local_size(0))\n"
+"    dst[record[0] + i] = src[i];\n"
+"}\n";
+static pthread_mutex_t m_scatterLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Small write held back to be combined with others
+struct writeRecord
+{
+  cl_ulong dst;
+  cl_ulong src;
+  cl_ulong size;
+};
+
+// Buffer targeted by combined writes
+struct writeTarget
+{
+  cl_mem mem;
+  struct writeRecord *records;
+  cl_uint numRecords;
+  cl_uint maxRecords;
+};
+
+// Writes held back by a queue until a command could observe them
+struct writeBatch
+{
+  struct writeTarget targets[MAX_WRITE_TARGETS];
+  cl_uint numTargets;
+  unsigned char *data;
+  size_t dataSize;
+  size_t maxData;
+  cl_event *events;
+  cl_uint numEvents;
+  cl_uint maxEvents;
+};
+
+// Utility function to create the kernel used to scatter combined writes
+cl_bool createScatterKernel(cl_command_queue queue)
+{
+  cl_context context = queue->context;
+  cl_int err = CL_SUCCESS;
+
+  pthread_mutex_lock(&m_scatterLock);
+  if (!context->scatterProgram)
+  {
+    cl_program _program = clCreateProgramWithSource(
+      context->context, 1, &m_scatterSource, NULL, &err);
+    if (err == CL_SUCCESS)
+    {
+      err = clBuildProgram(_program, 0, NULL, "", NULL, NULL);
+      if (err == CL_SUCCESS)
+      {
+        context->scatterProgram = _program;
+      }
+      else
+      {
+        clReleaseProgram(_program);
+      }
+    }
+  }
+  pthread_mutex_unlock(&m_scatterLock);
+
+  if (context->scatterProgram)
+  {
+    queue->scatterKernel =
+      clCreateKernel(context->scatterProgram, "oiw_scatter", &err);
+  }
+  if (!queue->scatterKernel)
+  {
+    return CL_FALSE;
+  }
+
+  // Use up to 64 work-items per record
+  size_t width = 64;
+  if (clGetKernelWorkGroupInfo(queue->scatterKernel, queue->device->device,
+                               CL_KERNEL_WORK_GROUP_SIZE, sizeof(size_t),
+                               &width, NULL) != CL_SUCCESS || width > 64)
+  {
+    width = 64;
+  }
+  queue->scatterWidth = width;
+  return CL_TRUE;
+}
+
+// Utility function to bind an unbound wrapper event to a real event
+// Must be called with the batch lock of the event's queue held
+void bindEvent(cl_event event, cl_event _event)
+{
+  for (cl_int r = 0; r < 1 + event->pendingRefs; r++)
+  {
+    clRetainEvent(_event);
+  }
+  __atomic_store_n(&event->event, _event, __ATOMIC_RELEASE);
+  __atomic_sub_fetch(&m_pendingEvents, 1, __ATOMIC_ACQ_REL);
+}
+
+// Utility function to create an unbound wrapper event for a command that
+// is held back. The event reports the type of the original command, since
+// it is later bound to the event of a combined one.
+cl_event createPendingEvent(cl_command_queue queue, cl_command_type type)
+{
+  cl_event event = createEvent(queue->context, queue, queue->queue, NULL);
+  event->pendingQueue = queue;
+  event->commandType = type;
+  __atomic_add_fetch(&m_pendingEvents, 1, __ATOMIC_ACQ_REL);
+  return event;
+}
+
+// Utility function to create an event that reports a failed submission
+cl_event createFailedEvent(cl_command_queue queue, cl_int err)
+{
+  cl_event _event = clCreateUserEvent(queue->context->context, NULL);
+  clSetUserEventStatus(_event, err);
+  return _event;
+}
+
+// Callback to free the host copy of a write batch once the writes made
+// directly from it have completed
+void CL_CALLBACK freeBatchCopy(cl_event _event,
+                               cl_int status,
+                               void *user_data)
+{
+  free(user_data);
+}
+
+// Utility function to submit the writes held back by a queue
+// Must be called with the batch lock held
+void submitWriteBatch(cl_command_queue queue)
+{
+  struct writeBatch *batch = queue->batch;
+  if (!batch || !batch->numTargets)
+  {
+    return;
+  }
+
+  // Build staging buffer: record tables followed by data
+  cl_uint numRecords = 0;
+  for (cl_uint t = 0; t < batch->numTargets; t++)
+  {
+    numRecords += batch->targets[t].numRecords;
+  }
+  size_t tableSize = numRecords*sizeof(struct writeRecord);
+  unsigned char *host = malloc(tableSize + batch->dataSize);
+  size_t offset = 0;
+  for (cl_uint t = 0; t < batch->numTargets; t++)
+  {
+    size_t size = batch->targets[t].numRecords*sizeof(struct writeRecord);
+    memcpy(host + offset, batch->targets[t].records, size);
+    offset += size;
+  }
+  memcpy(host + tableSize, batch->data, batch->dataSize);
+
+  cl_int err;
+  cl_mem _staging = clCreateBuffer(
+    queue->context->context,
+    CL_MEM_READ_ONLY | CL_MEM_COPY_HOST_PTR,
+    tableSize + batch->dataSize,
+    host,
+    &err
+  );
+
+  // Scatter the writes to each buffer. The queue is in order, so the last
+  // command of the batch completes after all the others.
+  cl_int scatterErr = err;
+  cl_bool direct = CL_FALSE;
+  cl_event _last = NULL;
+  err = CL_SUCCESS;
+  cl_ulong table = 0;
+  cl_ulong data = tableSize;
+  for (cl_uint t = 0; t < batch->numTargets; t++)
+  {
+    struct writeTarget *target = batch->targets + t;
+    cl_event _target = NULL;
+    if (scatterErr == CL_SUCCESS)
+    {
+      clSetKernelArg(queue->scatterKernel, 0, sizeof(cl_mem),
+                     &target->mem->mem);
+      clSetKernelArg(queue->scatterKernel, 1, sizeof(cl_mem), &_staging);
+      clSetKernelArg(queue->scatterKernel, 2, sizeof(cl_ulong), &table);
+      clSetKernelArg(queue->scatterKernel, 3, sizeof(cl_ulong), &data);
+      size_t global = target->numRecords*queue->scatterWidth;
+      scatterErr = clEnqueueNDRangeKernel(
+        queue->queue,
+        queue->scatterKernel,
+        1,
+        NULL,
+        &global,
+        &queue->scatterWidth,
+        0,
+        NULL,
+        &_target
+      );
+    }
+    if (scatterErr != CL_SUCCESS)
+    {
+      // Fall back to non-blocking writes from the host copy of the batch,
+      // merging records that are adjacent in both the data and the buffer
+      direct = CL_TRUE;
+      cl_uint r = 0;
+      while (r < target->numRecords && err == CL_SUCCESS)
+      {
+        struct writeRecord *record = target->records + r;
+        cl_ulong size = record->size;
+        for (r++; r < target->numRecords; r++)
+        {
+          struct writeRecord *next = target->records + r;
+          if (next->dst != record->dst + size ||
+              next->src != record->src + size)
+          {
+            break;
+          }
+          size += next->size;
+        }
+
+        if (_target)
+        {
+          clReleaseEvent(_target);
+          _target = NULL;
+        }
+        err = clEnqueueWriteBuffer(
+          queue->queue,
+          target->mem->mem,
+          CL_FALSE,
+          record->dst,
+          size,
+          host + tableSize + record->src,
+          0,
+          NULL,
+          &_target
+        );
+      }
+    }
+    if (_target)
+    {
+      if (_last)
+      {
+        clReleaseEvent(_last);
+      }
+      _last = _target;
+    }
+    table += target->numRecords*sizeof(struct writeRecord);
+    clReleaseMemObject(target->mem->mem);
+    target->numRecords = 0;
+  }
+  if (_staging)
+  {
+    clReleaseMemObject(_staging);
+  }
+
+  // The host copy is only needed until the direct writes have completed
+  if (!direct || !_last ||
+      clSetEventCallback(_last, CL_COMPLETE, freeBatchCopy, host) !=
+        CL_SUCCESS)
+  {
+    if (direct && _last)
+    {
+      clWaitForEvents(1, &_last);
+    }
+    free(host);
+  }
+
+  // Bind the wrapper events of the writes to the last command of the batch
+  if (batch->numEvents)
+  {
+    if (err != CL_SUCCESS || !_last)
+    {
+      // Report the failure through the events instead
+      if (_last)
+      {
+        clReleaseEvent(_last);
+      }
+      _last = createFailedEvent(queue, err != CL_SUCCESS ? err : scatterErr);
+    }
+
+    for (cl_uint i = 0; i < batch->numEvents; i++)
+    {
+      bindEvent(batch->events[i], _last);
+    }
+  }
+  if (_last)
+  {
+    clReleaseEvent(_last);
+  }
+
+  batch->numTargets = 0;
+  batch->dataSize = 0;
+  batch->numEvents = 0;
+  __atomic_store_n(&queue->pendingCommands, 0, __ATOMIC_RELEASE);
+}
+
+// Run of launches of one kernel over adjacent ranges, held back so that
+// they can be submitted as a single launch
+struct launchRun
+{
+  cl_kernel kernel;
+  cl_uint workDim;
+  cl_uint mergeDim;
+  size_t offset[3];
+  size_t size[3];
+  size_t local[3];
+  cl_bool hasLocal;
+  cl_mem *mems;
+  cl_uint numMems;
+  cl_event *events;
+  cl_uint numLaunches;
+  cl_uint numEvents;
+};
+
+// Utility function to submit the launches held back by a queue
+// Must be called with the batch lock held
+void submitLaunchRun(cl_command_queue queue)
+{
+  struct launchRun *run = queue->launches;
+  if (!run || !run->numLaunches)
+  {
+    return;
+  }
+  cl_kernel kernel = run->kernel;
+
+  cl_event *_event = NULL;
+  if (run->numEvents || needsEvent(queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  cl_uint numAccesses;
+  struct memAccess *accesses = getKernelAccesses(queue, kernel, &numAccesses);
+  cl_uint numWait = 0;
+  cl_event *_wait_list =
+    inferDependencies(queue, numAccesses, accesses, &numWait, NULL);
+
+  // Choose a local size for the combined launch if none was given
+  size_t tunedLocal[3];
+  struct tuneSample *sample = NULL;
+  const size_t *local = run->hasLocal ? run->local : NULL;
+  if (!local && m_autotuneLaunches)
+  {
+    local = selectLocalSize(queue, kernel, run->workDim, run->size,
+                            tunedLocal, &sample);
+    if (sample && !_event)
+    {
+      _event = malloc(sizeof(cl_event));
+    }
+  }
+
+  cl_int err = clEnqueueNDRangeKernel(
+    queue->queue,
+    kernel->kernel,
+    run->workDim,
+    run->offset,
+    run->size,
+    local,
+    numWait,
+    _wait_list,
+    _event
+  );
+  if (err != CL_SUCCESS && local && !run->hasLocal)
+  {
+    if (sample)
+    {
+      recordTuneSample(NULL, err, sample);
+      sample = NULL;
+    }
+    err = clEnqueueNDRangeKernel(queue->queue, kernel->kernel, run->workDim,
+                                 run->offset, run->size, NULL,
+                                 numWait, _wait_list, _event);
+  }
+  free(_wait_list);
+  if (sample)
+  {
+    if (err == CL_SUCCESS)
+    {
+      clSetEventCallback(*_event, CL_COMPLETE, recordTuneSample, sample);
+    }
+    else
+    {
+      recordTuneSample(NULL, err, sample);
+    }
+  }
+
+  // The arguments cannot have changed while held, so the kernel still
+  // describes the memory the combined launch uses
+  updateResidency(queue, kernel, err, _event);
+  recordAccesses(queue, queue->queue, numAccesses, accesses, err, _event);
+  free(accesses);
+
+  // Each launch the combined one stands for was admitted separately
+  if (queue->trackInFlight)
+  {
+    for (cl_uint i = 0; i < run->numLaunches; i++)
+    {
+      if (err == CL_SUCCESS)
+      {
+        clSetEventCallback(*_event, CL_COMPLETE, commandComplete, queue);
+      }
+      else
+      {
+        commandComplete(NULL, err, queue);
+      }
+    }
+  }
+
+  __atomic_store_n(&kernel->heldQueue, NULL, __ATOMIC_RELEASE);
+  clReleaseKernel(kernel->kernel);
+  for (cl_uint i = 0; i < run->numMems; i++)
+  {
+    clReleaseMemObject(run->mems[i]->mem);
+  }
+
+  // Give each launch its own wrapper event for the combined launch
+  if (run->numEvents)
+  {
+    cl_event _bound =
+      err == CL_SUCCESS ? *_event : createFailedEvent(queue, err);
+    for (cl_uint i = 0; i < run->numLaunches; i++)
+    {
+      if (run->events[i])
+      {
+        bindEvent(run->events[i], _bound);
+      }
+    }
+    clReleaseEvent(_bound);
+  }
+  else if (_event && err == CL_SUCCESS)
+  {
+    clReleaseEvent(*_event);
+  }
+  free(_event);
+
+  run->numLaunches = 0;
+  run->numEvents = 0;
+  run->numMems = 0;
+  __atomic_store_n(&queue->pendingCommands, 0, __ATOMIC_RELEASE);
+}
+
+// Part of a coalesced transfer
+struct transferPiece
+{
+  size_t offset;
+  size_t size;
+  void *ptr;
+  cl_event event;
+};
+
+// Run of adjacent reads or copies held back so that they can be submitted
+// as a single transfer
+struct transferRun
+{
+  cl_command_type type;
+  cl_mem src;
+  cl_mem dst;
+  size_t srcOffset;
+  size_t dstOffset;
+  size_t size;
+  size_t maxPiece;
+  void *ptr;
+  struct transferPiece *pieces;
+  cl_uint numPieces;
+  cl_uint numEvents;
+};
+
+// Host copies to perform once a coalesced read has completed
+struct splitRead
+{
+  unsigned char *data;
+  size_t offset;
+  struct transferPiece *pieces;
+  cl_uint numPieces;
+  cl_event _user;
+};
+
+// Callback to split a coalesced read into its destinations, run by the
+// callback dispatcher
+void CL_CALLBACK completeSplitRead(cl_event _event,
+                                   cl_int status,
+                                   void *user_data)
+{
+  struct splitRead *split = user_data;
+  if (status == CL_COMPLETE)
+  {
+    for (cl_uint i = 0; i < split->numPieces; i++)
+    {
+      struct transferPiece *piece = split->pieces + i;
+      memcpy(piece->ptr,
+             split->data + piece->offset - split->offset,
+             piece->size);
+    }
+  }
+  clSetUserEventStatus(split->_user, status < 0 ? status : CL_COMPLETE);
+  clReleaseEvent(split->_user);
+  free(split->pieces);
+  free(split->data);
+  free(split);
+}
+
+// Utility function to submit the transfer run held back by a queue
+// Must be called with the batch lock held
+void submitTransferRun(cl_command_queue queue)
+{
+  struct transferRun *run = queue->run;
+  if (!run || !run->numPieces)
+  {
+    return;
+  }
+
+  cl_int err;
+  cl_event _event = NULL;
+  cl_event *_eventp = run->numEvents ? &_event : NULL;
+  if (run->type == CL_COMMAND_COPY_BUFFER)
+  {
+    err = clEnqueueCopyBuffer(
+      queue->queue,
+      run->src->mem,
+      run->dst->mem,
+      run->srcOffset,
+      run->dstOffset,
+      run->size,
+      0,
+      NULL,
+      _eventp
+    );
+    clReleaseMemObject(run->dst->mem);
+  }
+  else if (run->ptr)
+  {
+    // Destinations are contiguous, so read straight into them
+    err = clEnqueueReadBuffer(
+      queue->queue,
+      run->src->mem,
+      CL_FALSE,
+      run->srcOffset,
+      run->size,
+      run->ptr,
+      0,
+      NULL,
+      _eventp
+    );
+  }
+  else
+  {
+    // Read into a temporary buffer and copy out the pieces afterwards.
+    // Later commands must not start before the copies are done, so the
+    // queue gets a marker that waits on a user event set once they are.
+    struct splitRead *split = malloc(sizeof(struct splitRead));
+    split->data = malloc(run->size);
+    split->offset = run->srcOffset;
+    split->numPieces = run->numPieces;
+    split->pieces = malloc(run->numPieces*sizeof(struct transferPiece));
+    memcpy(split->pieces, run->pieces,
+           run->numPieces*sizeof(struct transferPiece));
+    split->_user = clCreateUserEvent(queue->context->context, &err);
+
+    cl_event _read = NULL;
+    if (err == CL_SUCCESS)
+    {
+      err = clEnqueueReadBuffer(
+        queue->queue,
+        run->src->mem,
+        CL_FALSE,
+        run->srcOffset,
+        run->size,
+        split->data,
+        0,
+        NULL,
+        &_read
+      );
+    }
+    if (err == CL_SUCCESS)
+    {
+      cl_event _user = split->_user;
+      clRetainEvent(_user);
+      struct callbackJob *job = createCallbackJob(
+        CALLBACK_INTERNAL, _read, completeSplitRead, split, 1);
+      if (clSetEventCallback(_read, CL_COMPLETE,
+                             dispatchEventCallback, job) != CL_SUCCESS)
+      {
+        // Copy the pieces out here instead
+        free(job);
+        cl_int status = clWaitForEvents(1, &_read);
+        completeSplitRead(_read, status == CL_SUCCESS ? CL_COMPLETE : status,
+                          split);
+      }
+      clReleaseEvent(_read);
+
+      // The events of the reads complete with the marker
+      if (clEnqueueMarkerWithWaitList(queue->queue, 1, &_user, &_event)
+          == CL_SUCCESS)
+      {
+        clReleaseEvent(_user);
+      }
+      else
+      {
+        // Later commands must still not start before the copies are done
+        clFlush(queue->queue);
+        clWaitForEvents(1, &_user);
+        _event = _user;
+      }
+    }
+    else
+    {
+      if (split->_user)
+      {
+        clReleaseEvent(split->_user);
+      }
+      free(split->pieces);
+      free(split->data);
+      free(split);
+    }
+  }
+  clReleaseMemObject(run->src->mem);
+
+  // Give each command its own wrapper event for the combined transfer
+  if (run->numEvents)
+  {
+    if (!_event)
+    {
+      _event = createFailedEvent(queue, err);
+    }
+    for (cl_uint i = 0; i < run->numPieces; i++)
+    {
+      if (run->pieces[i].event)
+      {
+        bindEvent(run->pieces[i].event, _event);
+      }
+    }
+  }
+  if (_event)
+  {
+    clReleaseEvent(_event);
+  }
+
+  run->numPieces = 0;
+  run->numEvents = 0;
+  __atomic_store_n(&queue->pendingCommands, 0, __ATOMIC_RELEASE);
+}
+
+void flushPending(cl_command_queue queue)
+{
+  if (!__atomic_load_n(&queue->pendingCommands, __ATOMIC_ACQUIRE))
+  {
+    return;
+  }
+  pthread_mutex_lock(&queue->batchLock);
+  submitWriteBatch(queue);
+  submitTransferRun(queue);
+  submitLaunchRun(queue);
+  pthread_mutex_unlock(&queue->batchLock);
+}
+
+// Utility function to hold back a read or copy so that it can be merged
+// with adjacent ones. Returns CL_FALSE if it must be submitted normally.
+cl_bool coalesceTransfer(cl_command_queue queue,
+                         cl_command_type type,
+                         cl_mem src,
+                         cl_mem dst,
+                         cl_bool blocking,
+                         size_t src_offset,
+                         size_t dst_offset,
+                         size_t cb,
+                         void *ptr,
+                         cl_uint num_events,
+                         cl_event *event)
+{
+  if (!queue->combineTransfers || blocking || num_events || queue->graph ||
+      !cb || src->context != queue->context ||
+      src_offset >= src->size || cb > src->size - src_offset)
+  {
+    return CL_FALSE;
+  }
+  if (type == CL_COMMAND_READ_BUFFER && !ptr)
+  {
+    return CL_FALSE;
+  }
+  if (type == CL_COMMAND_COPY_BUFFER &&
+      (src == dst || dst->context != queue->context ||
+       dst_offset >= dst->size || cb > dst->size - dst_offset))
+  {
+    return CL_FALSE;
+  }
+
+  releaseMappings(src, queue->queue);
+  if (dst)
+  {
+    releaseMappings(dst, queue->queue);
+  }
+
+  pthread_mutex_lock(&queue->batchLock);
+
+  // Held back writes and launches come first
+  submitWriteBatch(queue);
+  submitLaunchRun(queue);
+
+  if (!queue->run)
+  {
+    queue->run = calloc(1, sizeof(struct transferRun));
+    queue->run->pieces =
+      malloc(m_coalesceWindow*sizeof(struct transferPiece));
+  }
+  struct transferRun *run = queue->run;
+
+  // Check whether this command continues the current run
+  cl_bool merge = CL_FALSE;
+  if (run->numPieces && run->numPieces < m_coalesceWindow &&
+      run->type == type && run->src == src)
+  {
+    size_t end = run->srcOffset + run->size;
+    if (type == CL_COMMAND_COPY_BUFFER)
+    {
+      merge = run->dst == dst && src_offset == end &&
+              dst_offset == run->dstOffset + run->size;
+    }
+    else if (run->ptr && src_offset == end &&
+             (char*)ptr == (char*)run->ptr + run->size)
+    {
+      merge = CL_TRUE;
+    }
+    else
+    {
+      // Reads to unrelated destinations are split up on the host, which
+      // is only worthwhile for small pieces
+      merge = src_offset >= run->srcOffset && src_offset <= end &&
+              cb <= m_coalesceSplitSize &&
+              run->maxPiece <= m_coalesceSplitSize;
+      if (merge)
+      {
+        run->ptr = NULL;
+      }
+    }
+  }
+
+  if (merge)
+  {
+    size_t end = src_offset + cb;
+    if (end > run->srcOffset + run->size)
+    {
+      run->size = end - run->srcOffset;
+    }
+    if (cb > run->maxPiece)
+    {
+      run->maxPiece = cb;
+    }
+  }
+  else
+  {
+    submitTransferRun(queue);
+    run->type = type;
+    run->src = src;
+    run->dst = dst;
+    run->srcOffset = src_offset;
+    run->dstOffset = dst_offset;
+    run->size = cb;
+    run->maxPiece = cb;
+    run->ptr = ptr;
+    clRetainMemObject(src->mem);
+    if (type == CL_COMMAND_COPY_BUFFER)
+    {
+      clRetainMemObject(dst->mem);
+    }
+  }
+
+  struct transferPiece *piece = run->pieces + run->numPieces++;
+  piece->offset = src_offset;
+  piece->size = cb;
+  piece->ptr = ptr;
+  piece->event = NULL;
+  if (event)
+  {
+    *event = createPendingEvent(queue, type);
+    piece->event = *event;
+    run->numEvents++;
+  }
+
+  __atomic_store_n(&queue->pendingCommands, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&queue->batchLock);
+  return CL_TRUE;
+}
+
+// Utility function to make sure an event is bound to a real event
+void resolveEvent(cl_event event)
+{
+  if (!__atomic_load_n(&event->event, __ATOMIC_ACQUIRE))
+  {
+    flushPending(event->pendingQueue);
+  }
+}
+
+// Utility function to hold back a small write so that it can be combined
+// with others. Returns CL_FALSE if the write must be submitted normally.
+cl_bool combineWrite(cl_command_queue queue,
+                     cl_mem buffer,
+                     cl_bool blocking,
+                     size_t offset,
+                     size_t cb,
+                     const void *ptr,
+                     cl_uint num_events,
+                     cl_event *event)
+{
+  if (!queue->combineWrites || blocking || num_events || queue->graph ||
+      !ptr || !cb || cb > m_writeCombineSize ||
+      buffer->context != queue->context ||
+      offset >= buffer->size || cb > buffer->size - offset)
+  {
+    return CL_FALSE;
+  }
+
+  // Combined writes reach the buffer through a kernel, which may not write
+  // to buffers the device can only read. Writes the host may not make are
+  // left for the implementation to reject.
+  cl_mem_flags flags = buffer->flags | getRootBuffer(buffer)->flags;
+  if (flags & (CL_MEM_READ_ONLY | CL_MEM_HOST_READ_ONLY |
+               CL_MEM_HOST_NO_ACCESS))
+  {
+    return CL_FALSE;
+  }
+
+  releaseMappings(buffer, queue->queue);
+
+  pthread_mutex_lock(&queue->batchLock);
+  if (!queue->scatterKernel && !createScatterKernel(queue))
+  {
+    queue->combineWrites = CL_FALSE;
+    pthread_mutex_unlock(&queue->batchLock);
+    return CL_FALSE;
+  }
+  if (!queue->batch)
+  {
+    queue->batch = calloc(1, sizeof(struct writeBatch));
+  }
+  struct writeBatch *batch = queue->batch;
+
+  // Held back reads, copies and launches come first
+  submitTransferRun(queue);
+  submitLaunchRun(queue);
+
+  if (batch->dataSize + cb > m_writeCombineBatch)
+  {
+    submitWriteBatch(queue);
+  }
+
+  // Find the target for this buffer
+  struct writeTarget *target = NULL;
+  for (cl_uint t = 0; t < batch->numTargets; t++)
+  {
+    if (batch->targets[t].mem == buffer)
+    {
+      target = batch->targets + t;
+
+      // Records of a target are scattered concurrently, so overlapping
+      // writes must go to separate batches
+      for (cl_uint r = 0; r < target->numRecords; r++)
+      {
+        struct writeRecord *record = target->records + r;
+        if (offset < record->dst + record->size &&
+            record->dst < offset + cb)
+        {
+          submitWriteBatch(queue);
+          target = NULL;
+          break;
+        }
+      }
+      break;
+    }
+  }
+  if (!target)
+  {
+    if (batch->numTargets == MAX_WRITE_TARGETS)
+    {
+      submitWriteBatch(queue);
+    }
+    target = batch->targets + batch->numTargets++;
+    target->mem = buffer;
+    clRetainMemObject(buffer->mem);
+  }
+
+  // Copy data to host staging area
+  if (batch->dataSize + cb > batch->maxData)
+  {
+    batch->maxData = 2*(batch->dataSize + cb);
+    batch->data = realloc(batch->data, batch->maxData);
+  }
+  memcpy(batch->data + batch->dataSize, ptr, cb);
+
+  // Extend the previous record if this write continues it
+  struct writeRecord *last =
+    target->numRecords ? target->records + target->numRecords - 1 : NULL;
+  if (last && last->dst + last->size == offset &&
+      last->src + last->size == batch->dataSize)
+  {
+    last->size += cb;
+  }
+  else
+  {
+    if (target->numRecords == target->maxRecords)
+    {
+      target->maxRecords = target->maxRecords ? 2*target->maxRecords : 64;
+      target->records = realloc(target->records,
+        target->maxRecords*sizeof(struct writeRecord));
+    }
+    struct writeRecord *record = target->records + target->numRecords++;
+    record->dst = offset;
+    record->src = batch->dataSize;
+    record->size = cb;
+  }
+  batch->dataSize += cb;
+
+  // Create an unbound wrapper event, which is bound at submission
+  if (event)
+  {
+    if (batch->numEvents == batch->maxEvents)
+    {
+      batch->maxEvents = batch->maxEvents ? 2*batch->maxEvents : 64;
+      batch->events = realloc(batch->events,
+                              batch->maxEvents*sizeof(cl_event));
+    }
+    *event = createPendingEvent(queue, CL_COMMAND_WRITE_BUFFER);
+    batch->events[batch->numEvents++] = *event;
+  }
+
+  __atomic_store_n(&queue->pendingCommands, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&queue->batchLock);
+  return CL_TRUE;
+}
+
+// Callback to retire a command counted against the in-flight limit
+void CL_CALLBACK commandComplete(cl_event _event,
+                                 cl_int status,
+                                 void *user_data)
+{
+  cl_command_queue queue = user_data;
+  pthread_mutex_lock(&queue->lock);
+  if (queue->inFlight > 0)
+  {
+    queue->inFlight--;
+  }
+  pthread_cond_broadcast(&queue->cond);
+  pthread_mutex_unlock(&queue->lock);
+}
+
+// Utility function to apply backpressure once a queue has too many commands
+// in flight. On success the new command is counted as in flight. Tracking
+// stays enabled once a limit has been set, so that every counted command
+// is also retired. Must not be called with the batch lock held.
+cl_int throttleCommand(cl_command_queue queue)
+{
+  if (!queue->trackInFlight)
+  {
+    return CL_SUCCESS;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  if (queue->maxInFlight && queue->inFlight >= queue->maxInFlight)
+  {
+    queue->throttled++;
+    if (queue->backpressure == CL_BACKPRESSURE_ERROR_OIW)
+    {
+      pthread_mutex_unlock(&queue->lock);
+      return CL_COMMAND_QUEUE_FULL_OIW;
+    }
+
+    // Make sure the commands we are waiting for have been submitted,
+    // including any held back launches that were counted
+    pthread_mutex_unlock(&queue->lock);
+    flushPending(queue);
+    for (cl_uint i = 0; i < queue->numQueues; i++)
+    {
+      clFlush(queue->queues[i]);
+    }
+    pthread_mutex_lock(&queue->lock);
+
+    while (queue->maxInFlight && queue->inFlight >= queue->maxInFlight)
+    {
+      if (queue->backpressure == CL_BACKPRESSURE_SPIN_OIW)
+      {
+        pthread_mutex_unlock(&queue->lock);
+        cl_uint max = queue->maxInFlight;
+        while (__atomic_load_n(&queue->inFlight, __ATOMIC_ACQUIRE) >= max)
+        {
+          sched_yield();
+        }
+        pthread_mutex_lock(&queue->lock);
+      }
+      else
+      {
+        pthread_cond_wait(&queue->cond, &queue->lock);
+      }
+    }
+  }
+
+  // Update queue depth statistics
+  queue->inFlight++;
+  queue->commands++;
+  if (queue->inFlight > queue->peakInFlight)
+  {
+    queue->peakInFlight = queue->inFlight;
+  }
+  queue->meanInFlight += (queue->inFlight - queue->meanInFlight) / 64.0;
+  pthread_mutex_unlock(&queue->lock);
+
+  return CL_SUCCESS;
+}
+
+// Utility function to admit a command that is submitted immediately
+cl_int admitCommand(cl_command_queue queue)
+{
+  // Held back writes must execute before any later command
+  flushPending(queue);
+
+  return throttleCommand(queue);
+}
+
+// Command submitted to a queue with per-thread real queues. Commands from
+// other threads wait for it, through a user event if it has not been
+// submitted to its real queue yet.
+struct orderLink
+{
+  cl_command_queue _queue;
+  cl_event _event;
+  cl_event _gate;
+  cl_bool submitted;
+  cl_uint refs;
+};
+
+// Command this thread is in the middle of submitting
+static __thread struct orderLink *m_orderLink = NULL;
+
+// Utility function to drop a reference to an order link
+// Called with the queue's order lock held
+void releaseOrderLink(struct orderLink *link)
+{
+  if (--link->refs == 0)
+  {
+    if (link->_event)
+    {
+      clReleaseEvent(link->_event);
+    }
+    free(link);
+  }
+}
+
+// Callback to let commands from other threads go once a command completes
+void CL_CALLBACK openOrderGate(cl_event _event, cl_int status, void *user_data)
+{
+  cl_event _gate = user_data;
+  clSetUserEventStatus(_gate, status < 0 ? status : CL_COMPLETE);
+  clReleaseEvent(_gate);
+}
+
+// Utility function to find the calling thread's real queue, creating it
+// the first time a thread submits. Threads beyond the limit share.
+cl_command_queue getThreadQueue(cl_command_queue queue)
+{
+  pthread_t self = pthread_self();
+  cl_uint num = __atomic_load_n(&queue->numQueues, __ATOMIC_ACQUIRE);
+  for (cl_uint i = 0; i < num; i++)
+  {
+    if (pthread_equal(queue->threads[i], self))
+    {
+      return queue->queues[i];
+    }
+  }
+
+  pthread_mutex_lock(&queue->orderLock);
+  num = queue->numQueues;
+  cl_command_queue _queue = NULL;
+  if (num < queue->maxQueues)
+  {
+    cl_int err;
+    _queue = clCreateCommandQueue(queue->context->context,
+                                  queue->device->device,
+                                  getRealProperties(queue->properties),
+                                  &err);
+    if (err == CL_SUCCESS)
+    {
+      // Match the references the application holds on the other queues
+      cl_uint refs = __atomic_load_n(&queue->refCount, __ATOMIC_ACQUIRE);
+      for (cl_uint r = 1; r < refs; r++)
+      {
+        clRetainCommandQueue(_queue);
+      }
+      queue->queues[num] = _queue;
+      queue->threads[num] = self;
+      __atomic_store_n(&queue->numQueues, num + 1, __ATOMIC_RELEASE);
+    }
+    else
+    {
+      _queue = NULL;
+    }
+  }
+  if (!_queue)
+  {
+    _queue = queue->queues[(uintptr_t)self % num];
+  }
+  pthread_mutex_unlock(&queue->orderLock);
+  return _queue;
+}
+
+// Utility function to select the calling thread's real queue, and make it
+// wait for the previous command if that went to another real queue
+cl_command_queue selectThreadQueue(cl_command_queue queue)
+{
+  cl_command_queue _queue = getThreadQueue(queue);
+
+  struct orderLink *link = malloc(sizeof(struct orderLink));
+  link->_queue = _queue;
+  link->_event = NULL;
+  link->_gate = NULL;
+  link->submitted = CL_FALSE;
+  link->refs = 2;
+
+  cl_event _dep = NULL;
+  cl_command_queue _flush = NULL;
+  pthread_mutex_lock(&queue->orderLock);
+  struct orderLink *prev = queue->lastLink;
+  queue->lastLink = link;
+  if (prev && prev->_queue != _queue)
+  {
+    if (!prev->submitted && !prev->_gate)
+    {
+      cl_int err;
+      prev->_gate = clCreateUserEvent(queue->context->context, &err);
+      if (err != CL_SUCCESS)
+      {
+        prev->_gate = NULL;
+      }
+    }
+    while (!prev->submitted && !prev->_gate)
+    {
+      // Without a gate, wait for the other thread to submit
+      pthread_mutex_unlock(&queue->orderLock);
+      CPU_RELAX();
+      pthread_mutex_lock(&queue->orderLock);
+    }
+    _dep = prev->submitted ? prev->_event : prev->_gate;
+    if (_dep)
+    {
+      clRetainEvent(_dep);
+    }
+    if (prev->submitted)
+    {
+      _flush = prev->_queue;
+    }
+  }
+  if (prev)
+  {
+    releaseOrderLink(prev);
+  }
+  pthread_mutex_unlock(&queue->orderLock);
+
+  if (_dep)
+  {
+    clEnqueueBarrierWithWaitList(_queue, 1, &_dep, NULL);
+    clReleaseEvent(_dep);
+  }
+  if (_flush)
+  {
+    clFlush(_flush);
+  }
+  m_orderLink = link;
+  return _queue;
+}
+
+// Utility function to publish the command this thread just submitted to a
+// queue with per-thread real queues
+void completeOrderLink(cl_command_queue queue, cl_int err, cl_event *_event)
+{
+  struct orderLink *link = m_orderLink;
+  m_orderLink = NULL;
+  if (!link)
+  {
+    return;
+  }
+
+  // A failed command is stood in for by a marker, which still follows the
+  // commands before it
+  cl_event _done = NULL;
+  if (err == CL_SUCCESS)
+  {
+    _done = *_event;
+    clRetainEvent(_done);
+  }
+  else if (clEnqueueMarkerWithWaitList(link->_queue, 0, NULL, &_done)
+           != CL_SUCCESS)
+  {
+    _done = NULL;
+  }
+
+  pthread_mutex_lock(&queue->orderLock);
+  link->_event = _done;
+  link->submitted = CL_TRUE;
+  cl_event _gate = link->_gate;
+  link->_gate = NULL;
+  cl_command_queue _queue = link->_queue;
+  releaseOrderLink(link);
+  pthread_mutex_unlock(&queue->orderLock);
+
+  if (_gate)
+  {
+    // Commands on other real queues are already waiting for this one
+    clFlush(_queue);
+    if (!_done)
+    {
+      openOrderGate(NULL, CL_COMPLETE, _gate);
+    }
+    else if (clSetEventCallback(_done, CL_COMPLETE, openOrderGate, _gate)
+             != CL_SUCCESS)
+    {
+      // Open the gate here instead, once the command has completed
+      cl_int status = clWaitForEvents(1, &_done);
+      if (status == CL_SUCCESS)
+      {
+        clGetEventInfo(_done, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(cl_int), &status, NULL);
+      }
+      openOrderGate(_done, status, _gate);
+    }
+  }
+}
+
+// Utility function to count a low priority command as outstanding
+// Called with the lane lock held
+void addInFlight(struct priorityLane *lane, struct priorityCommand *command)
+{
+  lane->lowInFlight++;
+  command->nextInFlight = lane->inFlight;
+  lane->inFlight = command;
+}
+
+// Utility function to stop counting a low priority command as outstanding
+// Called with the lane lock held
+void removeInFlight(struct priorityLane *lane, struct priorityCommand *command)
+{
+  struct priorityCommand **prev = &lane->inFlight;
+  while (*prev && *prev != command)
+  {
+    prev = &(*prev)->nextInFlight;
+  }
+  if (*prev)
+  {
+    *prev = command->nextInFlight;
+    lane->lowInFlight--;
+  }
+}
+
+// Utility function to free a prioritized command
+void freePriorityCommand(struct priorityCommand *command)
+{
+  clReleaseCommandQueue(command->_queue);
+  free(command);
+}
+
+// Utility function to let backlogged commands go while the lane has room
+// Called with the lane lock held. Returns the gates to open once the lock
+// is released.
+struct priorityCommand* admitBacklog(struct priorityLane *lane)
+{
+  struct priorityCommand *open = NULL;
+  while (lane->head && lane->lowInFlight < m_lowPriorityInFlight)
+  {
+    struct priorityCommand *command = lane->head;
+    lane->head = command->next;
+    if (!lane->head)
+    {
+      lane->tail = NULL;
+    }
+    if (!command->failed)
+    {
+      command->admitted = CL_TRUE;
+      addInFlight(lane, command);
+    }
+    command->next = open;
+    open = command;
+  }
+  return open;
+}
+
+// Utility function to open the gates returned by admitBacklog
+// Each real queue is flushed, since later commands may be waiting for the
+// admitted one to complete.
+void openGates(struct priorityCommand *open)
+{
+  while (open)
+  {
+    struct priorityCommand *next = open->next;
+    cl_bool failed = open->failed;
+    cl_command_queue _queue = open->_queue;
+    clRetainCommandQueue(_queue);
+    clSetUserEventStatus(open->_gate, CL_COMPLETE);
+    clReleaseEvent(open->_gate);
+    if (failed)
+    {
+      freePriorityCommand(open);
+    }
+    clFlush(_queue);
+    clReleaseCommandQueue(_queue);
+    open = next;
+  }
+}
+
+// Callback to account for a prioritized command once it completes
+void CL_CALLBACK priorityCommandComplete(cl_event _event,
+                                         cl_int status,
+                                         void *user_data)
+{
+  struct priorityCommand *command = user_data;
+  struct priorityLane *lane = command->lane;
+  cl_ulong latency = getTimeNs() - command->startNs;
+
+  pthread_mutex_lock(&lane->lock);
+  cl_uint l = command->level == CL_QUEUE_PRIORITY_HIGH_OIW;
+  lane->totalLatencyNs[l] += latency;
+  if (latency > lane->maxLatencyNs[l])
+  {
+    lane->maxLatencyNs[l] = latency;
+  }
+  if (!l)
+  {
+    removeInFlight(lane, command);
+  }
+  struct priorityCommand *open = admitBacklog(lane);
+  pthread_mutex_unlock(&lane->lock);
+
+  openGates(open);
+  freePriorityCommand(command);
+}
+
+// Utility function to hold a low priority command back if its device
+// already has as many low priority commands outstanding as allowed
+// Called with the queue's priority lock held, which is kept until the
+// command is submitted so that it directly follows its barrier. The real
+// queues of the outstanding commands are flushed, since nothing else
+// guarantees that the commands the backlog waits for are ever submitted.
+void holdForPriority(cl_command_queue queue, cl_command_queue _queue)
+{
+  struct priorityLane *lane = queue->lane;
+  struct priorityCommand *command = malloc(sizeof(struct priorityCommand));
+  command->lane = lane;
+  command->level = queue->priority;
+  command->startNs = getTimeNs();
+  command->_queue = _queue;
+  clRetainCommandQueue(_queue);
+  command->_gate = NULL;
+  command->admitted = CL_TRUE;
+  command->failed = CL_FALSE;
+  command->next = NULL;
+  command->nextInFlight = NULL;
+
+  cl_uint l = command->level == CL_QUEUE_PRIORITY_HIGH_OIW;
+  cl_event _gate = NULL;
+  cl_command_queue *_flush = NULL;
+  cl_uint numFlush = 0;
+  pthread_mutex_lock(&lane->lock);
+  lane->commands[l]++;
+  if (!l)
+  {
+    // Once there is a backlog, later commands join the back of it
+    if (lane->lowInFlight >= m_lowPriorityInFlight || lane->head)
+    {
+      cl_int err;
+      _gate = clCreateUserEvent(queue->context->context, &err);
+      if (err != CL_SUCCESS)
+      {
+        _gate = NULL;
+      }
+    }
+    if (_gate)
+    {
+      clRetainEvent(_gate);
+      command->_gate = _gate;
+      command->admitted = CL_FALSE;
+      lane->backlogged[l]++;
+      if (lane->tail)
+      {
+        lane->tail->next = command;
+      }
+      else
+      {
+        lane->head = command;
+      }
+      lane->tail = command;
+
+      _flush = malloc(lane->lowInFlight*sizeof(cl_command_queue));
+      for (struct priorityCommand *c = lane->inFlight; c; c = c->nextInFlight)
+      {
+        clRetainCommandQueue(c->_queue);
+        _flush[numFlush++] = c->_queue;
+      }
+    }
+    else
+    {
+      addInFlight(lane, command);
+    }
+  }
+  pthread_mutex_unlock(&lane->lock);
+
+  if (_gate)
+  {
+    clEnqueueBarrierWithWaitList(_queue, 1, &_gate, NULL);
+    clReleaseEvent(_gate);
+  }
+  for (cl_uint i = 0; i < numFlush; i++)
+  {
+    clFlush(_flush[i]);
+    clReleaseCommandQueue(_flush[i]);
+  }
+  free(_flush);
+  m_priorityCommand = command;
+}
+
+// Utility function to finish submitting a prioritized command
+void completePriority(cl_command_queue queue, cl_int err, cl_event *_event)
+{
+  struct priorityCommand *command = m_priorityCommand;
+  m_priorityCommand = NULL;
+  if (command)
+  {
+    if (err == CL_SUCCESS)
+    {
+      // Commands that joined the backlog before this one was submitted
+      // could not flush it
+      struct priorityLane *lane = command->lane;
+      pthread_mutex_lock(&lane->lock);
+      cl_bool flush = command->admitted && lane->head;
+      pthread_mutex_unlock(&lane->lock);
+      if (flush)
+      {
+        clFlush(command->_queue);
+      }
+      clSetEventCallback(*_event, CL_COMPLETE,
+                         priorityCommandComplete, command);
+    }
+    else
+    {
+      // A failed command gives back its place straight away, or is skipped
+      // when its turn comes
+      struct priorityLane *lane = command->lane;
+      struct priorityCommand *open = NULL;
+      pthread_mutex_lock(&lane->lock);
+      command->failed = CL_TRUE;
+      if (command->admitted)
+      {
+        if (command->level != CL_QUEUE_PRIORITY_HIGH_OIW)
+        {
+          removeInFlight(lane, command);
+        }
+        open = admitBacklog(lane);
+        freePriorityCommand(command);
+      }
+      pthread_mutex_unlock(&lane->lock);
+      openGates(open);
+    }
+  }
+  pthread_mutex_unlock(&queue->priorityLock);
+}
+
+// Kinds of command submitted to a queue with a transfer queue
+#define DUAL_UNTRACKED 0
+#define DUAL_COMPUTE   1
+#define DUAL_TRANSFER  2
+
+// Kind of the command the current thread is submitting
+static __thread cl_uint m_dualCommand = DUAL_UNTRACKED;
+
+// Utility function to pick the real queue of a queue with a transfer queue.
+// Commands whose memory accesses are not tracked wait for every earlier
+// transfer, and later transfers wait for them in completeDualCommand.
+cl_command_queue selectDualQueue(cl_command_queue queue)
+{
+  if (m_dualCommand == DUAL_TRANSFER)
+  {
+    return queue->queues[1];
+  }
+  if (m_dualCommand == DUAL_UNTRACKED)
+  {
+    // The compute queue is in-order, so a marker acts as a barrier
+    enqueueJoin(queue, CL_FALSE, 0, NULL, NULL);
+  }
+  return queue->queues[0];
+}
+
+// Utility function to make later transfers wait for an untracked command
+void completeDualCommand(cl_command_queue queue,
+                         cl_int err,
+                         cl_event *_event)
+{
+  if (m_dualCommand == DUAL_UNTRACKED && err == CL_SUCCESS)
+  {
+    clEnqueueBarrierWithWaitList(queue->queues[1], 1, _event, NULL);
+  }
+  m_dualCommand = DUAL_UNTRACKED;
+}
+
+// Utility function to finish submitting a command: tracks its completion
+// against the in-flight limit and creates the wrapper event if requested
+void completeCommand(cl_command_queue queue,
+                     cl_command_queue _queue,
+                     cl_int err,
+                     cl_event *_event,
+                     cl_event *event)
+{
+  if (queue->perThread)
+  {
+    completeOrderLink(queue, err, _event);
+  }
+  if (queue->lane)
+  {
+    completePriority(queue, err, _event);
+  }
+  if (queue->dualQueue)
+  {
+    completeDualCommand(queue, err, _event);
+  }
+
+  if (queue->trackInFlight)
+  {
+    if (err == CL_SUCCESS)
+    {
+      clSetEventCallback(*_event, CL_COMPLETE, commandComplete, queue);
+    }
+    else
+    {
+      commandComplete(NULL, err, queue);
+    }
+  }
+
+  if (err == CL_SUCCESS)
+  {
+    if (event)
+    {
+      *event = createEvent(queue->context, queue, _queue, *_event);
+    }
+    else if (_event)
+    {
+      clReleaseEvent(*_event);
+    }
+  }
+}
+
+// Utility function to pick the real queue a command is submitted to
+cl_command_queue pickQueue(cl_command_queue queue,
+                           cl_uint num_events,
+                           const cl_event *event_list)
+{
+  if (queue->perThread)
+  {
+    return selectThreadQueue(queue);
+  }
+  if (queue->dualQueue)
+  {
+    return selectDualQueue(queue);
+  }
+  if (queue->numQueues == 1)
+  {
+    return queue->queue;
+  }
+
+  // Follow a dependency from this queue, so that in-order execution of the
+  // real queue satisfies it without crossing queues
+  for (cl_uint i = 0; i < num_events && event_list; i++)
+  {
+    if (event_list[i]->queue == queue && event_list[i]->submitQueue)
+    {
+      return event_list[i]->submitQueue;
+    }
+  }
+
+  // Spread independent commands across the real queues
+  cl_uint next = __sync_fetch_and_add(&queue->nextQueue, 1);
+  return queue->queues[next % queue->numQueues];
+}
+
+// Whether the command the current thread is submitting has its memory
+// accesses tracked
+static __thread cl_bool m_trackedCommand = CL_FALSE;
+
+// Utility function to keep the order of a queue whose barriers are left to
+// inferred dependencies around a command whose memory use is not tracked.
+// Such a command keeps the next barrier real, and a barrier that was left
+// out before it is enqueued now.
+void orderUntracked(cl_command_queue queue)
+{
+  __atomic_store_n(&queue->untrackedSince, CL_TRUE, __ATOMIC_RELEASE);
+  if (!__atomic_exchange_n(&queue->barrierOwed, CL_FALSE, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+
+  if (queue->numQueues > 1)
+  {
+    // Barrier must span every real queue
+    enqueueJoin(queue, CL_TRUE, 0, NULL, NULL);
+  }
+  else
+  {
+    clEnqueueBarrierWithWaitList(queue->queue, 0, NULL, NULL);
+  }
+}
+
+// Utility function to keep the barriers of a queue real around a command
+// that uses host memory, since only memory objects are tracked
+void orderHostAccess(cl_command_queue queue)
+{
+  if (queue->inferDeps && m_downgradeBarriers && !queue->graph)
+  {
+    orderUntracked(queue);
+  }
+}
+
+// Utility function to note that a real barrier now orders a queue
+void completeBarrier(cl_command_queue queue, cl_int err)
+{
+  if (err == CL_SUCCESS && queue->inferDeps)
+  {
+    __atomic_store_n(&queue->untrackedSince, CL_FALSE, __ATOMIC_RELEASE);
+    __atomic_store_n(&queue->barrierOwed, CL_FALSE, __ATOMIC_RELEASE);
+  }
+}
+
+// Utility function to select the real queue a command is submitted to
+cl_command_queue selectQueue(cl_command_queue queue,
+                             cl_uint num_events,
+                             const cl_event *event_list)
+{
+  // Commands whose memory use is not tracked cannot rely on inferred
+  // dependencies in place of a barrier
+  cl_bool tracked = m_trackedCommand;
+  m_trackedCommand = CL_FALSE;
+  if (!tracked && queue->inferDeps && m_downgradeBarriers && !queue->graph)
+  {
+    orderUntracked(queue);
+  }
+
+  if (!queue->lane)
+  {
+    return pickQueue(queue, num_events, event_list);
+  }
+
+  // Hold low priority commands back while their device is busy
+  pthread_mutex_lock(&queue->priorityLock);
+  cl_command_queue _queue = pickQueue(queue, num_events, event_list);
+  holdForPriority(queue, _queue);
+  return _queue;
+}
+
+// Utility function to select the real queue for a command whose memory
+// accesses are tracked, so that with a transfer queue it only waits for
+// the commands it depends on. Transfers go to the transfer queue.
+// Commands are untracked while recording, as graphs keep their own order.
+cl_command_queue selectTrackedQueue(cl_command_queue queue,
+                                    cl_bool transfer,
+                                    cl_uint num_events,
+                                    const cl_event *event_list)
+{
+  m_dualCommand = DUAL_UNTRACKED;
+  if (queue->dualQueue && !queue->graph)
+  {
+    m_dualCommand = transfer ? DUAL_TRANSFER : DUAL_COMPUTE;
+  }
+  m_trackedCommand = CL_TRUE;
+  return selectQueue(queue, num_events, event_list);
+}
+
+// Utility function to synchronize all of the real queues backing a queue.
+// The resulting event completes once every previously submitted command and
+// every event in the wait list has completed. For barriers, commands
+// submitted afterwards to any real queue also wait for it.
+cl_int enqueueJoin(cl_command_queue queue,
+                   cl_bool barrier,
+                   cl_uint num_events,
+                   const cl_event *_wait_list,
+                   cl_event *_event)
+{
+  cl_uint numMarkers = queue->numQueues - 1;
+  cl_event *_events = malloc((numMarkers + num_events + 1)*sizeof(cl_event));
+
+  // Mark the current end of each of the other real queues
+  cl_int err = CL_SUCCESS;
+  cl_uint i;
+  for (i = 0; i < numMarkers && err == CL_SUCCESS; i++)
+  {
+    err = clEnqueueMarkerWithWaitList(
+      queue->queues[i+1],
+      0,
+      NULL,
+      _events + i
+    );
+  }
+  if (err != CL_SUCCESS)
+  {
+    numMarkers = i - 1;
+  }
+
+  // Wait for all of them on the first real queue
+  cl_event _join = NULL;
+  if (err == CL_SUCCESS)
+  {
+    if (num_events)
+    {
+      memcpy(_events + numMarkers, _wait_list, num_events*sizeof(cl_event));
+    }
+    err = clEnqueueMarkerWithWaitList(
+      queue->queues[0],
+      numMarkers + num_events,
+      _events,
+      &_join
+    );
+  }
+
+  // Block the other real queues until the join completes
+  for (i = 0; barrier && err == CL_SUCCESS && i < queue->numQueues - 1; i++)
+  {
+    err = clEnqueueBarrierWithWaitList(queue->queues[i+1], 1, &_join, NULL);
+  }
+
+  for (i = 0; i < numMarkers; i++)
+  {
+    clReleaseEvent(_events[i]);
+  }
+  free(_events);
+
+  if (_join)
+  {
+    if (_event && err == CL_SUCCESS)
+    {
+      *_event = _join;
+    }
+    else
+    {
+      clReleaseEvent(_join);
+    }
+  }
+  return err;
+}
+
+// Utility function to convert event list into real event list
+cl_event* createEventList(cl_uint num, const cl_event *list)
+{
+  cl_event *result = NULL;
+  if (num > 0 && list)
+  {
+    if (__atomic_load_n(&m_pendingEvents, __ATOMIC_ACQUIRE))
+    {
+      for (cl_uint i = 0; i < num; i++)
+      {
+        resolveEvent(list[i]);
+      }
+    }
+    result = malloc(num*sizeof(cl_event));
+    translateHandles(num, (void*const*)list, (void**)result);
+  }
+  return result;
+}
+
+// Memory object used by a command
+struct memAccess
+{
+  cl_mem mem;
+  cl_bool write;
+};
+
+// Reads of a memory object tracked before older ones are merged
+#define MAX_TRACKED_READS 16
+
+// Events a command was made to wait on by inferDependencies
+static __thread cl_event *m_inferred = NULL;
+static __thread cl_uint m_numInferred = 0;
+
+// Utility function to make a command wait for earlier commands that use
+// the same memory: reads wait for the last write, and writes wait for the
+// last write and every read since. Sub-buffers are tracked as their parent.
+// Not applied while recording, so that graphs keep the application's own
+// dependencies. Returns the extended wait list.
+cl_event* inferDependencies(cl_command_queue queue,
+                            cl_uint num_accesses,
+                            const struct memAccess *accesses,
+                            cl_uint *num_events,
+                            cl_event *_wait_list)
+{
+  m_numInferred = 0;
+  if (!queue->inferDeps || queue->graph || !num_accesses)
+  {
+    return _wait_list;
+  }
+
+  pthread_mutex_lock(&m_dependencyLock);
+  cl_uint num = 0;
+  for (cl_uint a = 0; a < num_accesses; a++)
+  {
+    cl_mem root = getRootBuffer(accesses[a].mem);
+    num += 1 + (accesses[a].write ? root->numReads : 0);
+  }
+  m_inferred = realloc(m_inferred, num*sizeof(cl_event));
+  for (cl_uint a = 0; a < num_accesses; a++)
+  {
+    cl_mem root = getRootBuffer(accesses[a].mem);
+    if (root->lastWrite)
+    {
+      m_inferred[m_numInferred++] = root->lastWrite;
+    }
+    for (cl_uint r = 0; accesses[a].write && r < root->numReads; r++)
+    {
+      m_inferred[m_numInferred++] = root->reads[r];
+    }
+  }
+
+  // Keep the events alive until the command has been submitted
+  for (cl_uint i = 0; i < m_numInferred; i++)
+  {
+    clRetainEvent(m_inferred[i]);
+  }
+  pthread_mutex_unlock(&m_dependencyLock);
+
+  if (m_numInferred)
+  {
+    _wait_list = realloc(_wait_list,
+                         (*num_events + m_numInferred)*sizeof(cl_event));
+    memcpy(_wait_list + *num_events, m_inferred,
+           m_numInferred*sizeof(cl_event));
+    *num_events += m_numInferred;
+  }
+  return _wait_list;
+}
+
+// Utility function to remember the memory a submitted command uses, so
+// that later commands can be made to wait for it
+void recordAccesses(cl_command_queue queue,
+                    cl_command_queue _queue,
+                    cl_uint num_accesses,
+                    const struct memAccess *accesses,
+                    cl_int err,
+                    cl_event *_event)
+{
+  for (cl_uint i = 0; i < m_numInferred; i++)
+  {
+    clReleaseEvent(m_inferred[i]);
+  }
+  m_numInferred = 0;
+  if (!queue->inferDeps || queue->graph || err != CL_SUCCESS)
+  {
+    return;
+  }
+
+  pthread_mutex_lock(&m_dependencyLock);
+  for (cl_uint a = 0; a < num_accesses; a++)
+  {
+    cl_mem root = getRootBuffer(accesses[a].mem);
+    clRetainEvent(*_event);
+    if (accesses[a].write)
+    {
+      // Later commands only need to wait for this write
+      if (root->lastWrite)
+      {
+        clReleaseEvent(root->lastWrite);
+      }
+      for (cl_uint r = 0; r < root->numReads; r++)
+      {
+        clReleaseEvent(root->reads[r]);
+      }
+      root->numReads = 0;
+      root->lastWrite = *_event;
+      continue;
+    }
+
+    if (root->numReads == MAX_TRACKED_READS)
+    {
+      // Forget reads that have completed
+      cl_uint kept = 0;
+      for (cl_uint r = 0; r < root->numReads; r++)
+      {
+        cl_int status = CL_QUEUED;
+        clGetEventInfo(root->reads[r], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(status), &status, NULL);
+        if (status == CL_COMPLETE)
+        {
+          clReleaseEvent(root->reads[r]);
+        }
+        else
+        {
+          root->reads[kept++] = root->reads[r];
+        }
+      }
+      root->numReads = kept;
+    }
+    if (root->numReads == MAX_TRACKED_READS)
+    {
+      // Stand in for the remaining reads with a single marker
+      cl_event _marker;
+      if (clEnqueueMarkerWithWaitList(_queue, root->numReads, root->reads,
+                                      &_marker) == CL_SUCCESS)
+      {
+        for (cl_uint r = 0; r < root->numReads; r++)
+        {
+          clReleaseEvent(root->reads[r]);
+        }
+        root->reads[0] = _marker;
+        root->numReads = 1;
+      }
+    }
+    if (root->numReads == root->maxReads)
+    {
+      root->maxReads = root->maxReads ? root->maxReads*2 : 4;
+      root->reads = realloc(root->reads, root->maxReads*sizeof(cl_event));
+    }
+    root->reads[root->numReads++] = *_event;
+  }
+  pthread_mutex_unlock(&m_dependencyLock);
+}
+
+// Utility function to drop the accesses recorded for a memory object
+void forgetAccesses(cl_mem mem)
+{
+  pthread_mutex_lock(&m_dependencyLock);
+  if (mem->lastWrite)
+  {
+    clReleaseEvent(mem->lastWrite);
+    mem->lastWrite = NULL;
+  }
+  for (cl_uint r = 0; r < mem->numReads; r++)
+  {
+    clReleaseEvent(mem->reads[r]);
+  }
+  mem->numReads = 0;
+  pthread_mutex_unlock(&m_dependencyLock);
+}
+
+// Utility function to list the memory objects a kernel launch uses
+// Returns NULL if the queue does not infer dependencies
+struct memAccess* getKernelAccesses(cl_command_queue queue,
+                                    cl_kernel kernel,
+                                    cl_uint *num_accesses)
+{
+  *num_accesses = 0;
+  if (!queue->inferDeps || !kernel->numArgs)
+  {
+    return NULL;
+  }
+  struct memAccess *accesses =
+    malloc(kernel->numArgs*sizeof(struct memAccess));
+  for (cl_uint i = 0; i < kernel->numArgs; i++)
+  {
+    if (kernel->args[i].mem)
+    {
+      accesses[*num_accesses].mem = kernel->args[i].mem;
+      accesses[*num_accesses].write = !kernel->args[i].readOnly;
+      (*num_accesses)++;
+    }
+  }
+  return accesses;
+}
+
+// Utility function to convert mem list into real mem list
+cl_mem* createMemList(cl_uint num, const cl_mem *list)
+{
+  cl_mem *result = NULL;
+  if (num > 0 && list)
+  {
+    result = malloc(num*sizeof(cl_mem));
+    translateHandles(num, (void*const*)list, (void**)result);
+  }
+  return result;
+}
+
+// Command recorded into a graph
+struct graphNode
+{
+  cl_command_type type;
+
+  // Buffer transfers
+  cl_mem mem[2];
+  size_t offset[2];
+  size_t size;
+  void *ptr;
+  void *pattern;
+  size_t patternSize;
+
+  // Kernel launches
+  cl_kernel kernel;
+  struct kernelArg *args;
+  cl_uint numArgs;
+  cl_bool guarded;
+  cl_ulong guardBound[4];
+  cl_uint workDim;
+  size_t globalOffset[3];
+  size_t globalSize[3];
+  size_t localSize[3];
+  cl_bool hasOffset;
+  cl_bool hasLocal;
+
+  // Wait structure
+  cl_uint *deps;
+  cl_uint numDeps;
+  cl_event *external;
+  cl_uint numExternal;
+
+  // Real event produced while recording
+  cl_event event;
+};
+
+struct _cl_command_graph_oiw
+{
+  cl_context context;
+  cl_device_id device;
+  struct graphNode *nodes;
+  cl_uint numNodes;
+  cl_uint maxNodes;
+  cl_int error;
+};
+
+// Utility function to append a command to the graph being recorded
+struct graphNode* recordCommand(cl_command_queue queue,
+                                cl_command_type type,
+                                cl_uint num_events,
+                                const cl_event *event_list,
+                                cl_event *event)
+{
+  cl_command_graph_oiw graph = queue->graph;
+  if (graph->numNodes == graph->maxNodes)
+  {
+    graph->maxNodes = graph->maxNodes ? 2*graph->maxNodes : 16;
+    graph->nodes = realloc(graph->nodes,
+                           graph->maxNodes*sizeof(struct graphNode));
+  }
+  struct graphNode *node = graph->nodes + graph->numNodes;
+  memset(node, 0, sizeof(struct graphNode));
+  node->type = type;
+
+  // Split wait list into recorded commands and external events
+  if (num_events > 0 && event_list)
+  {
+    node->deps = malloc(num_events*sizeof(cl_uint));
+    node->external = malloc(num_events*sizeof(cl_event));
+    for (cl_uint i = 0; i < num_events; i++)
+    {
+      cl_event _event = event_list[i]->event;
+      cl_uint n;
+      for (n = 0; n < graph->numNodes; n++)
+      {
+        if (graph->nodes[n].event == _event)
+        {
+          break;
+        }
+      }
+      if (n < graph->numNodes)
+      {
+        node->deps[node->numDeps++] = n;
+      }
+      else
+      {
+        clRetainEvent(_event);
+        node->external[node->numExternal++] = _event;
+      }
+    }
+  }
+
+  // Keep the real event alive so that it can't be recycled while recording
+  if (event)
+  {
+    node->event = (*event)->event;
+    clRetainEvent(node->event);
+  }
+
+  graph->numNodes++;
+  return node;
+}
+
+// Utility function to record a memory object used by a command, keeping the
+// real object alive for as long as the graph
+void recordMem(struct graphNode *node, cl_uint i, cl_mem mem)
+{
+  node->mem[i] = mem;
+  clRetainMemObject(mem->mem);
+}
+
+// Utility function to record a kernel launch, capturing its arguments
+void recordKernel(cl_command_queue queue,
+                  cl_command_type type,
+                  cl_kernel kernel,
+                  cl_uint work_dim,
+                  const size_t *global_work_offset,
+                  const size_t *global_work_size,
+                  const size_t *local_work_size,
+                  cl_uint num_events,
+                  const cl_event *event_list,
+                  cl_event *event)
+{
+  cl_kernel _kernel = createKernelClone(kernel);
+  if (!_kernel)
+  {
+    queue->graph->error = CL_OUT_OF_RESOURCES;
+    return;
+  }
+
+  struct graphNode *node =
+    recordCommand(queue, type, num_events, event_list, event);
+  node->kernel = _kernel;
+  node->numArgs = kernel->numArgs;
+  node->args = malloc(kernel->numArgs*sizeof(struct kernelArg));
+  for (cl_uint i = 0; i < kernel->numArgs; i++)
+  {
+    struct kernelArg *arg = node->args + i;
+    *arg = kernel->args[i];
+    if (arg->value)
+    {
+      arg->value = malloc(arg->size);
+      memcpy(arg->value, kernel->args[i].value, arg->size);
+    }
+    if (arg->mem)
+    {
+      clRetainMemObject(arg->mem->mem);
+    }
+  }
+  node->guarded = kernel->guarded;
+  memcpy(node->guardBound, kernel->guardBound, sizeof(node->guardBound));
+  node->workDim = work_dim;
+  for (cl_uint d = 0; d < work_dim; d++)
+  {
+    node->globalSize[d] = global_work_size[d];
+    node->globalOffset[d] = global_work_offset ? global_work_offset[d] : 0;
+    node->localSize[d] = local_work_size ? local_work_size[d] : 0;
+  }
+  node->hasOffset = global_work_offset != NULL;
+  node->hasLocal = local_work_size != NULL;
+}
+
+// Utility function to fail recording when an unsupported command is enqueued
+void abortRecording(cl_command_queue queue)
+{
+  if (queue->graph)
+  {
+    queue->graph->error = CL_INVALID_OPERATION;
+  }
+}
+
+// Utility function to look up the patched version of a memory object
+cl_mem getPatchedMem(cl_mem mem, cl_uint num_patches,
+                     const cl_mem *patch_src, const cl_mem *patch_dst)
+{
+  for (cl_uint i = 0; i < num_patches; i++)
+  {
+    if (patch_src[i] == mem)
+    {
+      return patch_dst[i];
+    }
+  }
+  return mem;
+}
+
+// Utility function to create a kernel for one replay of a recorded launch,
+// with patched memory objects substituted into its arguments
+cl_kernel createPatchedKernel(struct graphNode *node,
+                              cl_uint num_patches,
+                              const cl_mem *patch_src,
+                              const cl_mem *patch_dst)
+{
+  size_t sz;
+  cl_program _program;
+  cl_int err = clGetKernelInfo(node->kernel, CL_KERNEL_PROGRAM,
+                               sizeof(cl_program), &_program, NULL);
+  if (err == CL_SUCCESS)
+  {
+    err = clGetKernelInfo(node->kernel, CL_KERNEL_FUNCTION_NAME,
+                          0, NULL, &sz);
+  }
+  if (err != CL_SUCCESS)
+  {
+    return NULL;
+  }
+  char *name = malloc(sz);
+  clGetKernelInfo(node->kernel, CL_KERNEL_FUNCTION_NAME, sz, name, NULL);
+
+  cl_kernel _kernel = clCreateKernel(_program, name, &err);
+  free(name);
+  if (err != CL_SUCCESS)
+  {
+    return NULL;
+  }
+
+  for (cl_uint i = 0; i < node->numArgs; i++)
+  {
+    struct kernelArg *arg = node->args + i;
+    if (arg->mem)
+    {
+      cl_mem mem = getPatchedMem(arg->mem, num_patches, patch_src, patch_dst);
+      clSetKernelArg(_kernel, i, sizeof(cl_mem), &mem->mem);
+    }
+    else if (arg->isSet)
+    {
+      clSetKernelArg(_kernel, i, arg->size, arg->value);
+    }
+  }
+  if (node->guarded)
+  {
+    clSetKernelArg(_kernel, node->numArgs,
+                   sizeof(node->guardBound), node->guardBound);
+  }
+  return _kernel;
+}
+
+// Utility function to submit a single recorded command
+cl_int enqueueGraphNode(cl_command_queue _queue,
+                        struct graphNode *node,
+                        cl_uint num_patches,
+                        const cl_mem *patch_src,
+                        const cl_mem *patch_dst,
+                        cl_uint num_events,
+                        const cl_event *_wait_list,
+                        cl_event *_event)
+{
+  // Really unmap cached mappings before the device uses the memory
+  for (cl_uint i = 0; i < 2; i++)
+  {
+    if (node->mem[i])
+    {
+      releaseMappings(
+        getPatchedMem(node->mem[i], num_patches, patch_src, patch_dst),
+        _queue
+      );
+    }
+  }
+  for (cl_uint i = 0; i < node->numArgs; i++)
+  {
+    if (node->args[i].mem)
+    {
+      releaseMappings(
+        getPatchedMem(node->args[i].mem, num_patches, patch_src, patch_dst),
+        _queue
+      );
+    }
+  }
+
+  cl_kernel _kernel;
+  cl_int err;
+  cl_mem mem0 = NULL, mem1 = NULL;
+  if (node->mem[0])
+  {
+    mem0 = getPatchedMem(node->mem[0], num_patches, patch_src, patch_dst)->mem;
+  }
+  if (node->mem[1])
+  {
+    mem1 = getPatchedMem(node->mem[1], num_patches, patch_src, patch_dst)->mem;
+  }
+
+  switch (node->type)
+  {
+  case CL_COMMAND_READ_BUFFER:
+    return clEnqueueReadBuffer(_queue, mem0, CL_FALSE,
+                               node->offset[0], node->size, node->ptr,
+                               num_events, _wait_list, _event);
+  case CL_COMMAND_WRITE_BUFFER:
+    return clEnqueueWriteBuffer(_queue, mem0, CL_FALSE,
+                                node->offset[0], node->size, node->ptr,
+                                num_events, _wait_list, _event);
+  case CL_COMMAND_COPY_BUFFER:
+    return clEnqueueCopyBuffer(_queue, mem0, mem1,
+                               node->offset[0], node->offset[1], node->size,
+                               num_events, _wait_list, _event);
+  case CL_COMMAND_FILL_BUFFER:
+    return clEnqueueFillBuffer(_queue, mem0,
+                               node->pattern, node->patternSize,
+                               node->offset[0], node->size,
+                               num_events, _wait_list, _event);
+  case CL_COMMAND_MARKER:
+    return clEnqueueMarkerWithWaitList(_queue,
+                                       num_events, _wait_list, _event);
+  case CL_COMMAND_BARRIER:
+    return clEnqueueBarrierWithWaitList(_queue,
+                                        num_events, _wait_list, _event);
+  case CL_COMMAND_NDRANGE_KERNEL:
+  case CL_COMMAND_TASK:
+    // Patched memory objects go into a private copy of the kernel, so that
+    // concurrent replays of the graph don't change each other's arguments
+    _kernel = node->kernel;
+    for (cl_uint i = 0; i < node->numArgs; i++)
+    {
+      cl_mem mem = node->args[i].mem;
+      if (mem && getPatchedMem(mem, num_patches, patch_src, patch_dst) != mem)
+      {
+        _kernel = createPatchedKernel(node, num_patches, patch_src, patch_dst);
+        if (!_kernel)
+        {
+          return CL_OUT_OF_RESOURCES;
+        }
+        break;
+      }
+    }
+
+    if (node->type == CL_COMMAND_TASK)
+    {
+      err = clEnqueueTask(_queue, _kernel,
+                          num_events, _wait_list, _event);
+    }
+    else
+    {
+      err = clEnqueueNDRangeKernel(
+        _queue,
+        _kernel,
+        node->workDim,
+        node->hasOffset ? node->globalOffset : NULL,
+        node->globalSize,
+        node->hasLocal ? node->localSize : NULL,
+        num_events,
+        _wait_list,
+        _event
+      );
+    }
+
+    if (_kernel != node->kernel)
+    {
+      clReleaseKernel(_kernel);
+    }
+    return err;
+  default:
+    return CL_INVALID_OPERATION;
+  }
+}
+
+// Hybrid wait settings. The spin budget adapts between the bounds: it grows
+// while waits finish during the spin phase, and shrinks while they don't.
+static cl_bool m_spinWait = CL_FALSE;
+static cl_ulong m_spinBudget;
+static cl_ulong m_minSpinBudget;
+static cl_ulong m_maxSpinBudget;
+
+void initWaitEngine()
+{
+  m_spinWait = getEnvInt("OIW_SPIN_WAIT", 0) > 0;
+  m_maxSpinBudget = getEnvInt("OIW_SPIN_WAIT_MAX_NS", 200000);
+  m_minSpinBudget = getEnvInt("OIW_SPIN_WAIT_MIN_NS", 2000);
+  if (m_minSpinBudget > m_maxSpinBudget)
+  {
+    m_minSpinBudget = m_maxSpinBudget;
+  }
+  m_spinBudget = getEnvInt("OIW_SPIN_WAIT_NS", 50000);
+  if (m_spinBudget < m_minSpinBudget)
+  {
+    m_spinBudget = m_minSpinBudget;
+  }
+  if (m_spinBudget > m_maxSpinBudget)
+  {
+    m_spinBudget = m_maxSpinBudget;
+  }
+}
+
+// Utility function to adjust the spin budget after a wait
+void updateSpinBudget(cl_ulong budget, cl_ulong elapsed, cl_bool hit)
+{
+  if (hit)
+  {
+    // Keep twice the observed latency in hand
+    if (2*elapsed > budget)
+    {
+      budget = 2*elapsed;
+    }
+  }
+  else if (elapsed < 4*budget)
+  {
+    // Narrow miss, so spinning a little longer would have paid off
+    budget *= 2;
+  }
+  else
+  {
+    // Long wait, so spinning just burns CPU time
+    budget /= 2;
+  }
+
+  if (budget < m_minSpinBudget)
+  {
+    budget = m_minSpinBudget;
+  }
+  if (budget > m_maxSpinBudget)
+  {
+    budget = m_maxSpinBudget;
+  }
+  __atomic_store_n(&m_spinBudget, budget, __ATOMIC_RELAXED);
+}
+
+// Utility function to wait for real events, polling their status for a
+// bounded time before falling back to a blocking wait
+cl_int waitForRealEvents(cl_uint num, const cl_event *_events)
+{
+  if (!m_spinWait)
+  {
+    return clWaitForEvents(num, _events);
+  }
+
+  cl_ulong budget = __atomic_load_n(&m_spinBudget, __ATOMIC_RELAXED);
+  cl_ulong start = getTimeNs();
+  cl_ulong now = start;
+  cl_uint done = 0;
+  while (now - start < budget)
+  {
+    // Skip past events that have completed
+    while (done < num)
+    {
+      cl_int status;
+      cl_int err = clGetEventInfo(
+        _events[done],
+        CL_EVENT_COMMAND_EXECUTION_STATUS,
+        sizeof(cl_int),
+        &status,
+        NULL
+      );
+      if (err != CL_SUCCESS)
+      {
+        return err;
+      }
+      if (status < 0)
+      {
+        return CL_EXEC_STATUS_ERROR_FOR_EVENTS_IN_WAIT_LIST;
+      }
+      if (status != CL_COMPLETE)
+      {
+        break;
+      }
+      done++;
+    }
+    if (done == num)
+    {
+      updateSpinBudget(budget, getTimeNs() - start, CL_TRUE);
+      return CL_SUCCESS;
+    }
+
+    for (int i = 0; i < 32; i++)
+    {
+      CPU_RELAX();
+    }
+    now = getTimeNs();
+  }
+
+  cl_int err = clWaitForEvents(num - done, _events + done);
+  updateSpinBudget(budget, getTimeNs() - start, CL_FALSE);
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clWaitForEvents_(cl_uint              num_events ,
+                  const cl_event *     event_list) CL_API_SUFFIX__VERSION_1_0
+{
+  if (num_events == 0)
+  {
+    return CL_SUCCESS;
+  }
+
+  // Call original function
+  cl_event *_events = createEventList(num_events, event_list);
+  cl_int err = waitForRealEvents(num_events, _events);
+  free(_events);
+  return err;
+}
+
+// Utility function to update the status mirror of an event
+// Statuses only ever decrease, and terminal statuses are never overwritten
+void mirrorEventStatus(cl_event event, cl_int status)
+{
+  cl_int old = __atomic_load_n(&event->status, __ATOMIC_ACQUIRE);
+  while (status < old && old > CL_COMPLETE)
+  {
+    if (__atomic_compare_exchange_n(&event->status, &old, status, CL_TRUE,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      break;
+    }
+  }
+}
+
+// Callback to keep the status mirror of an event up to date
+void CL_CALLBACK updateEventStatus(cl_event _event,
+                                   cl_int status,
+                                   void *user_data)
+{
+  mirrorEventStatus((cl_event)user_data, status);
+}
+
+// Utility function to get the execution status of an event
+// The first query registers vendor callbacks that maintain the mirror, after
+// which statuses are answered without calling into the implementation
+cl_int getEventStatus(cl_event event, cl_int *status)
+{
+  resolveEvent(event);
+
+  cl_int current = __atomic_load_n(&event->status, __ATOMIC_ACQUIRE);
+  cl_int mirror = __atomic_load_n(&event->mirror, __ATOMIC_ACQUIRE);
+  if (current <= CL_COMPLETE || mirror == MIRROR_ALL)
+  {
+    *status = current;
+    return CL_SUCCESS;
+  }
+
+  cl_int expected = MIRROR_NONE;
+  if (mirror == MIRROR_NONE &&
+      __atomic_compare_exchange_n(&event->mirror, &expected,
+                                  MIRROR_REGISTERING, CL_FALSE,
+                                  __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+  {
+    // Intermediate states can only be observed through callbacks from
+    // OpenCL 1.2 onwards, so fall back to completion only if they fail
+    mirror = MIRROR_TERMINAL_ONLY;
+    if (clSetEventCallback(event->event, CL_COMPLETE,
+                           updateEventStatus, event) != CL_SUCCESS)
+    {
+      mirror = MIRROR_NONE;
+    }
+    else if (clSetEventCallback(event->event, CL_RUNNING,
+                                updateEventStatus, event) == CL_SUCCESS &&
+             clSetEventCallback(event->event, CL_SUBMITTED,
+                                updateEventStatus, event) == CL_SUCCESS)
+    {
+      mirror = MIRROR_ALL;
+    }
+  }
+
+  // Seed the mirror with the current status
+  cl_int err = clGetEventInfo(
+    event->event,
+    CL_EVENT_COMMAND_EXECUTION_STATUS,
+    sizeof(cl_int),
+    status,
+    NULL
+  );
+  if (err == CL_SUCCESS)
+  {
+    mirrorEventStatus(event, *status);
+    *status = __atomic_load_n(&event->status, __ATOMIC_ACQUIRE);
+  }
+  if (mirror != MIRROR_REGISTERING)
+  {
+    __atomic_store_n(&event->mirror, mirror, __ATOMIC_RELEASE);
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetEventInfo_(cl_event          event ,
+                 cl_event_info     param_name ,
+                 size_t            param_value_size ,
+                 void *            param_value ,
+                 size_t *          param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+{
+  if (param_name == CL_EVENT_CONTEXT)
+  {
+    if (param_value_size && param_value_size < sizeof(cl_context))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &(event->context), sizeof(cl_context));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_context);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_EVENT_COMMAND_QUEUE)
+  {
+    if (param_value_size && param_value_size < sizeof(cl_command_queue))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &event->queue, sizeof(cl_command_queue));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_command_queue);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_EVENT_COMMAND_TYPE && event->commandType)
+  {
+    if (param_value_size && param_value_size < sizeof(cl_command_type))
+    {
+      return CL_INVALID_VALUE;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &event->commandType, sizeof(cl_command_type));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_command_type);
+    }
+    return CL_SUCCESS;
+  }
+  else if (param_name == CL_EVENT_COMMAND_EXECUTION_STATUS)
+  {
+    if (param_value_size && param_value_size < sizeof(cl_int))
+    {
+      return CL_INVALID_VALUE;
+    }
+    cl_int status;
+    cl_int err = getEventStatus(event, &status);
+    if (err != CL_SUCCESS)
+    {
+      return err;
+    }
+    if (param_value)
+    {
+      memcpy(param_value, &status, sizeof(cl_int));
+    }
+    if (param_value_size_ret)
+    {
+      *param_value_size_ret = sizeof(cl_int);
+    }
+    return CL_SUCCESS;
+  }
+  else
+  {
+    resolveEvent(event);
+    return clGetEventInfo(
+      event->event,
+      param_name,
+      param_value_size,
+      param_value,
+      param_value_size_ret
+    );
+  }
+}
+
+CL_API_ENTRY cl_event CL_API_CALL
+_clCreateUserEvent_(cl_context     context ,
+                    cl_int *       errcode_ret) CL_API_SUFFIX__VERSION_1_1
+{
+  // Call original function
+  cl_int err;
+  cl_event _event = clCreateUserEvent(
+    context->context,
+    &err
+  );
+
+  // Create wrapper object
+  cl_event event = NULL;
+  if (err == CL_SUCCESS)
+  {
+    event = createEvent(context, NULL, NULL, _event);
+  }
+
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return event;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clRetainEvent_(cl_event  event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Count references to unbound events until they are bound
+  if (!__atomic_load_n(&event->event, __ATOMIC_ACQUIRE))
+  {
+    cl_command_queue queue = event->pendingQueue;
+    pthread_mutex_lock(&queue->batchLock);
+    cl_bool pending = !event->event;
+    if (pending)
+    {
+      event->pendingRefs++;
+    }
+    pthread_mutex_unlock(&queue->batchLock);
+    if (pending)
+    {
+      return CL_SUCCESS;
+    }
+  }
+  return clRetainEvent(event->event);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clReleaseEvent_(cl_event  event) CL_API_SUFFIX__VERSION_1_0
+{
+  if (!__atomic_load_n(&event->event, __ATOMIC_ACQUIRE))
+  {
+    cl_command_queue queue = event->pendingQueue;
+    pthread_mutex_lock(&queue->batchLock);
+    cl_bool pending = !event->event;
+    if (pending)
+    {
+      event->pendingRefs--;
+    }
+    pthread_mutex_unlock(&queue->batchLock);
+    if (pending)
+    {
+      return CL_SUCCESS;
+    }
+  }
+  return clReleaseEvent(event->event);
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clSetUserEventStatus_(cl_event    event ,
+                       cl_int      execution_status) CL_API_SUFFIX__VERSION_1_1
+{
+  cl_int err = clSetUserEventStatus(event->event, execution_status);
+  if (err == CL_SUCCESS)
+  {
+    mirrorEventStatus(event, execution_status);
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clSetEventCallback_(cl_event     event ,
+                     cl_int       command_exec_callback_type ,
+                     void (CL_CALLBACK *  pfn_notify)(cl_event, cl_int, void *),
+                     void *       user_data) CL_API_SUFFIX__VERSION_1_1
+{
+  if (!pfn_notify)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  resolveEvent(event);
+
+  struct callbackJob *job =
+    createCallbackJob(CALLBACK_EVENT, event, pfn_notify, user_data, 1);
+  cl_int err = clSetEventCallback(
     event->event,
     command_exec_callback_type,
-    pfn_notify,
-    user_data
+    dispatchEventCallback,
+    job
+  );
+  if (err != CL_SUCCESS)
+  {
+    free(job);
+  }
+  return err;
+}
+
+/* Profiling APIs  */
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetEventProfilingInfo_(cl_event             event ,
+                          cl_profiling_info    param_name ,
+                          size_t               param_value_size ,
+                          void *               param_value ,
+                          size_t *             param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+{
+  // Profiling information of completed events never changes, so cache the
+  // timestamps the first time they are queried
+  cl_uint index = param_name - CL_PROFILING_COMMAND_QUEUED;
+  if (index < 4)
+  {
+    cl_int status;
+    if (!__atomic_load_n(&event->profilingCached, __ATOMIC_ACQUIRE) &&
+        getEventStatus(event, &status) == CL_SUCCESS &&
+        status == CL_COMPLETE)
+    {
+      cl_ulong profiling[4];
+      cl_int err = CL_SUCCESS;
+      for (cl_uint i = 0; i < 4 && err == CL_SUCCESS; i++)
+      {
+        err = clGetEventProfilingInfo(
+          event->event,
+          CL_PROFILING_COMMAND_QUEUED + i,
+          sizeof(cl_ulong),
+          profiling + i,
+          NULL
+        );
+      }
+      if (err == CL_SUCCESS)
+      {
+        memcpy(event->profiling, profiling, sizeof(profiling));
+        __atomic_store_n(&event->profilingCached, CL_TRUE, __ATOMIC_RELEASE);
+      }
+    }
+
+    if (__atomic_load_n(&event->profilingCached, __ATOMIC_ACQUIRE))
+    {
+      if (param_value_size && param_value_size < sizeof(cl_ulong))
+      {
+        return CL_INVALID_VALUE;
+      }
+      if (param_value)
+      {
+        memcpy(param_value, event->profiling + index, sizeof(cl_ulong));
+      }
+      if (param_value_size_ret)
+      {
+        *param_value_size_ret = sizeof(cl_ulong);
+      }
+      return CL_SUCCESS;
+    }
+  }
+
+  resolveEvent(event);
+  return clGetEventProfilingInfo(
+    event->event,
+    param_name,
+    param_value_size,
+    param_value,
+    param_value_size_ret
+  );
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clFlush_(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
+{
+  flushPending(command_queue);
+
+  cl_int err = CL_SUCCESS;
+  for (cl_uint i = 0; i < command_queue->numQueues && err == CL_SUCCESS; i++)
+  {
+    err = clFlush(command_queue->queues[i]);
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clFinish_(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
+{
+  flushPending(command_queue);
+
+  if (m_spinWait)
+  {
+    // Wait for a marker at the end of each real queue
+    cl_uint num = command_queue->numQueues;
+    cl_event *_markers = calloc(num, sizeof(cl_event));
+    cl_uint numMarkers = 0;
+    cl_int err = CL_SUCCESS;
+    for (cl_uint i = 0; i < num && err == CL_SUCCESS; i++)
+    {
+      err = clEnqueueMarkerWithWaitList(
+        command_queue->queues[i],
+        0,
+        NULL,
+        _markers + numMarkers
+      );
+      if (err == CL_SUCCESS)
+      {
+        numMarkers++;
+        err = clFlush(command_queue->queues[i]);
+      }
+    }
+    if (err == CL_SUCCESS)
+    {
+      err = waitForRealEvents(numMarkers, _markers);
+    }
+    for (cl_uint i = 0; i < numMarkers; i++)
+    {
+      clReleaseEvent(_markers[i]);
+    }
+    free(_markers);
+    return err;
+  }
+
+  cl_int err = CL_SUCCESS;
+  for (cl_uint i = 0; i < command_queue->numQueues && err == CL_SUCCESS; i++)
+  {
+    err = clFinish(command_queue->queues[i]);
+  }
+  return err;
+}
+
+// Smallest host copy that is split across threads
+#define PARALLEL_COPY_SIZE (1<<20)
+
+// Size of a fill pattern once expanded, a multiple of every pattern size
+#define FILL_BLOCK_SIZE 256
+
+// Utility function to fill host memory from an expanded pattern
+static void fillPatternScalar(char *dst, const char *block, size_t size)
+{
+  for (; size >= FILL_BLOCK_SIZE; size -= FILL_BLOCK_SIZE)
+  {
+    memcpy(dst, block, FILL_BLOCK_SIZE);
+    dst += FILL_BLOCK_SIZE;
+  }
+  memcpy(dst, block, size);
+}
+
+#ifdef HAVE_X86_SIMD
+__attribute__((target("avx2")))
+static void fillPatternAVX2(char *dst, const char *block, size_t size)
+{
+  // Keep the whole expanded pattern in registers
+  __m256i v[FILL_BLOCK_SIZE/32];
+  for (cl_uint i = 0; i < FILL_BLOCK_SIZE/32; i++)
+  {
+    v[i] = _mm256_loadu_si256((const __m256i*)(block + i*32));
+  }
+  for (; size >= FILL_BLOCK_SIZE; size -= FILL_BLOCK_SIZE)
+  {
+    for (cl_uint i = 0; i < FILL_BLOCK_SIZE/32; i++)
+    {
+      _mm256_storeu_si256((__m256i*)(dst + i*32), v[i]);
+    }
+    dst += FILL_BLOCK_SIZE;
+  }
+  memcpy(dst, block, size);
+}
+#endif
+
+// Utility function to fill host memory with a pattern
+// Fills must start at a multiple of the pattern size, and block holds the
+// pattern repeated out to FILL_BLOCK_SIZE bytes.
+static void fillPattern(char *dst, const char *block,
+                        size_t pattern_size, size_t size)
+{
+  if (pattern_size == 1)
+  {
+    memset(dst, block[0], size);
+    return;
+  }
+#ifdef HAVE_X86_SIMD
+  if (__builtin_cpu_supports("avx2"))
+  {
+    fillPatternAVX2(dst, block, size);
+    return;
+  }
+#endif
+  fillPatternScalar(dst, block, size);
+}
+
+// Host copy shared between the copy threads and the calling thread
+struct copyJob
+{
+  char *dst;
+  const char *src;
+  size_t patternSize;
+  size_t size;
+  size_t chunk;
+  size_t numChunks;
+  size_t next;
+  size_t done;
+  cl_uint workers;
+};
+
+// Threads that help with large host copies
+static struct
+{
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  struct copyJob *job;
+  cl_ulong generation;
+  cl_uint numThreads;
+} m_copy =
+{
+  PTHREAD_MUTEX_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+  PTHREAD_COND_INITIALIZER,
+};
+
+// Utility function to copy chunks of a job until none are left
+void copyChunks(struct copyJob *job)
+{
+  size_t c;
+  while ((c = __atomic_fetch_add(&job->next, 1, __ATOMIC_ACQ_REL))
+         < job->numChunks)
+  {
+    size_t offset = c*job->chunk;
+    size_t len = job->size - offset < job->chunk ?
+                 job->size - offset : job->chunk;
+    if (job->patternSize)
+    {
+      fillPattern(job->dst + offset, job->src, job->patternSize, len);
+    }
+    else
+    {
+      memcpy(job->dst + offset, job->src + offset, len);
+    }
+    __atomic_add_fetch(&job->done, 1, __ATOMIC_ACQ_REL);
+  }
+}
+
+// Copy thread, which joins in with whichever job is current
+void* copyWorker(void *arg)
+{
+  cl_ulong seen = 0;
+  pthread_mutex_lock(&m_copy.lock);
+  while (1)
+  {
+    while (!m_copy.job || m_copy.generation == seen)
+    {
+      pthread_cond_wait(&m_copy.work, &m_copy.lock);
+    }
+    struct copyJob *job = m_copy.job;
+    seen = m_copy.generation;
+    job->workers++;
+    pthread_mutex_unlock(&m_copy.lock);
+
+    copyChunks(job);
+
+    pthread_mutex_lock(&m_copy.lock);
+    job->workers--;
+    pthread_cond_broadcast(&m_copy.done);
+  }
+  return NULL;
+}
+
+void initCopyThreads()
+{
+  long threads = getEnvInt("OIW_COPY_THREADS", 4);
+  for (long i = 0; i < threads; i++)
+  {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, copyWorker, NULL) != 0)
+    {
+      break;
+    }
+    pthread_detach(thread);
+    m_copy.numThreads++;
+  }
+}
+
+// Utility function to run a copy or fill job across the copy threads
+// Returns CL_FALSE without doing anything if the threads are unavailable.
+static cl_bool runCopyJob(char *dst, const char *src,
+                          size_t pattern_size, size_t size)
+{
+  if (size < PARALLEL_COPY_SIZE || !m_copy.numThreads)
+  {
+    return CL_FALSE;
+  }
+
+  pthread_mutex_lock(&m_copy.lock);
+  if (m_copy.job)
+  {
+    pthread_mutex_unlock(&m_copy.lock);
+    return CL_FALSE;
+  }
+
+  struct copyJob job;
+  job.dst = dst;
+  job.src = src;
+  job.patternSize = pattern_size;
+  job.size = size;
+  job.chunk = size / (m_copy.numThreads + 1) + 1;
+  if (job.chunk < PARALLEL_COPY_SIZE/4)
+  {
+    job.chunk = PARALLEL_COPY_SIZE/4;
+  }
+  // Keep chunks aligned to the expanded fill pattern
+  job.chunk = (job.chunk + FILL_BLOCK_SIZE - 1) & ~(size_t)(FILL_BLOCK_SIZE-1);
+  job.numChunks = (size + job.chunk - 1) / job.chunk;
+  job.next = 0;
+  job.done = 0;
+  job.workers = 0;
+  m_copy.job = &job;
+  m_copy.generation++;
+  pthread_cond_broadcast(&m_copy.work);
+  pthread_mutex_unlock(&m_copy.lock);
+
+  copyChunks(&job);
+
+  // Wait for the other threads to finish with the job
+  pthread_mutex_lock(&m_copy.lock);
+  while (__atomic_load_n(&job.done, __ATOMIC_ACQUIRE) < job.numChunks ||
+         job.workers)
+  {
+    pthread_cond_wait(&m_copy.done, &m_copy.lock);
+  }
+  m_copy.job = NULL;
+  pthread_mutex_unlock(&m_copy.lock);
+  return CL_TRUE;
+}
+
+// Utility function to copy host memory, using the copy threads for large
+// copies. Copies that find the threads busy are done on the calling thread.
+void parallelCopy(void *dst, const void *src, size_t size)
+{
+  if (!runCopyJob(dst, src, 0, size))
+  {
+    memcpy(dst, src, size);
+  }
+}
+
+// Utility function to fill host memory with a pattern, using the copy
+// threads for large fills
+void parallelFill(void *dst, const void *pattern,
+                  size_t pattern_size, size_t size)
+{
+  char block[FILL_BLOCK_SIZE];
+  for (size_t i = 0; i < FILL_BLOCK_SIZE; i += pattern_size)
+  {
+    memcpy(block + i, pattern, pattern_size);
+  }
+  if (!runCopyJob(dst, block, pattern_size, size))
+  {
+    fillPattern(dst, block, pattern_size, size);
+  }
+}
+
+// Pinned host memory used to stage transfers
+struct stagingBuffer
+{
+  cl_mem mem;
+  void *ptr;
+  size_t size;
+  struct stagingBuffer *next;
+};
+
+// Utility function to free idle staging buffers beyond the pool limit
+// The limit follows the recent peak amount of staging memory in use, so
+// the pool grows and shrinks with the transfer volume
+void trimStaging(cl_context context, cl_command_queue _queue)
+{
+  struct stagingBuffer *freed = NULL;
+  pthread_mutex_lock(&context->stagingLock);
+  while (context->staging && context->stagingIdle > 2*context->stagingPeak)
+  {
+    struct stagingBuffer *staging = context->staging;
+    context->staging = staging->next;
+    context->stagingIdle -= staging->size;
+    staging->next = freed;
+    freed = staging;
+  }
+  pthread_mutex_unlock(&context->stagingLock);
+
+  while (freed)
+  {
+    struct stagingBuffer *next = freed->next;
+    clEnqueueUnmapMemObject(_queue, freed->mem, freed->ptr, 0, NULL, NULL);
+    clReleaseMemObject(freed->mem);
+    free(freed);
+    freed = next;
+  }
+}
+
+// Utility function to get a pinned staging buffer of at least 'size' bytes
+// Idle staging buffers are kept per context and stay mapped
+struct stagingBuffer* acquireStaging(cl_context context,
+                                     cl_command_queue _queue,
+                                     size_t size)
+{
+  pthread_mutex_lock(&context->stagingLock);
+  context->stagingInUse += size;
+  context->stagingPeak -= context->stagingPeak / 64;
+  if (context->stagingInUse > context->stagingPeak)
+  {
+    context->stagingPeak = context->stagingInUse;
+  }
+
+  // Take the smallest idle buffer that is large enough
+  struct stagingBuffer **best = NULL;
+  for (struct stagingBuffer **prev = &context->staging; *prev;
+       prev = &(*prev)->next)
+  {
+    if ((*prev)->size >= size && (!best || (*prev)->size < (*best)->size))
+    {
+      best = prev;
+    }
+  }
+  struct stagingBuffer *staging = NULL;
+  if (best)
+  {
+    staging = *best;
+    *best = staging->next;
+    context->stagingIdle -= staging->size;
+    context->stagingInUse += staging->size - size;
+  }
+  pthread_mutex_unlock(&context->stagingLock);
+  if (staging)
+  {
+    return staging;
+  }
+  trimStaging(context, _queue);
+
+  cl_int err;
+  cl_mem _mem = clCreateBuffer(
+    context->context,
+    CL_MEM_READ_WRITE | CL_MEM_ALLOC_HOST_PTR,
+    size,
+    NULL,
+    &err
+  );
+  void *ptr = NULL;
+  if (err == CL_SUCCESS)
+  {
+    ptr = clEnqueueMapBuffer(
+      _queue,
+      _mem,
+      CL_TRUE,
+      CL_MAP_READ | CL_MAP_WRITE,
+      0,
+      size,
+      0,
+      NULL,
+      NULL,
+      &err
+    );
+    if (err != CL_SUCCESS)
+    {
+      clReleaseMemObject(_mem);
+      _mem = NULL;
+    }
+  }
+  if (!_mem)
+  {
+    pthread_mutex_lock(&context->stagingLock);
+    context->stagingInUse -= size;
+    pthread_mutex_unlock(&context->stagingLock);
+    return NULL;
+  }
+
+  staging = malloc(sizeof(struct stagingBuffer));
+  staging->mem = _mem;
+  staging->ptr = ptr;
+  staging->size = size;
+  return staging;
+}
+
+// Utility function to return a staging buffer to its context
+void releaseStaging(cl_context context, struct stagingBuffer *staging)
+{
+  if (!staging)
+  {
+    return;
+  }
+  pthread_mutex_lock(&context->stagingLock);
+  staging->next = context->staging;
+  context->staging = staging;
+  context->stagingIdle += staging->size;
+  context->stagingInUse -= staging->size;
+  pthread_mutex_unlock(&context->stagingLock);
+}
+
+// Staged transfer waiting for its device side to complete
+struct stagedTransfer
+{
+  cl_context context;
+  struct stagingBuffer *staging;
+  void *ptr;
+  size_t size;
+  cl_bool read;
+  cl_event _user;
+};
+
+// Callback to finish a staged transfer once the device side completes
+// Run by the callback dispatcher rather than on the implementation's
+// thread, since the copy out of a large read can take a while.
+void CL_CALLBACK completeStagedTransfer(cl_event _event,
+                                        cl_int status,
+                                        void *user_data)
+{
+  struct stagedTransfer *transfer = user_data;
+  if (transfer->read && status == CL_COMPLETE)
+  {
+    // Copy read data out to the application before completing
+    parallelCopy(transfer->ptr, transfer->staging->ptr, transfer->size);
+  }
+  if (transfer->_user)
+  {
+    clSetUserEventStatus(transfer->_user,
+                         status < 0 ? status : CL_COMPLETE);
+    clReleaseEvent(transfer->_user);
+  }
+  releaseStaging(transfer->context, transfer->staging);
+  free(transfer);
+}
+
+// Utility function to perform a transfer to or from pageable memory through
+// a pinned staging buffer. Non-blocking reads copy their data out from a
+// completion callback, and the queue waits for that copy so that later
+// commands see the data. Their event is a marker after that wait.
+// Returns CL_INVALID_OPERATION without doing anything if no staging buffer
+// is available, or if the host memory belongs to a buffer or mapping.
+cl_int enqueueStaged(cl_bool write,
+                     cl_command_queue queue,
+                     cl_command_queue _queue,
+                     cl_mem _buffer,
+                     cl_bool blocking,
+                     size_t offset,
+                     size_t cb,
+                     void *ptr,
+                     cl_uint num_events,
+                     const cl_event *_wait_list,
+                     cl_event *_event)
+{
+  // Memory the implementation already owns or has pinned gains nothing
+  if (isHostRegion(queue->context, ptr, cb))
+  {
+    return CL_INVALID_OPERATION;
+  }
+
+  struct stagingBuffer *staging =
+    acquireStaging(queue->context, _queue, cb);
+  if (!staging)
+  {
+    return CL_INVALID_OPERATION;
+  }
+
+  cl_int err;
+  cl_event _transfer = NULL;
+  if (write)
+  {
+    parallelCopy(staging->ptr, ptr, cb);
+    err = clEnqueueWriteBuffer(_queue, _buffer, blocking, offset, cb,
+                               staging->ptr, num_events, _wait_list,
+                               &_transfer);
+  }
+  else
+  {
+    err = clEnqueueReadBuffer(_queue, _buffer, blocking, offset, cb,
+                              staging->ptr, num_events, _wait_list,
+                              &_transfer);
+    if (err == CL_SUCCESS && blocking)
+    {
+      parallelCopy(ptr, staging->ptr, cb);
+    }
+  }
+  if (err != CL_SUCCESS)
+  {
+    releaseStaging(queue->context, staging);
+    return err;
+  }
+  if (blocking)
+  {
+    releaseStaging(queue->context, staging);
+    if (_event)
+    {
+      *_event = _transfer;
+    }
+    else
+    {
+      clReleaseEvent(_transfer);
+    }
+    return CL_SUCCESS;
+  }
+
+  struct stagedTransfer *transfer = malloc(sizeof(struct stagedTransfer));
+  transfer->context = queue->context;
+  transfer->staging = staging;
+  transfer->ptr = ptr;
+  transfer->size = cb;
+  transfer->read = !write;
+  transfer->_user = NULL;
+  cl_event _complete = _transfer;
+  if (!write)
+  {
+    cl_event _user = clCreateUserEvent(queue->context->context, &err);
+    transfer->_user = _user;
+    if (err == CL_SUCCESS)
+    {
+      clRetainEvent(_user);
+      err = clEnqueueBarrierWithWaitList(_queue, 1, &_user, NULL);
+    }
+    if (err == CL_SUCCESS)
+    {
+      err = clEnqueueMarkerWithWaitList(_queue, 0, NULL, &_complete);
+    }
+    if (_user)
+    {
+      clReleaseEvent(_user);
+    }
+  }
+
+  struct callbackJob *job = createCallbackJob(
+    CALLBACK_INTERNAL, _transfer, completeStagedTransfer, transfer, 1);
+  if (err != CL_SUCCESS ||
+      clSetEventCallback(_transfer, CL_COMPLETE,
+                         dispatchEventCallback, job) != CL_SUCCESS)
+  {
+    // Complete the transfer here instead, leaving its status on the event
+    free(job);
+    cl_int status = clWaitForEvents(1, &_transfer);
+    if (status == CL_SUCCESS)
+    {
+      clGetEventInfo(_transfer, CL_EVENT_COMMAND_EXECUTION_STATUS,
+                     sizeof(cl_int), &status, NULL);
+    }
+    completeStagedTransfer(_transfer, status, transfer);
+    err = CL_SUCCESS;
+  }
+  if (_complete != _transfer)
+  {
+    clReleaseEvent(_transfer);
+  }
+
+  if (_event)
+  {
+    *_event = _complete;
+  }
+  else
+  {
+    clReleaseEvent(_complete);
+  }
+  return err;
+}
+
+// Utility function to adjust the chunk size after a pipelined transfer
+// Keeps moving in the same direction while bandwidth improves
+void updateChunkSize(size_t chunk, size_t bytes, cl_ulong elapsed)
+{
+  cl_double bandwidth = bytes / (cl_double)(elapsed ? elapsed : 1);
+
+  pthread_mutex_lock(&m_chunkLock);
+  if (chunk == m_chunkSize)
+  {
+    if (bandwidth < m_chunkBandwidth)
+    {
+      m_chunkDirection = -m_chunkDirection;
+    }
+    m_chunkBandwidth = bandwidth;
+
+    size_t next = m_chunkDirection > 0 ? chunk*2 : chunk/2;
+    if (next < MIN_CHUNK_SIZE || next > MAX_CHUNK_SIZE)
+    {
+      m_chunkDirection = -m_chunkDirection;
+      next = m_chunkDirection > 0 ? chunk*2 : chunk/2;
+    }
+    m_chunkSize = next;
+  }
+  pthread_mutex_unlock(&m_chunkLock);
+}
+
+// Utility function to perform a large blocking transfer in chunks, staged
+// through two pinned buffers so that the host copy of one chunk overlaps
+// the device transfer of the other. The returned event is the transfer of
+// the last chunk, so its profiling information only covers that chunk.
+// Returns CL_INVALID_OPERATION without doing anything if no staging
+// buffers are available, or if the host memory belongs to a buffer or
+// mapping.
+cl_int enqueuePipelined(cl_bool write,
+                        cl_command_queue queue,
+                        cl_command_queue _queue,
+                        cl_mem _buffer,
+                        size_t offset,
+                        size_t cb,
+                        void *ptr,
+                        cl_uint num_events,
+                        const cl_event *_wait_list,
+                        cl_event *_event)
+{
+  // Memory the implementation already owns or has pinned gains nothing
+  if (isHostRegion(queue->context, ptr, cb))
+  {
+    return CL_INVALID_OPERATION;
+  }
+
+  pthread_mutex_lock(&m_chunkLock);
+  size_t chunk = m_chunkSize;
+  pthread_mutex_unlock(&m_chunkLock);
+
+  struct stagingBuffer *staging[2];
+  staging[0] = acquireStaging(queue->context, _queue, chunk);
+  staging[1] = acquireStaging(queue->context, _queue, chunk);
+  if (!staging[0] || !staging[1])
+  {
+    releaseStaging(queue->context, staging[0]);
+    releaseStaging(queue->context, staging[1]);
+    return CL_INVALID_OPERATION;
+  }
+
+  cl_ulong start = getTimeNs();
+  size_t numChunks = (cb + chunk - 1) / chunk;
+  cl_event _chunks[2] = {NULL, NULL};
+  cl_event _last = NULL;
+  cl_int err = CL_SUCCESS;
+  for (size_t i = 0; i < numChunks + (write ? 0 : 2) && err == CL_SUCCESS; i++)
+  {
+    // Reads run two chunks ahead of the host copies
+    size_t c = write ? i : i - 2;
+    cl_uint b = i % 2;
+
+    // Wait for the previous transfer using this staging buffer
+    if (_chunks[b])
+    {
+      err = clWaitForEvents(1, _chunks + b);
+      clReleaseEvent(_chunks[b]);
+      _chunks[b] = NULL;
+      if (!write && err == CL_SUCCESS)
+      {
+        size_t len = cb - c*chunk < chunk ? cb - c*chunk : chunk;
+        parallelCopy((char*)ptr + c*chunk, staging[b]->ptr, len);
+      }
+    }
+    if (err != CL_SUCCESS || i >= numChunks)
+    {
+      continue;
+    }
+
+    size_t len = cb - i*chunk < chunk ? cb - i*chunk : chunk;
+    if (write)
+    {
+      parallelCopy(staging[b]->ptr, (const char*)ptr + i*chunk, len);
+      err = clEnqueueWriteBuffer(_queue, _buffer, CL_FALSE, offset + i*chunk,
+                                 len, staging[b]->ptr, num_events, _wait_list,
+                                 _chunks + b);
+    }
+    else
+    {
+      err = clEnqueueReadBuffer(_queue, _buffer, CL_FALSE, offset + i*chunk,
+                                len, staging[b]->ptr, num_events, _wait_list,
+                                _chunks + b);
+    }
+    if (err == CL_SUCCESS && i == numChunks - 1 && _event)
+    {
+      _last = _chunks[b];
+      clRetainEvent(_last);
+    }
+    clFlush(_queue);
+  }
+
+  // Staging buffers must be idle before they are reused
+  for (cl_uint b = 0; b < 2; b++)
+  {
+    if (_chunks[b])
+    {
+      cl_int wait = clWaitForEvents(1, _chunks + b);
+      err = err == CL_SUCCESS ? wait : err;
+      clReleaseEvent(_chunks[b]);
+    }
+  }
+  releaseStaging(queue->context, staging[0]);
+  releaseStaging(queue->context, staging[1]);
+
+  if (err == CL_SUCCESS && _event)
+  {
+    *_event = _last;
+  }
+  else if (_last)
+  {
+    clReleaseEvent(_last);
+  }
+  if (err == CL_SUCCESS && numChunks >= 4)
+  {
+    updateChunkSize(chunk, cb, getTimeNs() - start);
+  }
+  return err;
+}
+
+// Fill or copy performed on the host once its buffers are mapped
+struct hostCommand
+{
+  char *dst;
+  const char *src;
+  size_t size;
+  size_t patternSize;
+  char pattern[128];
+  cl_uint arrivals;
+  cl_int status;
+  cl_event _user;
+};
+
+// Callback to perform a host fill or copy, run by the callback dispatcher
+void CL_CALLBACK runHostCommand(cl_event _event,
+                                cl_int status,
+                                void *user_data)
+{
+  struct hostCommand *command = user_data;
+  if (command->status == CL_COMPLETE)
+  {
+    if (command->patternSize)
+    {
+      parallelFill(command->dst, command->pattern,
+                   command->patternSize, command->size);
+    }
+    else
+    {
+      parallelCopy(command->dst, command->src, command->size);
+    }
+  }
+  clSetUserEventStatus(command->_user, command->status);
+  clReleaseEvent(command->_user);
+  free(command);
+}
+
+// Callback to hand a host fill or copy to the callback dispatcher once both
+// of its maps complete
+void CL_CALLBACK arriveHostCommand(cl_event _event,
+                                   cl_int status,
+                                   void *user_data)
+{
+  struct hostCommand *command = user_data;
+  if (status < 0)
+  {
+    command->status = status;
+  }
+  if (__atomic_sub_fetch(&command->arrivals, 1, __ATOMIC_ACQ_REL))
+  {
+    return;
+  }
+  dispatchCallback(createCallbackJob(CALLBACK_INTERNAL, _event,
+                                     runHostCommand, command, 1));
+}
+
+// Utility function to check whether a buffer was created in host memory
+static cl_bool isHostResident(cl_mem buffer)
+{
+  return (buffer->flags & (CL_MEM_USE_HOST_PTR | CL_MEM_ALLOC_HOST_PTR)) != 0;
+}
+
+// Utility function to perform a fill (when src is NULL) or a copy between
+// host-resident buffers on the host. The buffers are mapped after the wait
+// list, filled or copied by the callback dispatcher once the maps complete,
+// and unmapped once that is done, so the returned event completes after the
+// host work.
+// Returns CL_INVALID_OPERATION without doing anything if the command does
+// not qualify.
+cl_int enqueueHostCommand(cl_command_queue queue,
+                          cl_command_queue _queue,
+                          cl_mem src,
+                          cl_mem dst,
+                          size_t src_offset,
+                          size_t dst_offset,
+                          size_t cb,
+                          const void *pattern,
+                          size_t pattern_size,
+                          cl_uint num_events,
+                          const cl_event *_wait_list,
+                          cl_event *_event)
+{
+  if (!queue->hostCommands || !cb || !isHostResident(dst) ||
+      (src && !isHostResident(src)))
+  {
+    return CL_INVALID_OPERATION;
+  }
+  if (src)
+  {
+    // Leave copies within the same memory to the implementation
+    if (getRootBuffer(src) == getRootBuffer(dst))
+    {
+      return CL_INVALID_OPERATION;
+    }
+  }
+  else if (!pattern || !pattern_size || pattern_size > 128 ||
+           (pattern_size & (pattern_size - 1)) ||
+           dst_offset % pattern_size || cb % pattern_size)
+  {
+    // Leave invalid fills for the implementation to report
+    return CL_INVALID_OPERATION;
+  }
+
+  cl_int err;
+  struct hostCommand *command = malloc(sizeof(struct hostCommand));
+  command->_user = clCreateUserEvent(queue->context->context, &err);
+  if (err != CL_SUCCESS)
+  {
+    free(command);
+    return CL_INVALID_OPERATION;
+  }
+
+  // Map both buffers behind the wait list
+  cl_event _maps[2] = {NULL, NULL};
+  void *srcPtr = NULL;
+  if (src)
+  {
+    srcPtr = clEnqueueMapBuffer(_queue, src->mem, CL_FALSE, CL_MAP_READ,
+                                src_offset, cb, num_events, _wait_list,
+                                _maps, &err);
+  }
+  void *dstPtr = NULL;
+  if (err == CL_SUCCESS)
+  {
+    dstPtr = clEnqueueMapBuffer(_queue, dst->mem, CL_FALSE, CL_MAP_WRITE,
+                                dst_offset, cb, num_events, _wait_list,
+                                _maps + 1, &err);
+  }
+  if (err != CL_SUCCESS)
+  {
+    if (_maps[0])
+    {
+      clEnqueueUnmapMemObject(_queue, src->mem, srcPtr, 1, _maps, NULL);
+      clReleaseEvent(_maps[0]);
+    }
+    clReleaseEvent(command->_user);
+    free(command);
+    return CL_INVALID_OPERATION;
+  }
+
+  command->dst = dstPtr;
+  command->src = srcPtr;
+  command->size = cb;
+  command->patternSize = src ? 0 : pattern_size;
+  if (!src)
+  {
+    memcpy(command->pattern, pattern, pattern_size);
+  }
+  command->arrivals = src ? 2 : 1;
+  command->status = CL_COMPLETE;
+  cl_event _user = command->_user;
+  clRetainEvent(_user);
+  for (cl_uint i = src ? 0 : 1; i < 2; i++)
+  {
+    if (clSetEventCallback(_maps[i], CL_COMPLETE,
+                           arriveHostCommand, command) != CL_SUCCESS)
+    {
+      // Wait for the map here instead, so the unmaps are not left waiting
+      cl_int status = clWaitForEvents(1, _maps + i);
+      if (status == CL_SUCCESS)
+      {
+        clGetEventInfo(_maps[i], CL_EVENT_COMMAND_EXECUTION_STATUS,
+                       sizeof(cl_int), &status, NULL);
+      }
+      arriveHostCommand(_maps[i], status, command);
+    }
+    clReleaseEvent(_maps[i]);
+  }
+
+  // Unmap once the host work is done
+  cl_event _unmaps[2] = {_user, NULL};
+  if (src)
+  {
+    err = clEnqueueUnmapMemObject(_queue, src->mem, srcPtr, 1, &_user,
+                                  _unmaps + 1);
+  }
+  cl_int unmap = clEnqueueUnmapMemObject(_queue, dst->mem, dstPtr,
+                                         _unmaps[1] ? 2 : 1, _unmaps,
+                                         _event);
+  if (err == CL_SUCCESS)
+  {
+    err = unmap;
+  }
+  if (_unmaps[1])
+  {
+    clReleaseEvent(_unmaps[1]);
+  }
+  clReleaseEvent(_user);
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueReadBuffer_(cl_command_queue     command_queue ,
+                      cl_mem               buffer ,
+                      cl_bool              blocking_read ,
+                      size_t               offset ,
+                      size_t               cb ,
+                      void *               ptr ,
+                      cl_uint              num_events_in_wait_list ,
+                      const cl_event *     event_wait_list ,
+                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Hold back reads to merge them with adjacent ones
+  if (coalesceTransfer(command_queue, CL_COMMAND_READ_BUFFER, buffer, NULL,
+                       blocking_read, offset, 0, cb, ptr,
+                       num_events_in_wait_list, event))
+  {
+    return CL_SUCCESS;
+  }
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // The host memory it uses is not tracked
+  orderHostAccess(command_queue);
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_TRUE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] = {{buffer, CL_FALSE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    1,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Pipeline large blocking transfers through pinned memory
+  err = CL_INVALID_OPERATION;
+  if (blocking_read && m_pipelineThreshold && cb >= m_pipelineThreshold && ptr)
+  {
+    err = enqueuePipelined(
+      CL_FALSE,
+      command_queue,
+      _queue,
+      buffer->mem,
+      offset,
+      cb,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  else if (m_stagingThreshold && cb >= m_stagingThreshold && ptr)
+  {
+    // Route pageable host memory through pinned memory
+    err = enqueueStaged(
+      CL_FALSE,
+      command_queue,
+      _queue,
+      buffer->mem,
+      blocking_read,
+      offset,
+      cb,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    err = clEnqueueReadBuffer(
+      _queue,
+      buffer->mem,
+      blocking_read,
+      offset,
+      cb,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 1, accesses, err, _event);
+
+  // Create wrapper object
+  // Non-blocking staged reads complete with a marker, which should still
+  // be reported as a read
+  completeCommand(command_queue, _queue, err, _event, event);
+  if (err == CL_SUCCESS && event)
+  {
+    (*event)->commandType = CL_COMMAND_READ_BUFFER;
+  }
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    struct graphNode *node = recordCommand(
+      command_queue,
+      CL_COMMAND_READ_BUFFER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    recordMem(node, 0, buffer);
+    node->offset[0] = offset;
+    node->size = cb;
+    node->ptr = ptr;
+  }
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+// Ways of performing a rect transfer
+#define RECT_VENDOR 0
+#define RECT_ROWS   1
+#define RECT_SPAN   2
+#define NUM_RECT_STRATEGIES 3
+
+// Blocking transfers measured per strategy before trusting the results
+#define RECT_SAMPLES 4
+
+// Most rows transferred individually
+#define RECT_MAX_ROWS 256
+
+// Largest span read into temporary memory
+#define RECT_MAX_SPAN (16<<20)
+
+// Measured cost of each strategy, by rect shape
+struct rectStats
+{
+  cl_double nsPerByte[NUM_RECT_STRATEGIES];
+  cl_uint samples[NUM_RECT_STRATEGIES];
+};
+static struct rectStats m_rectStats[2][16][16];
+static pthread_mutex_t m_rectLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Utility function to apply the default pitches of a rect transfer
+void getRectPitches(const size_t *region,
+                    size_t *row_pitch,
+                    size_t *slice_pitch)
+{
+  if (!*row_pitch)
+  {
+    *row_pitch = region[0];
+  }
+  if (!*slice_pitch)
+  {
+    *slice_pitch = region[1] * *row_pitch;
+  }
+}
+
+// Utility function to get the offset of a rect region, if the region is
+// contiguous in memory
+cl_bool getLinearOffset(const size_t *origin,
+                        const size_t *region,
+                        size_t row_pitch,
+                        size_t slice_pitch,
+                        size_t *offset)
+{
+  getRectPitches(region, &row_pitch, &slice_pitch);
+  if ((region[1] > 1 && row_pitch != region[0]) ||
+      (region[2] > 1 && slice_pitch != region[0]*region[1]))
+  {
+    return CL_FALSE;
+  }
+  *offset = origin[2]*slice_pitch + origin[1]*row_pitch + origin[0];
+  return CL_TRUE;
+}
+
+// Utility function to make the event of a rect transfer that was performed
+// as linear transfers report the rect command type
+void setRectCommandType(cl_int err, cl_event *event, cl_command_type type)
+{
+  if (err == CL_SUCCESS && event)
+  {
+    (*event)->commandType = type;
+  }
+}
+
+// Utility function to get the cost statistics for a rect shape
+struct rectStats* getRectStats(cl_bool write, const size_t *region)
+{
+  cl_uint width = 0, rows = 0;
+  for (size_t w = region[0]; w > 1 && width < 15; w >>= 1)
+  {
+    width++;
+  }
+  for (size_t r = region[1]*region[2]; r > 1 && rows < 15; r >>= 1)
+  {
+    rows++;
+  }
+  return &m_rectStats[write][width][rows];
+}
+
+// Utility function to check whether a rect transfer has narrow rows,
+// which some implementations handle much more slowly than linear transfers
+cl_bool isNarrowRect(cl_command_queue queue, const size_t *region)
+{
+  return (queue->numQueues == 1 || queue->perThread || queue->dualQueue) &&
+         region[0] < m_rectSplitWidth &&
+         region[1]*region[2] > 1;
+}
+
+// Utility function to choose how to perform a narrow rect transfer
+// Only blocking transfers can be timed, so they also explore strategies
+// that have not been measured yet
+cl_uint selectRectStrategy(cl_bool write,
+                           cl_bool blocking,
+                           const size_t *region,
+                           size_t buffer_row_pitch,
+                           size_t buffer_slice_pitch)
+{
+  size_t rows = region[1]*region[2];
+  getRectPitches(region, &buffer_row_pitch, &buffer_slice_pitch);
+
+  // Row transfers are ordered through a trailing marker
+  cl_bool allowed[NUM_RECT_STRATEGIES];
+  allowed[RECT_VENDOR] = CL_TRUE;
+  allowed[RECT_ROWS] = rows <= RECT_MAX_ROWS;
+  allowed[RECT_SPAN] = CL_FALSE;
+  if (!write && blocking)
+  {
+    // Reading the whole span wastes bandwidth on the gaps between rows
+    size_t span = (region[2] - 1)*buffer_slice_pitch +
+                  (region[1] - 1)*buffer_row_pitch + region[0];
+    allowed[RECT_SPAN] = span <= 8*rows*region[0] && span <= RECT_MAX_SPAN;
+  }
+
+  struct rectStats *stats = getRectStats(write, region);
+  cl_uint strategy = RECT_VENDOR;
+  pthread_mutex_lock(&m_rectLock);
+  for (cl_uint i = 0; i < NUM_RECT_STRATEGIES; i++)
+  {
+    if (!allowed[i])
+    {
+      continue;
+    }
+    if (stats->samples[i] < RECT_SAMPLES)
+    {
+      if (blocking)
+      {
+        strategy = i;
+        break;
+      }
+      continue;
+    }
+    if (stats->samples[strategy] < RECT_SAMPLES ||
+        stats->nsPerByte[i] < stats->nsPerByte[strategy])
+    {
+      strategy = i;
+    }
+  }
+  if (!blocking && stats->samples[strategy] < RECT_SAMPLES)
+  {
+    strategy = RECT_VENDOR;
+  }
+  pthread_mutex_unlock(&m_rectLock);
+
+  return strategy;
+}
+
+// Utility function to record the duration of a blocking rect transfer
+void updateRectStats(cl_bool write,
+                     const size_t *region,
+                     cl_uint strategy,
+                     cl_ulong elapsed)
+{
+  struct rectStats *stats = getRectStats(write, region);
+  cl_double nsPerByte =
+    elapsed / (cl_double)(region[0]*region[1]*region[2]);
+
+  pthread_mutex_lock(&m_rectLock);
+  if (stats->samples[strategy]++)
+  {
+    stats->nsPerByte[strategy] +=
+      (nsPerByte - stats->nsPerByte[strategy]) / 8;
+  }
+  else
+  {
+    stats->nsPerByte[strategy] = nsPerByte;
+  }
+  pthread_mutex_unlock(&m_rectLock);
+}
+
+// Utility function to perform a rect transfer with linear transfers,
+// either one per row or one covering the whole region
+// Returns CL_INVALID_OPERATION without doing anything if there is no memory
+// to read the whole region into.
+cl_int enqueueRectLinear(cl_uint strategy,
+                         cl_bool write,
+                         cl_command_queue _queue,
+                         cl_mem _buffer,
+                         cl_bool blocking,
+                         const size_t *buffer_origin,
+                         const size_t *host_origin,
+                         const size_t *region,
+                         size_t buffer_row_pitch,
+                         size_t buffer_slice_pitch,
+                         size_t host_row_pitch,
+                         size_t host_slice_pitch,
+                         void *ptr,
+                         cl_uint num_events,
+                         const cl_event *_wait_list,
+                         cl_event *_event)
+{
+  getRectPitches(region, &buffer_row_pitch, &buffer_slice_pitch);
+  getRectPitches(region, &host_row_pitch, &host_slice_pitch);
+  size_t bufferBase = buffer_origin[2]*buffer_slice_pitch +
+                      buffer_origin[1]*buffer_row_pitch + buffer_origin[0];
+  size_t hostBase = host_origin[2]*host_slice_pitch +
+                    host_origin[1]*host_row_pitch + host_origin[0];
+
+  cl_int err = CL_SUCCESS;
+  if (strategy == RECT_SPAN)
+  {
+    // Read everything between the first and last row, then unpack
+    size_t span = (region[2] - 1)*buffer_slice_pitch +
+                  (region[1] - 1)*buffer_row_pitch + region[0];
+    unsigned char *data = malloc(span);
+    if (!data)
+    {
+      return CL_INVALID_OPERATION;
+    }
+    err = clEnqueueReadBuffer(_queue, _buffer, CL_TRUE, bufferBase, span,
+                              data, num_events, _wait_list, _event);
+    for (size_t z = 0; z < region[2] && err == CL_SUCCESS; z++)
+    {
+      for (size_t y = 0; y < region[1]; y++)
+      {
+        memcpy((char*)ptr + hostBase + z*host_slice_pitch + y*host_row_pitch,
+               data + z*buffer_slice_pitch + y*buffer_row_pitch,
+               region[0]);
+      }
+    }
+    free(data);
+    return err;
+  }
+
+  // Every row waits for the wait list, and a marker after the last row
+  // stands in for the whole transfer
+  for (size_t z = 0; z < region[2] && err == CL_SUCCESS; z++)
+  {
+    for (size_t y = 0; y < region[1] && err == CL_SUCCESS; y++)
+    {
+      size_t offset = bufferBase + z*buffer_slice_pitch + y*buffer_row_pitch;
+      char *host = (char*)ptr + hostBase + z*host_slice_pitch +
+                   y*host_row_pitch;
+      if (write)
+      {
+        err = clEnqueueWriteBuffer(_queue, _buffer, CL_FALSE, offset,
+                                   region[0], host, num_events, _wait_list,
+                                   NULL);
+      }
+      else
+      {
+        err = clEnqueueReadBuffer(_queue, _buffer, CL_FALSE, offset,
+                                  region[0], host, num_events, _wait_list,
+                                  NULL);
+      }
+    }
+  }
+
+  cl_event _marker = NULL;
+  if (err == CL_SUCCESS && (_event || blocking))
+  {
+    err = clEnqueueMarkerWithWaitList(_queue, 0, NULL, &_marker);
+  }
+  if (err == CL_SUCCESS && blocking)
+  {
+    err = clWaitForEvents(1, &_marker);
+  }
+  if (_marker)
+  {
+    if (_event && err == CL_SUCCESS)
+    {
+      *_event = _marker;
+    }
+    else
+    {
+      clReleaseEvent(_marker);
+    }
+  }
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueReadBufferRect_(cl_command_queue     command_queue ,
+                          cl_mem               buffer ,
+                          cl_bool              blocking_read ,
+                          const size_t *       buffer_origin ,
+                          const size_t *       host_origin ,
+                          const size_t *       region ,
+                          size_t               buffer_row_pitch ,
+                          size_t               buffer_slice_pitch ,
+                          size_t               host_row_pitch ,
+                          size_t               host_slice_pitch ,
+                          void *               ptr ,
+                          cl_uint              num_events_in_wait_list ,
+                          const cl_event *     event_wait_list ,
+                          cl_event *           event) CL_API_SUFFIX__VERSION_1_1
+{
+  // Transfer contiguous regions linearly
+  size_t offset, hostOffset;
+  if (buffer_origin && host_origin && region &&
+      getLinearOffset(buffer_origin, region,
+                      buffer_row_pitch, buffer_slice_pitch, &offset) &&
+      getLinearOffset(host_origin, region,
+                      host_row_pitch, host_slice_pitch, &hostOffset))
+  {
+    cl_int err = _clEnqueueReadBuffer_(
+      command_queue,
+      buffer,
+      blocking_read,
+      offset,
+      region[0]*region[1]*region[2],
+      (char*)ptr + hostOffset,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    setRectCommandType(err, event, CL_COMMAND_READ_BUFFER_RECT);
+    return err;
+  }
+
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // The host memory it uses is not tracked
+  orderHostAccess(command_queue);
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_TRUE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] = {{buffer, CL_FALSE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    1,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Use whichever of the implementation's rect transfer and equivalent
+  // linear transfers has been measured to be fastest for this shape
+  cl_uint strategy = RECT_VENDOR;
+  cl_bool measure = CL_FALSE;
+  if (buffer_origin && host_origin && region && ptr &&
+      isNarrowRect(command_queue, region))
+  {
+    strategy = selectRectStrategy(CL_FALSE, blocking_read, region,
+                                  buffer_row_pitch, buffer_slice_pitch);
+    measure = blocking_read;
+  }
+  cl_ulong start = getTimeNs();
+  err = CL_INVALID_OPERATION;
+  if (strategy != RECT_VENDOR)
+  {
+    err = enqueueRectLinear(
+      strategy,
+      CL_FALSE,
+      _queue,
+      buffer->mem,
+      blocking_read,
+      buffer_origin,
+      host_origin,
+      region,
+      buffer_row_pitch,
+      buffer_slice_pitch,
+      host_row_pitch,
+      host_slice_pitch,
+      (void*)ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    strategy = RECT_VENDOR;
+    err = clEnqueueReadBufferRect(
+      _queue,
+      buffer->mem,
+      blocking_read,
+      buffer_origin,
+      host_origin,
+      region,
+      buffer_row_pitch,
+      buffer_slice_pitch,
+      host_row_pitch,
+      host_slice_pitch,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (measure && err == CL_SUCCESS)
+  {
+    updateRectStats(CL_FALSE, region, strategy, getTimeNs() - start);
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 1, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  if (strategy != RECT_VENDOR)
+  {
+    setRectCommandType(err, event, CL_COMMAND_READ_BUFFER_RECT);
+  }
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueWriteBuffer_(cl_command_queue    command_queue ,
+                       cl_mem              buffer ,
+                       cl_bool             blocking_write ,
+                       size_t              offset ,
+                       size_t              cb ,
+                       const void *        ptr ,
+                       cl_uint             num_events_in_wait_list ,
+                       const cl_event *    event_wait_list ,
+                       cl_event *          event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Hold back small writes to combine them into one transfer
+  if (combineWrite(command_queue, buffer, blocking_write, offset, cb, ptr,
+                   num_events_in_wait_list, event))
+  {
+    return CL_SUCCESS;
+  }
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // The host memory it uses is not tracked
+  orderHostAccess(command_queue);
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_TRUE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] = {{buffer, CL_TRUE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    1,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Pipeline large blocking transfers through pinned memory
+  err = CL_INVALID_OPERATION;
+  if (blocking_write && m_pipelineThreshold && cb >= m_pipelineThreshold && ptr)
+  {
+    err = enqueuePipelined(
+      CL_TRUE,
+      command_queue,
+      _queue,
+      buffer->mem,
+      offset,
+      cb,
+      (void*)ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  else if (m_stagingThreshold && cb >= m_stagingThreshold && ptr)
+  {
+    // Route pageable host memory through pinned memory
+    err = enqueueStaged(
+      CL_TRUE,
+      command_queue,
+      _queue,
+      buffer->mem,
+      blocking_write,
+      offset,
+      cb,
+      (void*)ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    err = clEnqueueWriteBuffer(
+      _queue,
+      buffer->mem,
+      blocking_write,
+      offset,
+      cb,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 1, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    struct graphNode *node = recordCommand(
+      command_queue,
+      CL_COMMAND_WRITE_BUFFER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    recordMem(node, 0, buffer);
+    node->offset[0] = offset;
+    node->size = cb;
+    node->ptr = (void*)ptr;
+  }
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueWriteBufferRect_(cl_command_queue     command_queue ,
+                           cl_mem               buffer ,
+                           cl_bool              blocking_write ,
+                           const size_t *       buffer_origin ,
+                           const size_t *       host_origin ,
+                           const size_t *       region ,
+                           size_t               buffer_row_pitch ,
+                           size_t               buffer_slice_pitch ,
+                           size_t               host_row_pitch ,
+                           size_t               host_slice_pitch ,
+                           const void *         ptr ,
+                           cl_uint              num_events_in_wait_list ,
+                           const cl_event *     event_wait_list ,
+                           cl_event *           event) CL_API_SUFFIX__VERSION_1_1
+{
+  // Transfer contiguous regions linearly
+  size_t offset, hostOffset;
+  if (buffer_origin && host_origin && region &&
+      getLinearOffset(buffer_origin, region,
+                      buffer_row_pitch, buffer_slice_pitch, &offset) &&
+      getLinearOffset(host_origin, region,
+                      host_row_pitch, host_slice_pitch, &hostOffset))
+  {
+    cl_int err = _clEnqueueWriteBuffer_(
+      command_queue,
+      buffer,
+      blocking_write,
+      offset,
+      region[0]*region[1]*region[2],
+      (const char*)ptr + hostOffset,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    setRectCommandType(err, event, CL_COMMAND_WRITE_BUFFER_RECT);
+    return err;
+  }
+
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // The host memory it uses is not tracked
+  orderHostAccess(command_queue);
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_TRUE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] = {{buffer, CL_TRUE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    1,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Use whichever of the implementation's rect transfer and equivalent
+  // linear transfers has been measured to be fastest for this shape
+  cl_uint strategy = RECT_VENDOR;
+  cl_bool measure = CL_FALSE;
+  if (buffer_origin && host_origin && region && ptr &&
+      isNarrowRect(command_queue, region))
+  {
+    strategy = selectRectStrategy(CL_TRUE, blocking_write, region,
+                                  buffer_row_pitch, buffer_slice_pitch);
+    measure = blocking_write;
+  }
+  cl_ulong start = getTimeNs();
+  err = CL_INVALID_OPERATION;
+  if (strategy != RECT_VENDOR)
+  {
+    err = enqueueRectLinear(
+      strategy,
+      CL_TRUE,
+      _queue,
+      buffer->mem,
+      blocking_write,
+      buffer_origin,
+      host_origin,
+      region,
+      buffer_row_pitch,
+      buffer_slice_pitch,
+      host_row_pitch,
+      host_slice_pitch,
+      (void*)ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    strategy = RECT_VENDOR;
+    err = clEnqueueWriteBufferRect(
+      _queue,
+      buffer->mem,
+      blocking_write,
+      buffer_origin,
+      host_origin,
+      region,
+      buffer_row_pitch,
+      buffer_slice_pitch,
+      host_row_pitch,
+      host_slice_pitch,
+      ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  if (measure && err == CL_SUCCESS)
+  {
+    updateRectStats(CL_TRUE, region, strategy, getTimeNs() - start);
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 1, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  if (strategy != RECT_VENDOR)
+  {
+    setRectCommandType(err, event, CL_COMMAND_WRITE_BUFFER_RECT);
+  }
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueCopyBuffer_(cl_command_queue     command_queue ,
+                      cl_mem               src_buffer ,
+                      cl_mem               dst_buffer ,
+                      size_t               src_offset ,
+                      size_t               dst_offset ,
+                      size_t               cb ,
+                      cl_uint              num_events_in_wait_list ,
+                      const cl_event *     event_wait_list ,
+                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Hold back copies to merge them with adjacent ones
+  if (coalesceTransfer(command_queue, CL_COMMAND_COPY_BUFFER,
+                       src_buffer, dst_buffer, CL_FALSE,
+                       src_offset, dst_offset, cb, NULL,
+                       num_events_in_wait_list, event))
+  {
+    return CL_SUCCESS;
+  }
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(src_buffer, _queue);
+  releaseMappings(dst_buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] =
+    {{src_buffer, CL_FALSE}, {dst_buffer, CL_TRUE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    2,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Copy between host-resident buffers on the host
+  err = enqueueHostCommand(
+    command_queue,
+    _queue,
+    src_buffer,
+    dst_buffer,
+    src_offset,
+    dst_offset,
+    cb,
+    NULL,
+    0,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    err = clEnqueueCopyBuffer(
+      _queue,
+      src_buffer->mem,
+      dst_buffer->mem,
+      src_offset,
+      dst_offset,
+      cb,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 2, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    struct graphNode *node = recordCommand(
+      command_queue,
+      CL_COMMAND_COPY_BUFFER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    recordMem(node, 0, src_buffer);
+    recordMem(node, 1, dst_buffer);
+    node->offset[0] = src_offset;
+    node->offset[1] = dst_offset;
+    node->size = cb;
+  }
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueCopyBufferRect_(cl_command_queue     command_queue ,
+                          cl_mem               src_buffer ,
+                          cl_mem               dst_buffer ,
+                          const size_t *       src_origin ,
+                          const size_t *       dst_origin ,
+                          const size_t *       region ,
+                          size_t               src_row_pitch ,
+                          size_t               src_slice_pitch ,
+                          size_t               dst_row_pitch ,
+                          size_t               dst_slice_pitch ,
+                          cl_uint              num_events_in_wait_list ,
+                          const cl_event *     event_wait_list ,
+                          cl_event *           event) CL_API_SUFFIX__VERSION_1_1
+{
+  // Copy contiguous regions linearly
+  size_t srcOffset, dstOffset;
+  if (src_origin && dst_origin && region &&
+      getLinearOffset(src_origin, region,
+                      src_row_pitch, src_slice_pitch, &srcOffset) &&
+      getLinearOffset(dst_origin, region,
+                      dst_row_pitch, dst_slice_pitch, &dstOffset))
+  {
+    cl_int err = _clEnqueueCopyBuffer_(
+      command_queue,
+      src_buffer,
+      dst_buffer,
+      srcOffset,
+      dstOffset,
+      region[0]*region[1]*region[2],
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    setRectCommandType(err, event, CL_COMMAND_COPY_BUFFER_RECT);
+    return err;
+  }
+
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(src_buffer, _queue);
+  releaseMappings(dst_buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] =
+    {{src_buffer, CL_FALSE}, {dst_buffer, CL_TRUE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    2,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Call original function
+  err = clEnqueueCopyBufferRect(
+    _queue,
+    src_buffer->mem,
+    dst_buffer->mem,
+    src_origin,
+    dst_origin,
+    region,
+    src_row_pitch,
+    src_slice_pitch,
+    dst_row_pitch,
+    dst_slice_pitch,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 2, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueFillBuffer_(cl_command_queue    command_queue ,
+                      cl_mem              buffer ,
+                      const void *        pattern ,
+                      size_t              pattern_size ,
+                      size_t              offset ,
+                      size_t              cb ,
+                      cl_uint             num_events_in_wait_list ,
+                      const cl_event *    event_wait_list ,
+                      cl_event *          event) CL_API_SUFFIX__VERSION_1_2
+{
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Wait for earlier commands that use the same memory
+  struct memAccess accesses[] = {{buffer, CL_TRUE}};
+  _wait_list = inferDependencies(
+    command_queue,
+    1,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
+  // Fill host-resident buffers on the host
+  err = enqueueHostCommand(
+    command_queue,
+    _queue,
+    NULL,
+    buffer,
+    0,
+    offset,
+    cb,
+    pattern,
+    pattern_size,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+  if (err == CL_INVALID_OPERATION)
+  {
+    // Call original function
+    err = clEnqueueFillBuffer(
+      _queue,
+      buffer->mem,
+      pattern,
+      pattern_size,
+      offset,
+      cb,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, 1, accesses, err, _event);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    struct graphNode *node = recordCommand(
+      command_queue,
+      CL_COMMAND_FILL_BUFFER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
+    recordMem(node, 0, buffer);
+    node->offset[0] = offset;
+    node->size = cb;
+    node->pattern = malloc(pattern_size);
+    memcpy(node->pattern, pattern, pattern_size);
+    node->patternSize = pattern_size;
+  }
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueFillImage_(cl_command_queue    command_queue ,
+                     cl_mem              image ,
+                     const void *        fill_color ,
+                     const size_t *      origin ,
+                     const size_t *      region ,
+                     cl_uint             num_events_in_wait_list ,
+                     const cl_event *    event_wait_list ,
+                     cl_event *          event) CL_API_SUFFIX__VERSION_1_2
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(image, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Call original function
+  err = clEnqueueFillImage(
+    _queue,
+    image->mem,
+    fill_color,
+    origin,
+    region,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueReadImage_(cl_command_queue      command_queue ,
+                     cl_mem                image ,
+                     cl_bool               blocking_read ,
+                     const size_t *        origin ,
+                     const size_t *        region ,
+                     size_t                row_pitch ,
+                     size_t                slice_pitch ,
+                     void *                ptr ,
+                     cl_uint               num_events_in_wait_list ,
+                     const cl_event *      event_wait_list ,
+                     cl_event *            event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(image, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Call original function
+  err = clEnqueueReadImage(
+    _queue,
+    image->mem,
+    blocking_read,
+    origin,
+    region,
+    row_pitch,
+    slice_pitch,
+    ptr,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueWriteImage_(cl_command_queue     command_queue ,
+                      cl_mem               image ,
+                      cl_bool              blocking_write ,
+                      const size_t *       origin ,
+                      const size_t *       region ,
+                      size_t               input_row_pitch ,
+                      size_t               input_slice_pitch ,
+                      const void *         ptr ,
+                      cl_uint              num_events_in_wait_list ,
+                      const cl_event *     event_wait_list ,
+                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(image, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Call original function
+  err = clEnqueueWriteImage(
+    _queue,
+    image->mem,
+    blocking_write,
+    origin,
+    region,
+    input_row_pitch,
+    input_slice_pitch,
+    ptr,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
   );
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
 }
 
-/* Profiling APIs  */
 CL_API_ENTRY cl_int CL_API_CALL
-_clGetEventProfilingInfo_(cl_event             event ,
-                          cl_profiling_info    param_name ,
-                          size_t               param_value_size ,
-                          void *               param_value ,
-                          size_t *             param_value_size_ret) CL_API_SUFFIX__VERSION_1_0
+_clEnqueueCopyImage_(cl_command_queue      command_queue ,
+                     cl_mem                src_image ,
+                     cl_mem                dst_image ,
+                     const size_t *        src_origin ,
+                     const size_t *        dst_origin ,
+                     const size_t *        region ,
+                     cl_uint               num_events_in_wait_list ,
+                     const cl_event *      event_wait_list ,
+                     cl_event *            event) CL_API_SUFFIX__VERSION_1_0
 {
-  return clGetEventProfilingInfo(
-    event->event,
-    param_name,
-    param_value_size,
-    param_value,
-    param_value_size_ret
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
   );
-}
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clFlush_(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
-{
-  return clFlush(command_queue->queue);
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(src_image, _queue);
+  releaseMappings(dst_image, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Call original function
+  err = clEnqueueCopyImage(
+    _queue,
+    src_image->mem,
+    dst_image->mem,
+    src_origin,
+    dst_origin,
+    region,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clFinish_(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
+_clEnqueueCopyImageToBuffer_(cl_command_queue  command_queue ,
+                             cl_mem            src_image ,
+                             cl_mem            dst_buffer ,
+                             const size_t *    src_origin ,
+                             const size_t *    region ,
+                             size_t            dst_offset ,
+                             cl_uint           num_events_in_wait_list ,
+                             const cl_event *  event_wait_list ,
+                             cl_event *        event) CL_API_SUFFIX__VERSION_1_0
 {
-  return clFinish(command_queue->queue);
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(src_image, _queue);
+  releaseMappings(dst_buffer, _queue);
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Call original function
+  err = clEnqueueCopyImageToBuffer(
+    _queue,
+    src_image->mem,
+    dst_buffer->mem,
+    src_origin,
+    region,
+    dst_offset,
+    num_events_in_wait_list,
+    _wait_list,
+    _event
+  );
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueReadBuffer_(cl_command_queue     command_queue ,
-                      cl_mem               buffer ,
-                      cl_bool              blocking_read ,
-                      size_t               offset ,
-                      size_t               cb ,
-                      void *               ptr ,
-                      cl_uint              num_events_in_wait_list ,
-                      const cl_event *     event_wait_list ,
-                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+_clEnqueueCopyBufferToImage_(cl_command_queue  command_queue ,
+                             cl_mem            src_buffer ,
+                             cl_mem            dst_image ,
+                             size_t            src_offset ,
+                             const size_t *    dst_origin ,
+                             const size_t *    region ,
+                             cl_uint           num_events_in_wait_list ,
+                             const cl_event *  event_wait_list ,
+                             cl_event *        event) CL_API_SUFFIX__VERSION_1_0
 {
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(src_buffer, _queue);
+  releaseMappings(dst_image, _queue);
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
   // Call original function
-  cl_int err = clEnqueueReadBuffer(
-    command_queue->queue,
-    buffer->mem,
-    blocking_read,
-    offset,
-    cb,
-    ptr,
+  err = clEnqueueCopyBufferToImage(
+    _queue,
+    src_buffer->mem,
+    dst_image->mem,
+    src_offset,
+    dst_origin,
+    region,
     num_events_in_wait_list,
     _wait_list,
     _event
   );
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
-  }
-  if (_wait_list)
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY void * CL_API_CALL
+_clEnqueueMapBuffer_(cl_command_queue  command_queue ,
+                     cl_mem            buffer ,
+                     cl_bool           blocking_map ,
+                     cl_map_flags      map_flags ,
+                     size_t            offset ,
+                     size_t            cb ,
+                     cl_uint           num_events_in_wait_list ,
+                     const cl_event *  event_wait_list ,
+                     cl_event *        event ,
+                     cl_int *          errcode_ret) CL_API_SUFFIX__VERSION_1_0
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    if (errcode_ret)
+    {
+      *errcode_ret = err;
+    }
+    return NULL;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_event = NULL;
+  if (event || needsEvent(command_queue))
+  {
+    _event = malloc(sizeof(cl_event));
+  }
+
+  // Reuse a cached mapping of the region if possible
+  void *ret = NULL;
+  if (m_mapCache && !buffer->parent)
+  {
+    ret = findMapping(buffer, map_flags, offset, cb);
+  }
+  if (ret)
+  {
+    // Only the wait list needs to be honoured
+    err = CL_SUCCESS;
+    cl_event _marker = NULL;
+    if (num_events_in_wait_list || _event)
+    {
+      err = clEnqueueMarkerWithWaitList(
+        _queue,
+        num_events_in_wait_list,
+        _wait_list,
+        &_marker
+      );
+    }
+    if (err == CL_SUCCESS && _marker && blocking_map)
+    {
+      err = clWaitForEvents(1, &_marker);
+    }
+    if (_marker)
+    {
+      if (_event)
+      {
+        *_event = _marker;
+      }
+      else
+      {
+        clReleaseEvent(_marker);
+      }
+    }
+  }
+  else
+  {
+    // Overlapping cached mappings must not outlive a new real mapping
+    releaseMappings(buffer, _queue);
+
+    // Call original function
+    ret = clEnqueueMapBuffer(
+      _queue,
+      buffer->mem,
+      blocking_map,
+      map_flags,
+      offset,
+      cb,
+      num_events_in_wait_list,
+      _wait_list,
+      _event,
+      &err
+    );
+    if (err == CL_SUCCESS && m_mapCache && !buffer->parent)
+    {
+      addMapping(buffer, _queue, map_flags, offset, cb, ret);
+    }
+  }
+
+  if (err == CL_SUCCESS)
+  {
+    addHostRegion(buffer, ret, cb);
+  }
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return ret;
+}
+
+CL_API_ENTRY void * CL_API_CALL
+_clEnqueueMapImage_(cl_command_queue   command_queue ,
+                    cl_mem             image ,
+                    cl_bool            blocking_map ,
+                    cl_map_flags       map_flags ,
+                    const size_t *     origin ,
+                    const size_t *     region ,
+                    size_t *           image_row_pitch ,
+                    size_t *           image_slice_pitch ,
+                    cl_uint            num_events_in_wait_list ,
+                    const cl_event *   event_wait_list ,
+                    cl_event *         event ,
+                    cl_int *           errcode_ret) CL_API_SUFFIX__VERSION_1_0
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
   {
-    free(_wait_list);
+    if (errcode_ret)
+    {
+      *errcode_ret = err;
+    }
+    return NULL;
   }
 
-  return err;
-}
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseMappings(image, _queue);
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueReadBufferRect_(cl_command_queue     command_queue ,
-                          cl_mem               buffer ,
-                          cl_bool              blocking_read ,
-                          const size_t *       buffer_origin ,
-                          const size_t *       host_origin ,
-                          const size_t *       region ,
-                          size_t               buffer_row_pitch ,
-                          size_t               buffer_slice_pitch ,
-                          size_t               host_row_pitch ,
-                          size_t               host_slice_pitch ,
-                          void *               ptr ,
-                          cl_uint              num_events_in_wait_list ,
-                          const cl_event *     event_wait_list ,
-                          cl_event *           event) CL_API_SUFFIX__VERSION_1_1
-{
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
   // Call original function
-  cl_int err = clEnqueueReadBufferRect(
-    command_queue->queue,
-    buffer->mem,
-    blocking_read,
-    buffer_origin,
-    host_origin,
+  void *ret = clEnqueueMapImage(
+    _queue,
+    image->mem,
+    blocking_map,
+    map_flags,
+    origin,
     region,
-    buffer_row_pitch,
-    buffer_slice_pitch,
-    host_row_pitch,
-    host_slice_pitch,
-    ptr,
+    image_row_pitch,
+    image_slice_pitch,
     num_events_in_wait_list,
     _wait_list,
-    _event
+    _event,
+    &err
   );
 
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
-  }
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
   if (_wait_list)
   {
     free(_wait_list);
   }
-
-  return err;
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return ret;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueWriteBuffer_(cl_command_queue    command_queue ,
-                       cl_mem              buffer ,
-                       cl_bool             blocking_write ,
-                       size_t              offset ,
-                       size_t              cb ,
-                       const void *        ptr ,
-                       cl_uint             num_events_in_wait_list ,
-                       const cl_event *    event_wait_list ,
-                       cl_event *          event) CL_API_SUFFIX__VERSION_1_0
+_clEnqueueUnmapMemObject_(cl_command_queue  command_queue ,
+                          cl_mem            memobj ,
+                          void *            mapped_ptr ,
+                          cl_uint           num_events_in_wait_list ,
+                          const cl_event *   event_wait_list ,
+                          cl_event *         event) CL_API_SUFFIX__VERSION_1_0
 {
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
-  // Call original function
-  cl_int err = clEnqueueWriteBuffer(
-    command_queue->queue,
-    buffer->mem,
-    blocking_write,
-    offset,
-    cb,
-    ptr,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  if (unmapCached(memobj, mapped_ptr))
+  {
+    // Keep the real mapping until the device uses the buffer
+    err = CL_SUCCESS;
+    if (_event)
+    {
+      err = clEnqueueMarkerWithWaitList(
+        _queue,
+        num_events_in_wait_list,
+        _wait_list,
+        _event
+      );
+    }
+    else if (num_events_in_wait_list)
+    {
+      err = clEnqueueBarrierWithWaitList(
+        _queue,
+        num_events_in_wait_list,
+        _wait_list,
+        NULL
+      );
+    }
+  }
+  else
+  {
+    // Call original function
+    err = clEnqueueUnmapMemObject(
+      _queue,
+      memobj->mem,
+      mapped_ptr,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  if (err == CL_SUCCESS)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    removeHostRegion(memobj, mapped_ptr);
   }
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
   if (_wait_list)
   {
     free(_wait_list);
@@ -1946,60 +9595,82 @@ _clEnqueueWriteBuffer_(cl_command_queue    command_queue ,
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueWriteBufferRect_(cl_command_queue     command_queue ,
-                           cl_mem               buffer ,
-                           cl_bool              blocking_write ,
-                           const size_t *       buffer_origin ,
-                           const size_t *       host_origin ,
-                           const size_t *       region ,
-                           size_t               buffer_row_pitch ,
-                           size_t               buffer_slice_pitch ,
-                           size_t               host_row_pitch ,
-                           size_t               host_slice_pitch ,
-                           const void *         ptr ,
-                           cl_uint              num_events_in_wait_list ,
-                           const cl_event *     event_wait_list ,
-                           cl_event *           event) CL_API_SUFFIX__VERSION_1_1
+_clEnqueueMigrateMemObjects_(cl_command_queue        command_queue ,
+                             cl_uint                 num_mem_objects ,
+                             const cl_mem *          mem_objects ,
+                             cl_mem_migration_flags  flags ,
+                             cl_uint                 num_events_in_wait_list ,
+                             const cl_event *        event_wait_list ,
+                             cl_event *              event) CL_API_SUFFIX__VERSION_1_2
 {
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  for (cl_uint i = 0; i < num_mem_objects && mem_objects; i++)
+  {
+    releaseMappings(mem_objects[i], _queue);
+  }
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
+  // Build real mem object list
+  cl_mem *_objects = createMemList(num_mem_objects, mem_objects);
+
   // Call original function
-  cl_int err = clEnqueueWriteBufferRect(
-    command_queue->queue,
-    buffer->mem,
-    blocking_write,
-    buffer_origin,
-    host_origin,
-    region,
-    buffer_row_pitch,
-    buffer_slice_pitch,
-    host_row_pitch,
-    host_slice_pitch,
-    ptr,
+  err = clEnqueueMigrateMemObjects(
+    _queue,
+    num_mem_objects,
+    _objects,
+    flags,
     num_events_in_wait_list,
     _wait_list,
     _event
   );
+  if (_objects)
+  {
+    free(_objects);
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Track where the buffers now live
+  if (err == CL_SUCCESS && command_queue->trackResidency)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    for (cl_uint i = 0; i < num_mem_objects; i++)
+    {
+      setResidency(
+        mem_objects[i],
+        flags & CL_MIGRATE_MEM_OBJECT_HOST ? NULL : command_queue->device,
+        *_event
+      );
+    }
   }
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
   if (_wait_list)
   {
     free(_wait_list);
@@ -2008,728 +9679,1355 @@ _clEnqueueWriteBufferRect_(cl_command_queue     command_queue ,
   return err;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueCopyBuffer_(cl_command_queue     command_queue ,
-                      cl_mem               src_buffer ,
-                      cl_mem               dst_buffer ,
-                      size_t               src_offset ,
-                      size_t               dst_offset ,
-                      size_t               cb ,
-                      cl_uint              num_events_in_wait_list ,
-                      const cl_event *     event_wait_list ,
-                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+// Work-groups per nanosecond that a kernel achieves on a device, learned
+// from the profiling timestamps of split launches
+struct kernelRate
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  char *name;
+  char *device;
+  cl_double groupsPerNs;
+  cl_double savedGroupsPerNs;
+  struct kernelRate *next;
+};
+static struct kernelRate *m_kernelRates = NULL;
+static pthread_mutex_t m_rateLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Utility function to find the learned rate of a kernel on a device
+// Called with the rate lock held
+struct kernelRate* findKernelRate(const char *name, const char *device)
+{
+  struct kernelRate *rate = m_kernelRates;
+  while (rate && (strcmp(rate->device, device) || strcmp(rate->name, name)))
   {
-    _event = malloc(sizeof(cl_event));
+    rate = rate->next;
   }
+  if (!rate)
+  {
+    rate = malloc(sizeof(struct kernelRate));
+    rate->name = strdup(name);
+    rate->device = strdup(device);
+    rate->groupsPerNs = 0;
+    rate->savedGroupsPerNs = 0;
+    rate->next = m_kernelRates;
+    m_kernelRates = rate;
+  }
+  return rate;
+}
 
-  // Call original function
-  cl_int err = clEnqueueCopyBuffer(
-    command_queue->queue,
-    src_buffer->mem,
-    dst_buffer->mem,
-    src_offset,
-    dst_offset,
-    cb,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+// Utility function to find the learned rate of a kernel on a device
+struct kernelRate* getKernelRate(const char *name, const char *device)
+{
+  pthread_mutex_lock(&m_rateLock);
+  struct kernelRate *rate = findKernelRate(name, device);
+  pthread_mutex_unlock(&m_rateLock);
+  return rate;
+}
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+void initKernelRates()
+{
+  const char *db = getenv("OIW_STEAL_DB");
+  const char *home = getenv("HOME");
+  if (db)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    m_rateDb = strdup(db);
   }
-  if (_wait_list)
+  else if (home)
   {
-    free(_wait_list);
+    m_rateDb = malloc(strlen(home) + 16);
+    sprintf(m_rateDb, "%s/.oiw_steal", home);
+  }
+  FILE *file = m_rateDb ? fopen(m_rateDb, "r") : NULL;
+  if (!file)
+  {
+    return;
   }
 
-  return err;
+  // One rate per line, with later lines replacing earlier ones:
+  // device<TAB>kernel<TAB>work-groups per nanosecond
+  char line[1024];
+  while (fgets(line, sizeof(line), file))
+  {
+    char *device = strtok(line, "\t");
+    char *kernel = strtok(NULL, "\t");
+    char *groups = strtok(NULL, "\t\n");
+    cl_double groupsPerNs;
+    if (!groups || sscanf(groups, "%lg", &groupsPerNs) != 1 ||
+        !(groupsPerNs > 0))
+    {
+      continue;
+    }
+
+    struct kernelRate *rate = findKernelRate(kernel, device);
+    rate->groupsPerNs = groupsPerNs;
+    rate->savedGroupsPerNs = groupsPerNs;
+  }
+  fclose(file);
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueCopyBufferRect_(cl_command_queue     command_queue ,
-                          cl_mem               src_buffer ,
-                          cl_mem               dst_buffer ,
-                          const size_t *       src_origin ,
-                          const size_t *       dst_origin ,
-                          const size_t *       region ,
-                          size_t               src_row_pitch ,
-                          size_t               src_slice_pitch ,
-                          size_t               dst_row_pitch ,
-                          size_t               dst_slice_pitch ,
-                          cl_uint              num_events_in_wait_list ,
-                          const cl_event *     event_wait_list ,
-                          cl_event *           event) CL_API_SUFFIX__VERSION_1_1
+// Utility function to record a learned rate in the database once it has
+// moved by more than a quarter since it was last saved
+// Called with the rate lock held
+void saveKernelRate(struct kernelRate *rate)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  cl_double saved = rate->savedGroupsPerNs;
+  if (saved > 0 && rate->groupsPerNs < 1.25*saved &&
+      rate->groupsPerNs > 0.75*saved)
+  {
+    return;
+  }
+
+  FILE *file = m_rateDb ? fopen(m_rateDb, "a") : NULL;
+  if (!file)
+  {
+    return;
+  }
+  fprintf(file, "%s\t%s\t%.17g\n", rate->device, rate->name,
+          rate->groupsPerNs);
+  fclose(file);
+  rate->savedGroupsPerNs = rate->groupsPerNs;
+}
+
+// Split launch whose work-groups are handed out by the feeder threads
+struct splitLaunch
+{
+  cl_kernel _kernel;
+  cl_uint work_dim;
+  cl_uint dim;
+  size_t offset[3];
+  size_t size[3];
+  size_t local[3];
+  cl_bool hasLocal;
+  size_t granule;
+  size_t *lo;
+  size_t *hi;
+  struct kernelRate **rates;
+  cl_uint numDeps;
+  cl_event *_deps;
+  cl_uint active;
+  cl_int status;
+  cl_event _user;
+  cl_ulong seq;
+  struct splitLaunch *next;
+};
+
+struct splitFeeder
+{
+  struct splitScheduler *sched;
+  cl_uint index;
+  pthread_t thread;
+};
+
+// Feeder threads of a split queue, one per device
+struct splitScheduler
+{
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  cl_uint numDevices;
+  cl_command_queue *queues;
+  char **deviceNames;
+  struct splitFeeder *feeders;
+  cl_uint numFeeders;
+  cl_bool stop;
+  struct splitLaunch *launches;
+  cl_ulong seq;
+};
+
+// Utility function to take the next chunk of a split launch for a device,
+// stealing from the back of the device with the most work left once its
+// own range is used up
+// Returns the number of work-groups taken, starting at *start
+size_t takeChunk(struct splitLaunch *launch,
+                 cl_uint numDevices,
+                 cl_uint d,
+                 size_t *start)
+{
+  // Until the device has been measured, take a quarter of what is left
+  size_t want = 0;
+  cl_double rate = launch->rates[d]->groupsPerNs;
+  if (rate > 0)
+  {
+    want = (size_t)(rate * m_stealChunkNs);
+    want = want ? want : 1;
+  }
+
+  if (launch->lo[d] < launch->hi[d])
+  {
+    size_t n = launch->hi[d] - launch->lo[d];
+    if (!want)
+    {
+      want = n/4 ? n/4 : 1;
+    }
+    n = n < want ? n : want;
+    *start = launch->lo[d];
+    launch->lo[d] += n;
+    return n;
+  }
+
+  cl_uint victim = d;
+  size_t most = 0;
+  for (cl_uint v = 0; v < numDevices; v++)
+  {
+    if (launch->hi[v] - launch->lo[v] > most)
+    {
+      most = launch->hi[v] - launch->lo[v];
+      victim = v;
+    }
+  }
+  if (!most)
   {
-    _event = malloc(sizeof(cl_event));
+    return 0;
   }
 
-  // Call original function
-  cl_int err = clEnqueueCopyBufferRect(
-    command_queue->queue,
-    src_buffer->mem,
-    dst_buffer->mem,
-    src_origin,
-    dst_origin,
-    region,
-    src_row_pitch,
-    src_slice_pitch,
-    dst_row_pitch,
-    dst_slice_pitch,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  // Take half of what is left, but no more than a chunk
+  if (!want)
+  {
+    want = most/4 ? most/4 : 1;
+  }
+  size_t n = (most + 1) / 2;
+  n = n < want ? n : want;
+  launch->hi[victim] -= n;
+  *start = launch->hi[victim];
+  return n;
+}
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+// Utility function to learn a device's rate from a completed chunk
+void updateKernelRate(struct kernelRate *rate, cl_event _chunk, size_t groups)
+{
+  cl_ulong start = 0, end = 0;
+  if (clGetEventProfilingInfo(_chunk, CL_PROFILING_COMMAND_START,
+                              sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+      clGetEventProfilingInfo(_chunk, CL_PROFILING_COMMAND_END,
+                              sizeof(cl_ulong), &end, NULL) != CL_SUCCESS ||
+      end <= start)
+  {
+    return;
+  }
+
+  cl_double sample = groups / (cl_double)(end - start);
+  pthread_mutex_lock(&m_rateLock);
+  rate->groupsPerNs = rate->groupsPerNs > 0 ?
+    0.75*rate->groupsPerNs + 0.25*sample : sample;
+  saveKernelRate(rate);
+  pthread_mutex_unlock(&m_rateLock);
+}
+
+// Utility function to finish a feeder's part in a split launch
+// Called with the scheduler lock held. Returns the launch once the last
+// feeder has left it, so that it can be completed without the lock.
+struct splitLaunch* leaveLaunch(struct splitScheduler *sched,
+                                struct splitLaunch *launch)
+{
+  if (--launch->active)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    return NULL;
   }
-  if (_wait_list)
+
+  struct splitLaunch **prev = &sched->launches;
+  while (*prev != launch)
   {
-    free(_wait_list);
+    prev = &(*prev)->next;
   }
+  *prev = launch->next;
+  return launch;
+}
 
-  return err;
+// Utility function to complete a split launch and release its resources
+void completeSplitLaunch(struct splitLaunch *launch)
+{
+  clSetUserEventStatus(launch->_user, launch->status);
+  clReleaseEvent(launch->_user);
+  clReleaseKernel(launch->_kernel);
+  for (cl_uint i = 0; i < launch->numDeps; i++)
+  {
+    clReleaseEvent(launch->_deps[i]);
+  }
+  free(launch->_deps);
+  free(launch->lo);
+  free(launch->hi);
+  free(launch->rates);
+  free(launch);
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueFillBuffer_(cl_command_queue    command_queue ,
-                      cl_mem              buffer ,
-                      const void *        pattern ,
-                      size_t              pattern_size ,
-                      size_t              offset ,
-                      size_t              cb ,
-                      cl_uint             num_events_in_wait_list ,
-                      const cl_event *    event_wait_list ,
-                      cl_event *          event) CL_API_SUFFIX__VERSION_1_2
+// Feeder thread, which keeps up to two chunks of each split launch in
+// flight on its device
+void* splitFeeder(void *arg)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
-  {
-    _event = malloc(sizeof(cl_event));
+  struct splitFeeder *feeder = arg;
+  struct splitScheduler *sched = feeder->sched;
+  cl_uint d = feeder->index;
+  cl_command_queue _queue = sched->queues[d];
+  cl_ulong seen = 0;
+
+  pthread_mutex_lock(&sched->lock);
+  while (1)
+  {
+    // Find the oldest launch this feeder has not worked on, stopping once
+    // there are none left and the queue has gone
+    struct splitLaunch *launch = NULL;
+    while (!launch)
+    {
+      for (launch = sched->launches; launch; launch = launch->next)
+      {
+        if (launch->seq > seen)
+        {
+          break;
+        }
+      }
+      if (!launch)
+      {
+        if (sched->stop)
+        {
+          pthread_mutex_unlock(&sched->lock);
+          return NULL;
+        }
+        pthread_cond_wait(&sched->cond, &sched->lock);
+      }
+    }
+    seen = launch->seq;
+
+    cl_event _pending[2] = {NULL, NULL};
+    size_t pendingGroups[2] = {0, 0};
+    cl_uint b = 0;
+    size_t start;
+    size_t n;
+    while (1)
+    {
+      n = launch->status == CL_COMPLETE ?
+        takeChunk(launch, sched->numDevices, d, &start) : 0;
+      pthread_mutex_unlock(&sched->lock);
+
+      if (n)
+      {
+        size_t offset[3] = {launch->offset[0], launch->offset[1],
+                            launch->offset[2]};
+        size_t size[3] = {launch->size[0], launch->size[1], launch->size[2]};
+        offset[launch->dim] += start*launch->granule;
+        size[launch->dim] = n*launch->granule;
+        cl_int err = clEnqueueNDRangeKernel(
+          _queue, launch->_kernel, launch->work_dim, offset, size,
+          launch->hasLocal ? launch->local : NULL,
+          launch->numDeps, launch->_deps, _pending + b);
+        clFlush(_queue);
+        if (err == CL_SUCCESS)
+        {
+          pendingGroups[b] = n;
+        }
+        else
+        {
+          _pending[b] = NULL;
+          pthread_mutex_lock(&sched->lock);
+          launch->status = err;
+          pthread_mutex_unlock(&sched->lock);
+        }
+        b ^= 1;
+      }
+
+      // Wait for the older chunk while the newer one runs
+      if (_pending[b])
+      {
+        cl_int err = clWaitForEvents(1, _pending + b);
+        if (err == CL_SUCCESS)
+        {
+          updateKernelRate(launch->rates[d], _pending[b], pendingGroups[b]);
+        }
+        clReleaseEvent(_pending[b]);
+        _pending[b] = NULL;
+        if (err != CL_SUCCESS)
+        {
+          pthread_mutex_lock(&sched->lock);
+          launch->status = err;
+          pthread_mutex_unlock(&sched->lock);
+        }
+      }
+
+      pthread_mutex_lock(&sched->lock);
+      if (!n && !_pending[0] && !_pending[1])
+      {
+        break;
+      }
+      if (!n)
+      {
+        b ^= 1;
+      }
+    }
+    if (leaveLaunch(sched, launch))
+    {
+      pthread_mutex_unlock(&sched->lock);
+      completeSplitLaunch(launch);
+      pthread_mutex_lock(&sched->lock);
+    }
   }
+  return NULL;
+}
 
-  // Call original function
-  cl_int err = clEnqueueFillBuffer(
-    command_queue->queue,
-    buffer->mem,
-    pattern,
-    pattern_size,
-    offset,
-    cb,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+// Utility function to stop the feeder threads of a split queue and free the
+// scheduler. Launches already handed to the feeders are run first.
+void destroySplitScheduler(struct splitScheduler *sched)
+{
+  pthread_mutex_lock(&sched->lock);
+  sched->stop = CL_TRUE;
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  for (cl_uint d = 0; d < sched->numFeeders; d++)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    pthread_join(sched->feeders[d].thread, NULL);
   }
-  if (_wait_list)
+  for (cl_uint d = 0; d < sched->numDevices; d++)
   {
-    free(_wait_list);
+    free(sched->deviceNames[d]);
   }
+  pthread_mutex_destroy(&sched->lock);
+  pthread_cond_destroy(&sched->cond);
+  free(sched->deviceNames);
+  free(sched->feeders);
+  free(sched->queues);
+  free(sched);
+}
 
-  return err;
+// Utility function to start the feeder threads of a split queue, one per
+// device, with the queue's own device first
+struct splitScheduler* createSplitScheduler(cl_command_queue queue,
+                                            cl_command_queue _own)
+{
+  struct splitScheduler *sched = malloc(sizeof(struct splitScheduler));
+  pthread_mutex_init(&sched->lock, NULL);
+  pthread_cond_init(&sched->cond, NULL);
+  sched->numDevices = queue->numSplitQueues + 1;
+  sched->queues = malloc(sched->numDevices*sizeof(cl_command_queue));
+  sched->queues[0] = _own;
+  memcpy(sched->queues + 1, queue->splitQueues,
+         queue->numSplitQueues*sizeof(cl_command_queue));
+  sched->launches = NULL;
+  sched->seq = 0;
+  sched->stop = CL_FALSE;
+
+  // Rates are kept by device name, so they carry over between runs
+  sched->deviceNames = malloc(sched->numDevices*sizeof(char*));
+  for (cl_uint d = 0; d < sched->numDevices; d++)
+  {
+    cl_device_id _device = NULL;
+    size_t sz = 0;
+    clGetCommandQueueInfo(sched->queues[d], CL_QUEUE_DEVICE,
+                          sizeof(cl_device_id), &_device, NULL);
+    clGetDeviceInfo(_device, CL_DEVICE_NAME, 0, NULL, &sz);
+    sched->deviceNames[d] = calloc(sz + 1, 1);
+    clGetDeviceInfo(_device, CL_DEVICE_NAME, sz, sched->deviceNames[d], NULL);
+  }
+
+  sched->feeders = malloc(sched->numDevices*sizeof(struct splitFeeder));
+  sched->numFeeders = 0;
+  for (cl_uint d = 0; d < sched->numDevices; d++)
+  {
+    struct splitFeeder *feeder = sched->feeders + d;
+    feeder->sched = sched;
+    feeder->index = d;
+    if (pthread_create(&feeder->thread, NULL, splitFeeder, feeder) != 0)
+    {
+      // No work has reached the feeders yet, so they stop straight away
+      destroySplitScheduler(sched);
+      return NULL;
+    }
+    sched->numFeeders++;
+  }
+  return sched;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueFillImage_(cl_command_queue    command_queue ,
-                     cl_mem              image ,
-                     const void *        fill_color ,
-                     const size_t *      origin ,
-                     const size_t *      region ,
-                     cl_uint             num_events_in_wait_list ,
-                     const cl_event *    event_wait_list ,
-                     cl_event *          event) CL_API_SUFFIX__VERSION_1_2
+// Utility function to hand a split launch to the feeder threads
+// The slices in shares become each device's initial range, and the event
+// returned completes once the feeders have run every work-group.
+// Returns CL_FALSE without doing anything if the launch cannot be handed
+// over. Otherwise the result of the launch is stored in err.
+cl_bool scheduleSplitKernel(struct splitScheduler *sched,
+                           cl_command_queue _queue,
+                           cl_kernel kernel,
+                           cl_uint work_dim,
+                           cl_uint dim,
+                           const size_t *offset,
+                           const size_t *size,
+                           const size_t *local_work_size,
+                           size_t granule,
+                           const size_t *shares,
+                           cl_uint num_deps,
+                           const cl_event *_deps,
+                           cl_event *_event,
+                           cl_int *err)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  // Capture the arguments, since the feeders enqueue later
+  cl_kernel _kernel = createKernelClone(kernel);
+  if (!_kernel)
   {
-    _event = malloc(sizeof(cl_event));
+    return CL_FALSE;
   }
 
-  // Call original function
-  cl_int err = clEnqueueFillImage(
-    command_queue->queue,
-    image->mem,
-    fill_color,
-    origin,
-    region,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  size_t sz = 0;
+  clGetKernelInfo(_kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, &sz);
+  char *name = calloc(sz + 1, 1);
+  clGetKernelInfo(_kernel, CL_KERNEL_FUNCTION_NAME, sz, name, NULL);
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  struct splitLaunch *launch = malloc(sizeof(struct splitLaunch));
+  launch->_user = clCreateUserEvent(kernel->program->context->context, err);
+  if (*err != CL_SUCCESS)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    clReleaseKernel(_kernel);
+    free(launch);
+    free(name);
+    return CL_FALSE;
   }
-  if (_wait_list)
+  launch->_kernel = _kernel;
+  launch->work_dim = work_dim;
+  launch->dim = dim;
+  launch->hasLocal = local_work_size != NULL;
+  for (cl_uint i = 0; i < 3; i++)
   {
-    free(_wait_list);
+    launch->offset[i] = offset[i];
+    launch->size[i] = size[i];
+    launch->local[i] = i < work_dim && local_work_size ? local_work_size[i] : 1;
   }
+  launch->granule = granule;
 
-  return err;
-}
-
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueReadImage_(cl_command_queue      command_queue ,
-                     cl_mem                image ,
-                     cl_bool               blocking_read ,
-                     const size_t *        origin ,
-                     const size_t *        region ,
-                     size_t                row_pitch ,
-                     size_t                slice_pitch ,
-                     void *                ptr ,
-                     cl_uint               num_events_in_wait_list ,
-                     const cl_event *      event_wait_list ,
-                     cl_event *            event) CL_API_SUFFIX__VERSION_1_0
-{
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  cl_uint num = sched->numDevices;
+  launch->lo = malloc(num*sizeof(size_t));
+  launch->hi = malloc(num*sizeof(size_t));
+  launch->rates = malloc(num*sizeof(struct kernelRate*));
+  size_t start = 0;
+  for (cl_uint d = 0; d < num; d++)
   {
-    _event = malloc(sizeof(cl_event));
+    launch->rates[d] = getKernelRate(name, sched->deviceNames[d]);
+    launch->lo[d] = start;
+    launch->hi[d] = start + shares[d];
+    start += shares[d];
   }
+  free(name);
 
-  // Call original function
-  cl_int err = clEnqueueReadImage(
-    command_queue->queue,
-    image->mem,
-    blocking_read,
-    origin,
-    region,
-    row_pitch,
-    slice_pitch,
-    ptr,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
-
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  launch->numDeps = num_deps;
+  launch->_deps = malloc(num_deps*sizeof(cl_event));
+  for (cl_uint i = 0; i < num_deps; i++)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    launch->_deps[i] = _deps[i];
+    clRetainEvent(_deps[i]);
   }
-  if (_wait_list)
+  launch->active = num;
+  launch->status = CL_COMPLETE;
+
+  // Join the launch back into the real queue before the feeders can
+  // complete it, and only hand it over once the join is in place
+  *err = clEnqueueBarrierWithWaitList(_queue, 1, &launch->_user, _event);
+  if (*err != CL_SUCCESS)
   {
-    free(_wait_list);
+    completeSplitLaunch(launch);
+    return CL_FALSE;
   }
 
-  return err;
+  pthread_mutex_lock(&sched->lock);
+  launch->seq = ++sched->seq;
+  launch->next = NULL;
+  struct splitLaunch **tail = &sched->launches;
+  while (*tail)
+  {
+    tail = &(*tail)->next;
+  }
+  *tail = launch;
+  pthread_cond_broadcast(&sched->cond);
+  pthread_mutex_unlock(&sched->lock);
+  return CL_TRUE;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueWriteImage_(cl_command_queue     command_queue ,
-                      cl_mem               image ,
-                      cl_bool              blocking_write ,
-                      const size_t *       origin ,
-                      const size_t *       region ,
-                      size_t               input_row_pitch ,
-                      size_t               input_slice_pitch ,
-                      const void *         ptr ,
-                      cl_uint              num_events_in_wait_list ,
-                      const cl_event *     event_wait_list ,
-                      cl_event *           event) CL_API_SUFFIX__VERSION_1_0
+// Utility function to run an NDRange launch across every device of a split
+// queue. Each device gets a slice of the dimension with the most work-groups
+// in proportion to its compute units, or the queue's feeder threads balance
+// the slices as they run. The other devices' slices wait for the commands
+// already on the real queue, and a barrier joins them back into it, so the
+// event returned completes once every slice has.
+// Returns CL_FALSE without doing anything if the launch cannot be split.
+// Otherwise the result of the launch is stored in err.
+cl_bool enqueueSplitKernel(cl_command_queue queue,
+                          cl_command_queue _queue,
+                          cl_kernel kernel,
+                          cl_uint work_dim,
+                          const size_t *global_work_offset,
+                          const size_t *global_work_size,
+                          const size_t *local_work_size,
+                          cl_uint num_events,
+                          const cl_event *_wait_list,
+                          cl_event *_event,
+                          cl_int *err)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  if (!queue->numSplitQueues || !kernel->splittable ||
+      !global_work_size || work_dim < 1 || work_dim > 3)
   {
-    _event = malloc(sizeof(cl_event));
+    return CL_FALSE;
   }
 
-  // Call original function
-  cl_int err = clEnqueueWriteImage(
-    command_queue->queue,
-    image->mem,
-    blocking_write,
-    origin,
-    region,
-    input_row_pitch,
-    input_slice_pitch,
-    ptr,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  // Find the dimension with the most work-groups, leaving invalid launches
+  // for the implementation to report
+  size_t offset[3] = {0, 0, 0};
+  size_t size[3] = {1, 1, 1};
+  cl_uint dim = 0;
+  size_t groups = 0;
+  for (cl_uint d = 0; d < work_dim; d++)
+  {
+    size_t local = local_work_size ? local_work_size[d] : 1;
+    offset[d] = global_work_offset ? global_work_offset[d] : 0;
+    size[d] = global_work_size[d];
+    if (!local || size[d] % local)
+    {
+      return CL_FALSE;
+    }
+    if (size[d] / local > groups)
+    {
+      groups = size[d] / local;
+      dim = d;
+    }
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Without a local size, keep slices divisible by a sensible work-group
+  size_t granule = local_work_size ? local_work_size[dim] : 1;
+  while (!local_work_size && granule < 64 && size[dim] % (granule*2) == 0)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    granule *= 2;
   }
-  if (_wait_list)
+  groups = size[dim] / granule;
+  cl_uint numDevices = queue->numSplitQueues + 1;
+  if (groups < numDevices)
   {
-    free(_wait_list);
+    return CL_FALSE;
   }
 
-  return err;
-}
+  // Mark the commands the other devices must wait for
+  cl_event *_deps = malloc((num_events + 1)*sizeof(cl_event));
+  if (num_events)
+  {
+    memcpy(_deps, _wait_list, num_events*sizeof(cl_event));
+  }
+  if (clEnqueueMarkerWithWaitList(_queue, 0, NULL,
+                                  _deps + num_events) != CL_SUCCESS)
+  {
+    free(_deps);
+    return CL_FALSE;
+  }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueCopyImage_(cl_command_queue      command_queue ,
-                     cl_mem                src_image ,
-                     cl_mem                dst_image ,
-                     const size_t *        src_origin ,
-                     const size_t *        dst_origin ,
-                     const size_t *        region ,
-                     cl_uint               num_events_in_wait_list ,
-                     const cl_event *      event_wait_list ,
-                     cl_event *            event) CL_API_SUFFIX__VERSION_1_0
-{
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  // Share out the work-groups, with the queue's own device taking the rest
+  cl_ulong totalUnits = 0;
+  for (cl_uint i = 0; i < numDevices; i++)
   {
-    _event = malloc(sizeof(cl_event));
+    totalUnits += queue->splitUnits[i];
+  }
+  size_t *shares = malloc(numDevices*sizeof(size_t));
+  shares[0] = groups;
+  for (cl_uint i = 1; i < numDevices; i++)
+  {
+    shares[i] = groups * queue->splitUnits[i] / totalUnits;
+    shares[0] -= shares[i];
   }
 
-  // Call original function
-  cl_int err = clEnqueueCopyImage(
-    command_queue->queue,
-    src_image->mem,
-    dst_image->mem,
-    src_origin,
-    dst_origin,
-    region,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  // Let the feeder threads balance the work between the devices
+  if (queue->scheduler)
+  {
+    if (scheduleSplitKernel(queue->scheduler, _queue, kernel, work_dim,
+                            dim, offset, size, local_work_size, granule,
+                            shares, num_events + 1, _deps, _event, err))
+    {
+      clReleaseEvent(_deps[num_events]);
+      free(shares);
+      free(_deps);
+      return CL_TRUE;
+    }
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Launch the other devices' slices, running any that fail locally
+  // Every slice gets an event, so the join also covers out-of-order queues.
+  cl_event *_parts = malloc(numDevices*sizeof(cl_event));
+  cl_uint numParts = 0;
+  size_t start = shares[0];
+  *err = CL_SUCCESS;
+  for (cl_uint i = 1; i < numDevices && *err == CL_SUCCESS; i++)
+  {
+    if (!shares[i])
+    {
+      continue;
+    }
+
+    size_t sliceOffset[3] = {offset[0], offset[1], offset[2]};
+    size_t sliceSize[3] = {size[0], size[1], size[2]};
+    sliceOffset[dim] += start*granule;
+    sliceSize[dim] = shares[i]*granule;
+    start += shares[i];
+
+    cl_command_queue _split = queue->splitQueues[i-1];
+    cl_int split = clEnqueueNDRangeKernel(_split, kernel->kernel, work_dim,
+                                          sliceOffset, sliceSize,
+                                          local_work_size, num_events + 1,
+                                          _deps, _parts + numParts);
+    if (split == CL_SUCCESS)
+    {
+      clFlush(_split);
+      numParts++;
+    }
+    else
+    {
+      *err = clEnqueueNDRangeKernel(_queue, kernel->kernel, work_dim,
+                                    sliceOffset, sliceSize, local_work_size,
+                                    num_events, _wait_list,
+                                    _parts + numParts);
+      if (*err == CL_SUCCESS)
+      {
+        numParts++;
+      }
+    }
+  }
+
+  // Launch the local slice
+  if (*err == CL_SUCCESS && shares[0])
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    size_t sliceSize[3] = {size[0], size[1], size[2]};
+    sliceSize[dim] = shares[0]*granule;
+    *err = clEnqueueNDRangeKernel(_queue, kernel->kernel, work_dim,
+                                  offset, sliceSize, local_work_size,
+                                  num_events, _wait_list, _parts + numParts);
+    if (*err == CL_SUCCESS)
+    {
+      numParts++;
+    }
   }
-  if (_wait_list)
+
+  // Join the slices back into the real queue
+  if (*err == CL_SUCCESS)
   {
-    free(_wait_list);
+    *err = clEnqueueBarrierWithWaitList(_queue, numParts,
+                                        numParts ? _parts : NULL, _event);
   }
 
-  return err;
+  for (cl_uint i = 0; i < numParts; i++)
+  {
+    clReleaseEvent(_parts[i]);
+  }
+  clReleaseEvent(_deps[num_events]);
+  free(_parts);
+  free(shares);
+  free(_deps);
+  return CL_TRUE;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueCopyImageToBuffer_(cl_command_queue  command_queue ,
-                             cl_mem            src_image ,
-                             cl_mem            dst_buffer ,
-                             const size_t *    src_origin ,
-                             const size_t *    region ,
-                             size_t            dst_offset ,
-                             cl_uint           num_events_in_wait_list ,
-                             const cl_event *  event_wait_list ,
-                             cl_event *        event) CL_API_SUFFIX__VERSION_1_0
+// Most local sizes the tuner tries for one kernel
+#define MAX_TUNE_CANDIDATES 16
+
+// Local size tuning state of a kernel on a device, for global sizes of
+// the same power of two in every dimension. A local size of zero leaves
+// the choice to the implementation.
+struct tuneEntry
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  char *device;
+  char *kernel;
+  cl_uint workDim;
+  cl_uint sizeClass[3];
+  cl_bool tuned;
+  size_t best[3];
+  cl_uint numCandidates;
+  size_t candidates[MAX_TUNE_CANDIDATES][3];
+  cl_ulong fastestNs[MAX_TUNE_CANDIDATES];
+  cl_uint launches;
+  cl_uint pending;
+  struct tuneEntry *next;
+};
+static struct tuneEntry *m_tuneEntries = NULL;
+static pthread_mutex_t m_tuneLock = PTHREAD_MUTEX_INITIALIZER;
+
+// Launch being timed for the tuner
+struct tuneSample
+{
+  struct tuneEntry *entry;
+  cl_uint candidate;
+};
+
+// Utility function to find the tuning state for a launch
+// Called with the tuner lock held
+struct tuneEntry* findTuneEntry(const char *device,
+                                const char *kernel,
+                                cl_uint work_dim,
+                                const cl_uint *sizeClass)
+{
+  struct tuneEntry *entry;
+  for (entry = m_tuneEntries; entry; entry = entry->next)
   {
-    _event = malloc(sizeof(cl_event));
+    if (entry->workDim == work_dim &&
+        !memcmp(entry->sizeClass, sizeClass, 3*sizeof(cl_uint)) &&
+        !strcmp(entry->kernel, kernel) && !strcmp(entry->device, device))
+    {
+      break;
+    }
   }
+  return entry;
+}
 
-  // Call original function
-  cl_int err = clEnqueueCopyImageToBuffer(
-    command_queue->queue,
-    src_image->mem,
-    dst_buffer->mem,
-    src_origin,
-    region,
-    dst_offset,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+// Utility function to add tuning state for a launch
+// Called with the tuner lock held
+struct tuneEntry* addTuneEntry(const char *device,
+                               const char *kernel,
+                               cl_uint work_dim,
+                               const cl_uint *sizeClass)
+{
+  struct tuneEntry *entry = calloc(1, sizeof(struct tuneEntry));
+  entry->device = strdup(device);
+  entry->kernel = strdup(kernel);
+  entry->workDim = work_dim;
+  memcpy(entry->sizeClass, sizeClass, 3*sizeof(cl_uint));
+  entry->next = m_tuneEntries;
+  m_tuneEntries = entry;
+  return entry;
+}
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+void initAutotune()
+{
+  const char *db = getenv("OIW_AUTOTUNE_DB");
+  const char *home = getenv("HOME");
+  if (db)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    m_autotuneDb = strdup(db);
   }
-  if (_wait_list)
+  else if (home)
   {
-    free(_wait_list);
+    m_autotuneDb = malloc(strlen(home) + 16);
+    sprintf(m_autotuneDb, "%s/.oiw_autotune", home);
+  }
+  FILE *file = m_autotuneDb ? fopen(m_autotuneDb, "r") : NULL;
+  if (!file)
+  {
+    return;
   }
 
-  return err;
+  // One result per line, with later lines replacing earlier ones:
+  // device<TAB>kernel<TAB>dims<TAB>class,class,class<TAB>size,size,size
+  char line[1024];
+  while (fgets(line, sizeof(line), file))
+  {
+    char *device = strtok(line, "\t");
+    char *kernel = strtok(NULL, "\t");
+    char *dims = strtok(NULL, "\t");
+    char *classes = strtok(NULL, "\t");
+    char *sizes = strtok(NULL, "\t\n");
+    cl_uint sizeClass[3];
+    unsigned long best[3];
+    if (!sizes ||
+        sscanf(classes, "%u,%u,%u",
+               sizeClass, sizeClass + 1, sizeClass + 2) != 3 ||
+        sscanf(sizes, "%lu,%lu,%lu", best, best + 1, best + 2) != 3)
+    {
+      continue;
+    }
+
+    cl_uint work_dim = atoi(dims);
+    struct tuneEntry *entry =
+      findTuneEntry(device, kernel, work_dim, sizeClass);
+    if (!entry)
+    {
+      entry = addTuneEntry(device, kernel, work_dim, sizeClass);
+    }
+    entry->tuned = CL_TRUE;
+    for (cl_uint d = 0; d < 3; d++)
+    {
+      entry->best[d] = best[d];
+    }
+  }
+  fclose(file);
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueCopyBufferToImage_(cl_command_queue  command_queue ,
-                             cl_mem            src_buffer ,
-                             cl_mem            dst_image ,
-                             size_t            src_offset ,
-                             const size_t *    dst_origin ,
-                             const size_t *    region ,
-                             cl_uint           num_events_in_wait_list ,
-                             const cl_event *  event_wait_list ,
-                             cl_event *        event) CL_API_SUFFIX__VERSION_1_0
+// Callback to append a tuned local size to the database, run on a callback
+// worker so that the implementation's thread never waits on the file
+void CL_CALLBACK saveTuneEntry(cl_event _event,
+                               cl_int status,
+                               void *user_data)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  char *line = user_data;
+  FILE *file = fopen(m_autotuneDb, "a");
+  if (file)
   {
-    _event = malloc(sizeof(cl_event));
+    fputs(line, file);
+    fclose(file);
   }
+  free(line);
+}
 
-  // Call original function
-  cl_int err = clEnqueueCopyBufferToImage(
-    command_queue->queue,
-    src_buffer->mem,
-    dst_image->mem,
-    src_offset,
-    dst_origin,
-    region,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+// Utility function to format a tuned local size as a database line
+// Called with the tuner lock held
+char* formatTuneEntry(struct tuneEntry *entry)
+{
+  // Room for the names, seven numbers of up to 20 digits and separators
+  size_t length = strlen(entry->device) + strlen(entry->kernel) + 7*21 + 8;
+  char *line = malloc(length);
+  snprintf(line, length, "%s\t%s\t%u\t%u,%u,%u\t%lu,%lu,%lu\n",
+           entry->device, entry->kernel, entry->workDim,
+           entry->sizeClass[0], entry->sizeClass[1], entry->sizeClass[2],
+           (unsigned long)entry->best[0], (unsigned long)entry->best[1],
+           (unsigned long)entry->best[2]);
+  return line;
+}
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+// Utility function to list the local sizes worth trying for a kernel:
+// the implementation's choice, then power of two shapes that are a multiple
+// of the preferred work-group size multiple and fit the kernel. Kernels
+// that require a work-group size or use local memory are left to the
+// implementation, since they are likely to depend on the size it picks.
+void buildTuneCandidates(struct tuneEntry *entry,
+                         cl_kernel _kernel,
+                         cl_device_id _device)
+{
+  size_t maxSize = 1;
+  size_t multiple = 1;
+  size_t maxItems[3] = {1, 1, 1};
+  clGetKernelWorkGroupInfo(_kernel, _device, CL_KERNEL_WORK_GROUP_SIZE,
+                           sizeof(size_t), &maxSize, NULL);
+  clGetKernelWorkGroupInfo(_kernel, _device,
+                           CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                           sizeof(size_t), &multiple, NULL);
+  clGetDeviceInfo(_device, CL_DEVICE_MAX_WORK_ITEM_SIZES,
+                  sizeof(maxItems), maxItems, NULL);
+  multiple = multiple ? multiple : 1;
+
+  cl_uint n = 0;
+  memset(entry->candidates[n++], 0, 3*sizeof(size_t));
+
+  size_t required[3] = {0, 0, 0};
+  cl_ulong localMem = 0;
+  clGetKernelWorkGroupInfo(_kernel, _device, CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                           sizeof(required), required, NULL);
+  clGetKernelWorkGroupInfo(_kernel, _device, CL_KERNEL_LOCAL_MEM_SIZE,
+                           sizeof(cl_ulong), &localMem, NULL);
+  if (required[0] || required[1] || required[2] || localMem)
+  {
+    entry->numCandidates = n;
+    entry->fastestNs[0] = 0;
+    memset(entry->best, 0, 3*sizeof(size_t));
+    entry->tuned = CL_TRUE;
+    return;
+  }
+
+  // Larger work-groups first, and wider rather than taller shapes
+  for (size_t total = maxSize; total >= multiple && total; total /= 2)
+  {
+    size_t pow2 = 1;
+    while (pow2*2 <= total)
+    {
+      pow2 *= 2;
+    }
+    if (pow2 % multiple)
+    {
+      continue;
+    }
+    for (size_t y = 1; y <= pow2 && n < MAX_TUNE_CANDIDATES; y *= 2)
+    {
+      size_t x = pow2 / y;
+      if ((entry->workDim < 2 && y > 1) || x < y ||
+          x > maxItems[0] || y > maxItems[1])
+      {
+        continue;
+      }
+      entry->candidates[n][0] = x;
+      entry->candidates[n][1] = y;
+      entry->candidates[n][2] = 1;
+      n++;
+    }
+    total = pow2;
   }
-  if (_wait_list)
+
+  // Keep to the launches that will be sampled
+  entry->numCandidates = n < m_autotuneLaunches ? n : m_autotuneLaunches;
+  for (cl_uint i = 0; i < entry->numCandidates; i++)
   {
-    free(_wait_list);
+    entry->fastestNs[i] = (cl_ulong)-1;
   }
+}
 
-  return err;
+// Utility function to check whether a local size fits a launch
+cl_bool localSizeFits(const size_t *local,
+                      cl_uint work_dim,
+                      const size_t *global_work_size)
+{
+  if (!local[0])
+  {
+    return CL_TRUE;
+  }
+  for (cl_uint d = 0; d < work_dim; d++)
+  {
+    if (global_work_size[d] % local[d])
+    {
+      return CL_FALSE;
+    }
+  }
+  return CL_TRUE;
 }
 
-CL_API_ENTRY void * CL_API_CALL
-_clEnqueueMapBuffer_(cl_command_queue  command_queue ,
-                     cl_mem            buffer ,
-                     cl_bool           blocking_map ,
-                     cl_map_flags      map_flags ,
-                     size_t            offset ,
-                     size_t            cb ,
-                     cl_uint           num_events_in_wait_list ,
-                     const cl_event *  event_wait_list ,
-                     cl_event *        event ,
-                     cl_int *          errcode_ret) CL_API_SUFFIX__VERSION_1_0
+// Utility function to choose a local size for a launch that left it to the
+// implementation. The first launches of each kernel, device and global size
+// class try each candidate in turn, and later ones use the fastest.
+// Returns the local size to launch with, or NULL for the implementation's
+// choice. If the launch should be timed, *sample is set.
+const size_t* selectLocalSize(cl_command_queue queue,
+                              cl_kernel kernel,
+                              cl_uint work_dim,
+                              const size_t *global_work_size,
+                              size_t *local,
+                              struct tuneSample **sample)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  *sample = NULL;
+  if (!global_work_size || work_dim < 1 || work_dim > 3 || !queue->deviceName)
   {
-    _event = malloc(sizeof(cl_event));
+    return NULL;
   }
 
-  // Call original function
-  cl_int err;
-  void *ret = clEnqueueMapBuffer(
-    command_queue->queue,
-    buffer->mem,
-    blocking_map,
-    map_flags,
-    offset,
-    cb,
-    num_events_in_wait_list,
-    _wait_list,
-    _event,
-    &err
-  );
+  // Split launches complete on a barrier, which cannot be timed
+  if (queue->numSplitQueues && kernel->splittable)
+  {
+    return NULL;
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Kernel names are only looked up once
+  if (!__atomic_load_n(&kernel->name, __ATOMIC_ACQUIRE))
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    size_t sz = 0;
+    clGetKernelInfo(kernel->kernel, CL_KERNEL_FUNCTION_NAME, 0, NULL, &sz);
+    char *name = calloc(sz + 1, 1);
+    clGetKernelInfo(kernel->kernel, CL_KERNEL_FUNCTION_NAME, sz, name, NULL);
+    char *expected = NULL;
+    if (!__atomic_compare_exchange_n(&kernel->name, &expected, name, 0,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+    {
+      free(name);
+    }
   }
-  if (_wait_list)
+
+  cl_uint sizeClass[3] = {0, 0, 0};
+  for (cl_uint d = 0; d < work_dim; d++)
   {
-    free(_wait_list);
+    for (size_t g = global_work_size[d]; g > 1; g /= 2)
+    {
+      sizeClass[d]++;
+    }
   }
-  if (errcode_ret)
+
+  pthread_mutex_lock(&m_tuneLock);
+  struct tuneEntry *entry =
+    findTuneEntry(queue->deviceName, kernel->name, work_dim, sizeClass);
+  if (!entry)
   {
-    *errcode_ret = err;
+    entry = addTuneEntry(queue->deviceName, kernel->name,
+                         work_dim, sizeClass);
+    buildTuneCandidates(entry, kernel->kernel, queue->device->device);
   }
-  return ret;
+
+  const size_t *result = NULL;
+  if (entry->tuned)
+  {
+    memcpy(local, entry->best, 3*sizeof(size_t));
+    if ((kernel->guarded || localSizeFits(local, work_dim, global_work_size))
+        && local[0])
+    {
+      result = local;
+    }
+  }
+  else if (entry->launches < m_autotuneLaunches)
+  {
+    // Try the next candidate that fits this launch
+    for (cl_uint i = 0; i < entry->numCandidates; i++)
+    {
+      cl_uint c = (entry->launches + i) % entry->numCandidates;
+      if (kernel->guarded ||
+          localSizeFits(entry->candidates[c], work_dim, global_work_size))
+      {
+        memcpy(local, entry->candidates[c], 3*sizeof(size_t));
+        result = local[0] ? local : NULL;
+        entry->launches++;
+        entry->pending++;
+        *sample = malloc(sizeof(struct tuneSample));
+        (*sample)->entry = entry;
+        (*sample)->candidate = c;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&m_tuneLock);
+  return result;
 }
 
-CL_API_ENTRY void * CL_API_CALL
-_clEnqueueMapImage_(cl_command_queue   command_queue ,
-                    cl_mem             image ,
-                    cl_bool            blocking_map ,
-                    cl_map_flags       map_flags ,
-                    const size_t *     origin ,
-                    const size_t *     region ,
-                    size_t *           image_row_pitch ,
-                    size_t *           image_slice_pitch ,
-                    cl_uint            num_events_in_wait_list ,
-                    const cl_event *   event_wait_list ,
-                    cl_event *         event ,
-                    cl_int *           errcode_ret) CL_API_SUFFIX__VERSION_1_0
+// Callback to record the time a sampled launch took, and lock in the
+// fastest local size once every sample is in
+void CL_CALLBACK recordTuneSample(cl_event _event,
+                                  cl_int status,
+                                  void *user_data)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  struct tuneSample *sample = user_data;
+  struct tuneEntry *entry = sample->entry;
+  char *line = NULL;
+
+  cl_ulong start = 0, end = 0;
+  if (status == CL_COMPLETE &&
+      (clGetEventProfilingInfo(_event, CL_PROFILING_COMMAND_START,
+                               sizeof(cl_ulong), &start, NULL) != CL_SUCCESS ||
+       clGetEventProfilingInfo(_event, CL_PROFILING_COMMAND_END,
+                               sizeof(cl_ulong), &end, NULL) != CL_SUCCESS))
   {
-    _event = malloc(sizeof(cl_event));
+    start = end = 0;
   }
 
-  // Call original function
-  cl_int err;
-  void *ret = clEnqueueMapImage(
-    command_queue->queue,
-    image->mem,
-    blocking_map,
-    map_flags,
-    origin,
-    region,
-    image_row_pitch,
-    image_slice_pitch,
-    num_events_in_wait_list,
-    _wait_list,
-    _event,
-    &err
-  );
-
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  pthread_mutex_lock(&m_tuneLock);
+  if (end > start && end - start < entry->fastestNs[sample->candidate])
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    entry->fastestNs[sample->candidate] = end - start;
   }
-  if (_wait_list)
+  entry->pending--;
+  if (!entry->tuned && !entry->pending &&
+      entry->launches >= m_autotuneLaunches)
   {
-    free(_wait_list);
+    cl_uint best = 0;
+    for (cl_uint c = 1; c < entry->numCandidates; c++)
+    {
+      if (entry->fastestNs[c] < entry->fastestNs[best])
+      {
+        best = c;
+      }
+    }
+    memcpy(entry->best, entry->candidates[best], 3*sizeof(size_t));
+    entry->tuned = CL_TRUE;
+    if (m_autotuneDb)
+    {
+      line = formatTuneEntry(entry);
+    }
   }
-  if (errcode_ret)
+  pthread_mutex_unlock(&m_tuneLock);
+  free(sample);
+
+  if (line)
   {
-    *errcode_ret = err;
+    dispatchCallback(createCallbackJob(CALLBACK_INTERNAL, NULL,
+                                       saveTuneEntry, line, 1));
   }
-  return ret;
 }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueUnmapMemObject_(cl_command_queue  command_queue ,
-                          cl_mem            memobj ,
-                          void *            mapped_ptr ,
-                          cl_uint           num_events_in_wait_list ,
-                          const cl_event *   event_wait_list ,
-                          cl_event *         event) CL_API_SUFFIX__VERSION_1_0
+// Utility function to round a launch of a guarded kernel up to a whole
+// number of work-groups, and set the bounds its guard checks against.
+// Without a local size, one is only chosen if the first dimension is not
+// a multiple of the kernel's preferred work-group size multiple.
+// Returns the global size to launch with.
+const size_t* padGlobalSize(cl_command_queue queue,
+                            cl_kernel kernel,
+                            cl_uint work_dim,
+                            const size_t *global_work_offset,
+                            const size_t *global_work_size,
+                            const size_t **local_work_size,
+                            size_t *padded_global,
+                            size_t *padded_local)
 {
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
-  {
-    _event = malloc(sizeof(cl_event));
+  cl_ulong bound[4] = {-1, -1, -1, -1};
+  const size_t *result = global_work_size;
+  if (!global_work_size || work_dim < 1 || work_dim > 3)
+  {
+    return result;
+  }
+
+  const size_t *local = *local_work_size;
+  cl_device_id _device = queue->device->device;
+  if (!local)
+  {
+    // Respect a required work-group size
+    size_t required[3] = {0, 0, 0};
+    clGetKernelWorkGroupInfo(kernel->kernel, _device,
+                             CL_KERNEL_COMPILE_WORK_GROUP_SIZE,
+                             sizeof(required), required, NULL);
+    size_t multiple = 1;
+    size_t maxSize = 1;
+    clGetKernelWorkGroupInfo(kernel->kernel, _device,
+                             CL_KERNEL_PREFERRED_WORK_GROUP_SIZE_MULTIPLE,
+                             sizeof(size_t), &multiple, NULL);
+    clGetKernelWorkGroupInfo(kernel->kernel, _device,
+                             CL_KERNEL_WORK_GROUP_SIZE,
+                             sizeof(size_t), &maxSize, NULL);
+    if (required[0])
+    {
+      memcpy(padded_local, required, 3*sizeof(size_t));
+      local = padded_local;
+    }
+    else if (multiple > 1 && global_work_size[0] % multiple &&
+             maxSize >= multiple)
+    {
+      // Use the largest multiple of the preferred size up to 256 work-items
+      size_t limit = maxSize < 256 ? maxSize : 256;
+      padded_local[0] = multiple*(limit >= multiple ? limit/multiple : 1);
+      padded_local[1] = 1;
+      padded_local[2] = 1;
+      local = padded_local;
+    }
   }
 
-  // Call original function
-  cl_int err = clEnqueueUnmapMemObject(
-    command_queue->queue,
-    memobj->mem,
-    mapped_ptr,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  if (local)
+  {
+    cl_bool padded = CL_FALSE;
+    for (cl_uint d = 0; d < work_dim; d++)
+    {
+      padded_global[d] = global_work_size[d];
+      if (local[d])
+      {
+        padded_global[d] += (local[d] - global_work_size[d] % local[d])
+                            % local[d];
+      }
+      if (padded_global[d] != global_work_size[d])
+      {
+        padded = CL_TRUE;
+      }
+    }
+    if (padded)
+    {
+      for (cl_uint d = 0; d < work_dim; d++)
+      {
+        bound[d] = global_work_size[d] +
+          (global_work_offset ? global_work_offset[d] : 0);
+      }
+      *local_work_size = local;
+      result = padded_global;
+    }
+  }
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Only update the argument when the bounds change
+  if (memcmp(bound, kernel->guardBound, sizeof(bound)))
+  {
+    memcpy(kernel->guardBound, bound, sizeof(bound));
+    clSetKernelArg(kernel->kernel, kernel->numArgs, sizeof(bound), bound);
+  }
+  return result;
+}
+
+// Utility function to hold back a kernel launch so that it can be merged
+// with later launches of the same kernel over an adjacent range. The
+// kernel's arguments cannot change while it is held, as setting one
+// submits the launch first. Each launch is admitted on its own. Returns
+// CL_FALSE if it must be submitted normally.
+cl_bool coalesceLaunch(cl_command_queue queue,
+                       cl_kernel kernel,
+                       cl_uint work_dim,
+                       const size_t *global_work_offset,
+                       const size_t *global_work_size,
+                       const size_t *local_work_size,
+                       cl_uint num_events,
+                       cl_event *event,
+                       cl_int *err)
+{
+  if (!queue->combineLaunches || num_events || queue->graph ||
+      !global_work_size || work_dim < 1 || work_dim > 3 ||
+      kernel->guarded || (kernel->splittable && queue->numSplitQueues))
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    return CL_FALSE;
   }
-  if (_wait_list)
+  cl_command_queue held =
+    __atomic_load_n(&kernel->heldQueue, __ATOMIC_ACQUIRE);
+  if (held && held != queue)
   {
-    free(_wait_list);
+    return CL_FALSE;
+  }
+  for (cl_uint d = 0; d < work_dim; d++)
+  {
+    if (!global_work_size[d] || (local_work_size && !local_work_size[d]))
+    {
+      return CL_FALSE;
+    }
   }
 
-  return err;
-}
+  // Apply admission control
+  *err = throttleCommand(queue);
+  if (*err != CL_SUCCESS)
+  {
+    return CL_TRUE;
+  }
 
-CL_API_ENTRY cl_int CL_API_CALL
-_clEnqueueMigrateMemObjects_(cl_command_queue        command_queue ,
-                             cl_uint                 num_mem_objects ,
-                             const cl_mem *          mem_objects ,
-                             cl_mem_migration_flags  flags ,
-                             cl_uint                 num_events_in_wait_list ,
-                             const cl_event *        event_wait_list ,
-                             cl_event *              event) CL_API_SUFFIX__VERSION_1_2
-{
-  // Initialize event arguments
-  cl_event *_wait_list = createEventList(
-    num_events_in_wait_list,
-    event_wait_list
-  );
-  cl_event *_event = NULL;
-  if (event)
+  releaseKernelMappings(kernel, queue->queue);
+
+  pthread_mutex_lock(&queue->batchLock);
+
+  // Held back writes, reads and copies come first
+  submitWriteBatch(queue);
+  submitTransferRun(queue);
+
+  if (!queue->launches)
   {
-    _event = malloc(sizeof(cl_event));
+    queue->launches = calloc(1, sizeof(struct launchRun));
+    queue->launches->events =
+      malloc(m_launchCoalesceWindow*sizeof(cl_event));
   }
+  struct launchRun *run = queue->launches;
 
-  // Build real mem object list
-  cl_mem *_objects = NULL;
-  if (num_mem_objects > 0 && mem_objects)
+  // Check whether this launch continues the current run: every dimension
+  // must match except one, in which it must start where the run ends
+  cl_bool merge = run->numLaunches &&
+    run->numLaunches < m_launchCoalesceWindow &&
+    run->kernel == kernel && run->workDim == work_dim &&
+    run->hasLocal == (local_work_size != NULL) &&
+    (!local_work_size ||
+     !memcmp(run->local, local_work_size, work_dim*sizeof(size_t)));
+  cl_uint dim = work_dim;
+  for (cl_uint d = 0; d < work_dim && merge; d++)
   {
-    _objects = malloc(num_mem_objects*sizeof(cl_mem));
-    for (int i = 0; i < num_mem_objects; i++)
+    size_t offset = global_work_offset ? global_work_offset[d] : 0;
+    if (offset == run->offset[d] && global_work_size[d] == run->size[d])
+    {
+      continue;
+    }
+    if (dim == work_dim && offset == run->offset[d] + run->size[d] &&
+        (run->mergeDim == work_dim || run->mergeDim == d))
+    {
+      dim = d;
+    }
+    else
     {
-      _objects[i] = mem_objects[i]->mem;
+      merge = CL_FALSE;
     }
   }
+  merge = merge && dim < work_dim;
 
-  // Call original function
-  cl_int err = clEnqueueMigrateMemObjects(
-    command_queue->queue,
-    num_mem_objects,
-    _objects,
-    flags,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
-  if (_objects)
+  if (merge)
   {
-    free(_objects);
+    run->size[dim] += global_work_size[dim];
+    run->mergeDim = dim;
   }
-
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  else
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    submitLaunchRun(queue);
+    run->kernel = kernel;
+    run->workDim = work_dim;
+    run->mergeDim = work_dim;
+    run->hasLocal = local_work_size != NULL;
+    for (cl_uint d = 0; d < 3; d++)
+    {
+      run->offset[d] =
+        d < work_dim && global_work_offset ? global_work_offset[d] : 0;
+      run->size[d] = d < work_dim ? global_work_size[d] : 1;
+      run->local[d] = d < work_dim && local_work_size ? local_work_size[d] : 1;
+    }
+
+    // Keep the kernel and its buffers alive until the launch is submitted
+    clRetainKernel(kernel->kernel);
+    run->mems = realloc(run->mems, kernel->numArgs*sizeof(cl_mem));
+    for (cl_uint i = 0; i < kernel->numArgs; i++)
+    {
+      cl_mem mem = kernel->args[i].mem;
+      if (mem)
+      {
+        clRetainMemObject(mem->mem);
+        run->mems[run->numMems++] = mem;
+      }
+    }
+    __atomic_store_n(&kernel->heldQueue, queue, __ATOMIC_RELEASE);
   }
-  if (_wait_list)
+
+  run->events[run->numLaunches] = NULL;
+  if (event)
   {
-    free(_wait_list);
+    *event = createPendingEvent(queue, CL_COMMAND_NDRANGE_KERNEL);
+    run->events[run->numLaunches] = *event;
+    run->numEvents++;
   }
+  run->numLaunches++;
 
-  return err;
+  __atomic_store_n(&queue->pendingCommands, 1, __ATOMIC_RELEASE);
+  pthread_mutex_unlock(&queue->batchLock);
+  return CL_TRUE;
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -2743,39 +11041,183 @@ _clEnqueueNDRangeKernel_(cl_command_queue  command_queue ,
                          const cl_event *  event_wait_list ,
                          cl_event *        event) CL_API_SUFFIX__VERSION_1_0
 {
+  // Hold back launches to merge them with adjacent ones
+  cl_int err;
+  if (coalesceLaunch(command_queue, kernel, work_dim, global_work_offset,
+                     global_work_size, local_work_size,
+                     num_events_in_wait_list, event, &err))
+  {
+    return err;
+  }
+
+  // Apply admission control
+  err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseKernelMappings(kernel, _queue);
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
-  // Call original function
-  cl_int err = clEnqueueNDRangeKernel(
-    command_queue->queue,
-    kernel->kernel,
-    work_dim,
-    global_work_offset,
-    global_work_size,
-    local_work_size,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
+  // Wait for earlier commands that use the same memory
+  cl_uint numAccesses;
+  struct memAccess *accesses =
+    getKernelAccesses(command_queue, kernel, &numAccesses);
+  _wait_list = inferDependencies(
+    command_queue,
+    numAccesses,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
   );
 
-  // Create wrapper object
-  if (err == CL_SUCCESS && event)
+  // Choose a local size for launches that leave it to the implementation
+  size_t tunedLocal[3];
+  struct tuneSample *sample = NULL;
+  const size_t *requested_local_size = local_work_size;
+  if (!local_work_size && m_autotuneLaunches)
+  {
+    local_work_size = selectLocalSize(
+      command_queue,
+      kernel,
+      work_dim,
+      global_work_size,
+      tunedLocal,
+      &sample
+    );
+    if (sample && !_event)
+    {
+      _event = malloc(sizeof(cl_event));
+    }
+  }
+
+  // Round awkward global sizes of guarded kernels up to whole work-groups
+  size_t paddedGlobal[3];
+  size_t paddedLocal[3];
+  const size_t *launch_global_size = global_work_size;
+  if (kernel->guarded)
+  {
+    launch_global_size = padGlobalSize(
+      command_queue,
+      kernel,
+      work_dim,
+      global_work_offset,
+      global_work_size,
+      &local_work_size,
+      paddedGlobal,
+      paddedLocal
+    );
+  }
+
+  // Spread splittable kernels across the devices of a split queue
+  if (!enqueueSplitKernel(
+        command_queue,
+        _queue,
+        kernel,
+        work_dim,
+        global_work_offset,
+        launch_global_size,
+        local_work_size,
+        num_events_in_wait_list,
+        _wait_list,
+        _event,
+        &err))
+  {
+    // Call original function
+    err = clEnqueueNDRangeKernel(
+      _queue,
+      kernel->kernel,
+      work_dim,
+      global_work_offset,
+      launch_global_size,
+      local_work_size,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Leave the local size to the implementation if the tuner's choice does
+  // not work for this launch
+  if (err != CL_SUCCESS && local_work_size && !requested_local_size)
+  {
+    if (sample)
+    {
+      recordTuneSample(NULL, err, sample);
+      sample = NULL;
+    }
+    err = clEnqueueNDRangeKernel(
+      _queue,
+      kernel->kernel,
+      work_dim,
+      global_work_offset,
+      launch_global_size,
+      NULL,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+
+  // Time launches that sample a local size
+  if (sample)
   {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+    if (err == CL_SUCCESS)
+    {
+      clSetEventCallback(*_event, CL_COMPLETE, recordTuneSample, sample);
+    }
+    else
+    {
+      recordTuneSample(NULL, err, sample);
+    }
+  }
+
+  // Track where the kernel's buffers now live
+  updateResidency(command_queue, kernel, err, _event);
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, numAccesses, accesses, err, _event);
+  free(accesses);
+
+  // Create wrapper object
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    recordKernel(
+      command_queue,
+      CL_COMMAND_NDRANGE_KERNEL,
+      kernel,
+      work_dim,
+      global_work_offset,
+      global_work_size,
+      requested_local_size,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
   }
   if (_wait_list)
   {
@@ -2792,35 +11234,83 @@ _clEnqueueTask_(cl_command_queue   command_queue ,
                 const cl_event *   event_wait_list ,
                 cl_event *         event) CL_API_SUFFIX__VERSION_1_0
 {
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  releaseKernelMappings(kernel, _queue);
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
+  // Wait for earlier commands that use the same memory
+  cl_uint numAccesses;
+  struct memAccess *accesses =
+    getKernelAccesses(command_queue, kernel, &numAccesses);
+  _wait_list = inferDependencies(
+    command_queue,
+    numAccesses,
+    accesses,
+    &num_events_in_wait_list,
+    _wait_list
+  );
+
   // Call original function
-  cl_int err = clEnqueueTask(
-    command_queue->queue,
+  err = clEnqueueTask(
+    _queue,
     kernel->kernel,
     num_events_in_wait_list,
     _wait_list,
     _event
   );
 
+  // Track where the kernel's buffers now live
+  updateResidency(command_queue, kernel, err, _event);
+
+  // Track the memory used by the command for later commands
+  recordAccesses(command_queue, _queue, numAccesses, accesses, err, _event);
+  free(accesses);
+
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    size_t one = 1;
+    recordKernel(
+      command_queue,
+      CL_COMMAND_TASK,
+      kernel,
+      1,
+      NULL,
+      &one,
+      &one,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
   }
   if (_wait_list)
   {
@@ -2849,7 +11339,7 @@ CL_API_ENTRY void * CL_API_CALL
 _clGetExtensionFunctionAddressForPlatform_(cl_platform_id  platform ,
                                            const char *    func_name) CL_API_SUFFIX__VERSION_1_2
 {
-  return NULL;
+  return getExtensionFunction(func_name);
 }
 
 CL_API_ENTRY cl_int CL_API_CALL
@@ -2859,34 +11349,66 @@ _clEnqueueMarkerWithWaitList_(cl_command_queue  command_queue ,
                               cl_event *         event) CL_API_SUFFIX__VERSION_1_2
 
 {
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
   // Call original function
-  cl_int err = clEnqueueMarkerWithWaitList(
-    command_queue->queue,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  if (command_queue->numQueues > 1 && !command_queue->perThread &&
+      (num_events_in_wait_list == 0 || command_queue->dualQueue))
+  {
+    // Marker must wait for commands on every real queue, as well as the
+    // wait list of an in-order queue
+    _queue = command_queue->queues[0];
+    err = enqueueJoin(command_queue, CL_FALSE, num_events_in_wait_list,
+                      _wait_list, _event);
+  }
+  else
+  {
+    err = clEnqueueMarkerWithWaitList(
+      _queue,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
 
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    recordCommand(
+      command_queue,
+      CL_COMMAND_MARKER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
   }
   if (_wait_list)
   {
@@ -2902,34 +11424,82 @@ _clEnqueueBarrierWithWaitList_(cl_command_queue  command_queue ,
                                const cl_event *   event_wait_list ,
                                cl_event *         event) CL_API_SUFFIX__VERSION_1_2
 {
+  // Leave ordering to inferred dependencies, but still give the barrier an
+  // event that completes after every earlier command. Only done if every
+  // command since the last real barrier was tracked, and owed to any
+  // untracked command that follows.
+  if (command_queue->inferDeps && m_downgradeBarriers &&
+      !num_events_in_wait_list && !command_queue->graph &&
+      !__atomic_load_n(&command_queue->untrackedSince, __ATOMIC_ACQUIRE))
+  {
+    __atomic_store_n(&command_queue->barrierOwed, CL_TRUE, __ATOMIC_RELEASE);
+    return _clEnqueueMarkerWithWaitList_(command_queue, 0, NULL, event);
+  }
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectTrackedQueue(
+    command_queue,
+    CL_FALSE,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
 
   // Call original function
-  cl_int err = clEnqueueBarrierWithWaitList(
-    command_queue->queue,
-    num_events_in_wait_list,
-    _wait_list,
-    _event
-  );
+  if (command_queue->numQueues > 1 && !command_queue->perThread)
+  {
+    // Barrier must span every real queue
+    _queue = command_queue->queues[0];
+    err = enqueueJoin(
+      command_queue,
+      CL_TRUE,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
+  else
+  {
+    err = clEnqueueBarrierWithWaitList(
+      _queue,
+      num_events_in_wait_list,
+      _wait_list,
+      _event
+    );
+  }
 
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
+  completeBarrier(command_queue, err);
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    recordCommand(
+      command_queue,
+      CL_COMMAND_BARRIER,
+      num_events_in_wait_list,
+      event_wait_list,
+      event
+    );
   }
   if (_wait_list)
   {
@@ -2967,12 +11537,36 @@ _clEnqueueWaitForEvents_(cl_command_queue  command_queue ,
                          cl_uint           num_events ,
                          const cl_event *  event_list) CL_API_SUFFIX__VERSION_1_0
 {
+  // Per-thread queues keep their order through the usual submission path
+  if (command_queue->perThread)
+  {
+    return _clEnqueueBarrierWithWaitList_(
+      command_queue,
+      num_events,
+      event_list,
+      NULL
+    );
+  }
+
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+  flushPending(command_queue);
+
   cl_event *_events = createEventList(num_events, event_list);
-  cl_int err = clEnqueueWaitForEvents(
-    command_queue,
-    num_events,
-    _events
-  );
+  cl_int err;
+  if (command_queue->numQueues > 1)
+  {
+    // Every real queue must wait for the events
+    err = enqueueJoin(command_queue, CL_TRUE, num_events, _events, NULL);
+  }
+  else
+  {
+    err = clEnqueueWaitForEvents(
+      command_queue->queue,
+      num_events,
+      _events
+    );
+  }
   free(_events);
   return err;
 }
@@ -2980,13 +11574,48 @@ _clEnqueueWaitForEvents_(cl_command_queue  command_queue ,
 CL_API_ENTRY cl_int CL_API_CALL
 _clEnqueueBarrier_(cl_command_queue  command_queue) CL_API_SUFFIX__VERSION_1_0
 {
-  return clEnqueueBarrier(command_queue->queue);
+  // Per-thread queues keep their order through the usual submission path
+  if (command_queue->perThread)
+  {
+    return _clEnqueueBarrierWithWaitList_(command_queue, 0, NULL, NULL);
+  }
+
+  // Leave ordering to inferred dependencies, as above
+  if (command_queue->inferDeps && m_downgradeBarriers &&
+      !command_queue->graph &&
+      !__atomic_load_n(&command_queue->untrackedSince, __ATOMIC_ACQUIRE))
+  {
+    __atomic_store_n(&command_queue->barrierOwed, CL_TRUE, __ATOMIC_RELEASE);
+    return CL_SUCCESS;
+  }
+
+  flushPending(command_queue);
+
+  cl_int err;
+  if (command_queue->numQueues > 1)
+  {
+    // Barrier must span every real queue
+    err = enqueueJoin(command_queue, CL_TRUE, 0, NULL, NULL);
+  }
+  else
+  {
+    err = clEnqueueBarrier(command_queue->queue);
+  }
+  completeBarrier(command_queue, err);
+
+  // Record command into graph
+  if (err == CL_SUCCESS && command_queue->graph)
+  {
+    recordCommand(command_queue, CL_COMMAND_BARRIER, 0, NULL, NULL);
+  }
+
+  return err;
 }
 
 CL_API_ENTRY void* CL_API_CALL
 _clGetExtensionFunctionAddress_(const char *funcname) CL_API_SUFFIX__VERSION_1_2
 {
-  return NULL;
+  return getExtensionFunction(funcname);
 }
 
 CL_API_ENTRY cl_mem CL_API_CALL
@@ -3014,6 +11643,20 @@ _clCreateFromGLBuffer_(cl_context      context ,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -3052,6 +11695,20 @@ _clCreateFromGLTexture_(cl_context       context ,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -3090,6 +11747,20 @@ _clCreateFromGLTexture2D_(cl_context       context,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -3129,6 +11800,20 @@ _clCreateFromGLTexture3D_(cl_context       context,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -3163,6 +11848,20 @@ _clCreateFromGLRenderbuffer_(cl_context    context,
     buffer->context = context;
     buffer->parent = NULL;
     buffer->imgBuffer = NULL;
+    buffer->size = 0;
+    buffer->mapCache = NULL;
+    buffer->flags = 0;
+    buffer->device = NULL;
+    buffer->lastUse = NULL;
+    buffer->lastWrite = NULL;
+    buffer->reads = NULL;
+    buffer->numReads = 0;
+    buffer->maxReads = 0;
+    buffer->refCount = 1;
+    buffer->useCount = 0;
+    buffer->prefetch = NULL;
+    buffer->_prefetchQueue = NULL;
+    buffer->trackedUse = 0;
   }
 
   if (errcode_ret)
@@ -3208,13 +11907,36 @@ _clEnqueueAcquireGLObjects_(cl_command_queue       command_queue,
                             const cl_event *       event_wait_list,
                             cl_event *             event ) CL_API_SUFFIX__VERSION_1_0
 {
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  for (cl_uint i = 0; i < num_objects && mem_objects; i++)
+  {
+    releaseMappings(mem_objects[i], _queue);
+  }
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
@@ -3223,8 +11945,8 @@ _clEnqueueAcquireGLObjects_(cl_command_queue       command_queue,
   cl_mem *_objects = createMemList(num_objects, mem_objects);
 
   // Call original function
-  cl_int err = clEnqueueAcquireGLObjects(
-    command_queue->queue,
+  err = clEnqueueAcquireGLObjects(
+    _queue,
     num_objects,
     _objects,
     num_events_in_wait_list,
@@ -3237,15 +11959,8 @@ _clEnqueueAcquireGLObjects_(cl_command_queue       command_queue,
   }
 
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
-  }
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
   if (_wait_list)
   {
     free(_wait_list);
@@ -3262,14 +11977,37 @@ _clEnqueueReleaseGLObjects_(cl_command_queue       command_queue,
                             const cl_event *       event_wait_list,
                             cl_event *             event ) CL_API_SUFFIX__VERSION_1_0
 
-{
+{
+  // Command cannot be recorded into a graph
+  abortRecording(command_queue);
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Really unmap cached mappings before the device uses the memory
+  for (cl_uint i = 0; i < num_objects && mem_objects; i++)
+  {
+    releaseMappings(mem_objects[i], _queue);
+  }
+
   // Initialize event arguments
   cl_event *_wait_list = createEventList(
     num_events_in_wait_list,
     event_wait_list
   );
   cl_event *_event = NULL;
-  if (event)
+  if (event || needsEvent(command_queue))
   {
     _event = malloc(sizeof(cl_event));
   }
@@ -3278,8 +12016,8 @@ _clEnqueueReleaseGLObjects_(cl_command_queue       command_queue,
   cl_mem *_objects = createMemList(num_objects, mem_objects);
 
   // Call original function
-  cl_int err = clEnqueueReleaseGLObjects(
-    command_queue->queue,
+  err = clEnqueueReleaseGLObjects(
+    _queue,
     num_objects,
     _objects,
     num_events_in_wait_list,
@@ -3292,15 +12030,8 @@ _clEnqueueReleaseGLObjects_(cl_command_queue       command_queue,
   }
 
   // Create wrapper object
-  if (err == CL_SUCCESS && event)
-  {
-    *event = malloc(sizeof(struct _cl_event));
-    (*event)->dispatch = command_queue->dispatch;
-    (*event)->event = *_event;
-    (*event)->context = command_queue->context;
-    (*event)->queue = command_queue;
-    free(_event);
-  }
+  completeCommand(command_queue, _queue, err, _event, event);
+  free(_event);
   if (_wait_list)
   {
     free(_wait_list);
@@ -3349,11 +12080,7 @@ _clCreateEventFromGLsyncKHR_(cl_context            context ,
   cl_event event = NULL;
   if (err == CL_SUCCESS)
   {
-    event = malloc(sizeof(struct _cl_event));
-    event->dispatch = context->dispatch;
-    event->event = _event;
-    event->context = context;
-    event->queue = NULL;
+    event = createEvent(context, NULL, NULL, _event);
   }
 
   if (errcode_ret)
@@ -3363,6 +12090,607 @@ _clCreateEventFromGLsyncKHR_(cl_context            context ,
   return event;
 }
 
+CL_API_ENTRY cl_int CL_API_CALL
+_clBeginCommandGraphRecordingOIW_(cl_command_queue command_queue)
+{
+  if (command_queue->graph)
+  {
+    return CL_INVALID_OPERATION;
+  }
+
+  cl_command_graph_oiw graph = malloc(sizeof(struct _cl_command_graph_oiw));
+  if (!graph)
+  {
+    return CL_OUT_OF_HOST_MEMORY;
+  }
+  graph->context = command_queue->context;
+  graph->device = command_queue->device;
+  graph->nodes = NULL;
+  graph->numNodes = 0;
+  graph->maxNodes = 0;
+  graph->error = CL_SUCCESS;
+  command_queue->graph = graph;
+
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clReleaseCommandGraphOIW_(cl_command_graph_oiw graph)
+{
+  for (cl_uint n = 0; n < graph->numNodes; n++)
+  {
+    struct graphNode *node = graph->nodes + n;
+    if (node->kernel)
+    {
+      clReleaseKernel(node->kernel);
+    }
+    for (cl_uint i = 0; i < 2; i++)
+    {
+      if (node->mem[i])
+      {
+        clReleaseMemObject(node->mem[i]->mem);
+      }
+    }
+    for (cl_uint i = 0; i < node->numArgs; i++)
+    {
+      if (node->args[i].mem)
+      {
+        clReleaseMemObject(node->args[i].mem->mem);
+      }
+      free(node->args[i].value);
+    }
+    for (cl_uint i = 0; i < node->numExternal; i++)
+    {
+      clReleaseEvent(node->external[i]);
+    }
+    if (node->event)
+    {
+      clReleaseEvent(node->event);
+    }
+    free(node->args);
+    free(node->pattern);
+    free(node->deps);
+    free(node->external);
+  }
+  free(graph->nodes);
+  free(graph);
+
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_command_graph_oiw CL_API_CALL
+_clEndCommandGraphRecordingOIW_(cl_command_queue command_queue,
+                                cl_int *         errcode_ret)
+{
+  cl_command_graph_oiw graph = command_queue->graph;
+  cl_int err = graph ? graph->error : CL_INVALID_OPERATION;
+  command_queue->graph = NULL;
+
+  if (graph)
+  {
+    // Events were only needed to resolve wait lists while recording
+    for (cl_uint n = 0; n < graph->numNodes; n++)
+    {
+      if (graph->nodes[n].event)
+      {
+        clReleaseEvent(graph->nodes[n].event);
+        graph->nodes[n].event = NULL;
+      }
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      _clReleaseCommandGraphOIW_(graph);
+      graph = NULL;
+    }
+  }
+
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return graph;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clEnqueueCommandGraphOIW_(cl_command_queue     command_queue,
+                           cl_command_graph_oiw graph,
+                           cl_uint              num_patches,
+                           const cl_mem *       patch_src,
+                           const cl_mem *       patch_dst,
+                           cl_uint              num_events_in_wait_list,
+                           const cl_event *     event_wait_list,
+                           cl_event *           event)
+{
+  if (!graph)
+  {
+    return CL_INVALID_VALUE;
+  }
+  if (command_queue->context != graph->context)
+  {
+    return CL_INVALID_CONTEXT;
+  }
+  if (command_queue->device != graph->device)
+  {
+    return CL_INVALID_DEVICE;
+  }
+  if (num_patches && (!patch_src || !patch_dst))
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  // Apply admission control
+  cl_int err = admitCommand(command_queue);
+  if (err != CL_SUCCESS)
+  {
+    return err;
+  }
+
+  // Select real queue to submit to, keeping the whole graph on one queue
+  // so that its recorded order is preserved
+  cl_command_queue _queue = selectQueue(
+    command_queue,
+    num_events_in_wait_list,
+    event_wait_list
+  );
+
+  // Initialize event arguments
+  cl_event *_wait_list = createEventList(
+    num_events_in_wait_list,
+    event_wait_list
+  );
+  cl_event *_events = calloc(graph->numNodes, sizeof(cl_event));
+
+  // Find the largest wait list needed by any command
+  cl_uint maxWait = 0;
+  for (cl_uint n = 0; n < graph->numNodes; n++)
+  {
+    struct graphNode *node = graph->nodes + n;
+    cl_uint num = node->numDeps + node->numExternal + num_events_in_wait_list;
+    if (num > maxWait)
+    {
+      maxWait = num;
+    }
+  }
+  cl_event *_node_wait_list = malloc((maxWait ? maxWait : 1)*sizeof(cl_event));
+
+  // Submit each command, rebuilding its wait structure
+  cl_uint n;
+  for (n = 0; n < graph->numNodes; n++)
+  {
+    struct graphNode *node = graph->nodes + n;
+    cl_uint num = 0;
+    for (cl_uint i = 0; i < node->numDeps; i++)
+    {
+      _node_wait_list[num++] = _events[node->deps[i]];
+    }
+    for (cl_uint i = 0; i < node->numExternal; i++)
+    {
+      _node_wait_list[num++] = node->external[i];
+    }
+    if (node->numDeps == 0)
+    {
+      for (cl_uint i = 0; i < num_events_in_wait_list; i++)
+      {
+        _node_wait_list[num++] = _wait_list[i];
+      }
+    }
+
+    err = enqueueGraphNode(
+      _queue,
+      node,
+      num_patches,
+      patch_src,
+      patch_dst,
+      num,
+      num ? _node_wait_list : NULL,
+      _events + n
+    );
+    if (err != CL_SUCCESS)
+    {
+      break;
+    }
+  }
+
+  // Create a single event that completes with the whole graph
+  cl_event _event = NULL;
+  if (err == CL_SUCCESS && (event || needsEvent(command_queue)))
+  {
+    err = clEnqueueMarkerWithWaitList(
+      _queue,
+      graph->numNodes,
+      graph->numNodes ? _events : NULL,
+      &_event
+    );
+  }
+  completeCommand(command_queue, _queue, err, &_event, event);
+
+  for (cl_uint i = 0; i < n; i++)
+  {
+    clReleaseEvent(_events[i]);
+  }
+  free(_events);
+  free(_node_wait_list);
+  if (_wait_list)
+  {
+    free(_wait_list);
+  }
+
+  return err;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clSetCommandQueueInFlightLimitOIW_(cl_command_queue      command_queue,
+                                    cl_uint               max_in_flight,
+                                    cl_backpressure_oiw   backpressure)
+{
+  if (backpressure != CL_BACKPRESSURE_BLOCK_OIW &&
+      backpressure != CL_BACKPRESSURE_SPIN_OIW &&
+      backpressure != CL_BACKPRESSURE_ERROR_OIW)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  pthread_mutex_lock(&command_queue->lock);
+  command_queue->maxInFlight = max_in_flight;
+  command_queue->trackInFlight |= max_in_flight > 0;
+  command_queue->backpressure = backpressure;
+  pthread_cond_broadcast(&command_queue->cond);
+  pthread_mutex_unlock(&command_queue->lock);
+
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetCommandQueueStatsOIW_(cl_command_queue        command_queue,
+                            cl_command_queue_stats_oiw *stats)
+{
+  if (!stats)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  pthread_mutex_lock(&command_queue->lock);
+  stats->commands = command_queue->commands;
+  stats->throttled = command_queue->throttled;
+  stats->in_flight = command_queue->inFlight;
+  stats->peak_in_flight = command_queue->peakInFlight;
+  stats->mean_in_flight = command_queue->meanInFlight;
+  pthread_mutex_unlock(&command_queue->lock);
+
+  return CL_SUCCESS;
+}
+
+// Notifier that signals a file descriptor when events complete
+struct _cl_event_notifier_oiw
+{
+  int readFd;
+  int writeFd;
+  pthread_mutex_t lock;
+  cl_uint refs;
+  cl_bool released;
+};
+
+// Utility function to drop a reference to a notifier
+void releaseNotifier(cl_event_notifier_oiw notifier)
+{
+  pthread_mutex_lock(&notifier->lock);
+  cl_uint refs = --notifier->refs;
+  pthread_mutex_unlock(&notifier->lock);
+  if (refs == 0)
+  {
+    pthread_mutex_destroy(&notifier->lock);
+    free(notifier);
+  }
+}
+
+// Callback to signal a notifier when an event completes
+void CL_CALLBACK notifyEventComplete(cl_event _event,
+                                     cl_int status,
+                                     void *user_data)
+{
+  cl_event_notifier_oiw notifier = user_data;
+  pthread_mutex_lock(&notifier->lock);
+  if (!notifier->released)
+  {
+#ifdef __linux__
+    uint64_t one = 1;
+    ssize_t ret = write(notifier->writeFd, &one, sizeof(one));
+#else
+    char one = 1;
+    ssize_t ret = write(notifier->writeFd, &one, sizeof(one));
+#endif
+    (void)ret;
+  }
+  pthread_mutex_unlock(&notifier->lock);
+  releaseNotifier(notifier);
+}
+
+CL_API_ENTRY cl_event_notifier_oiw CL_API_CALL
+_clCreateEventNotifierOIW_(cl_context context,
+                           cl_int *   errcode_ret)
+{
+  cl_event_notifier_oiw notifier =
+    malloc(sizeof(struct _cl_event_notifier_oiw));
+  if (!notifier)
+  {
+    if (errcode_ret)
+    {
+      *errcode_ret = CL_OUT_OF_HOST_MEMORY;
+    }
+    return NULL;
+  }
+
+#ifdef __linux__
+  notifier->readFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  notifier->writeFd = notifier->readFd;
+  cl_bool ok = notifier->readFd >= 0;
+#else
+  // Fall back to a pipe, which works with poll and kqueue
+  int fds[2];
+  cl_bool ok = pipe(fds) == 0;
+  if (ok)
+  {
+    notifier->readFd = fds[0];
+    notifier->writeFd = fds[1];
+    for (int i = 0; i < 2; i++)
+    {
+      fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+      fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+    }
+  }
+#endif
+  if (!ok)
+  {
+    free(notifier);
+    if (errcode_ret)
+    {
+      *errcode_ret = CL_OUT_OF_RESOURCES;
+    }
+    return NULL;
+  }
+
+  pthread_mutex_init(&notifier->lock, NULL);
+  notifier->refs = 1;
+  notifier->released = CL_FALSE;
+
+  if (errcode_ret)
+  {
+    *errcode_ret = CL_SUCCESS;
+  }
+  return notifier;
+}
+
+CL_API_ENTRY int CL_API_CALL
+_clGetEventNotifierFdOIW_(cl_event_notifier_oiw notifier)
+{
+  return notifier ? notifier->readFd : -1;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clAddEventsToNotifierOIW_(cl_event_notifier_oiw notifier,
+                           cl_uint               num_events,
+                           const cl_event *      event_list)
+{
+  if (!notifier || (num_events && !event_list))
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  for (cl_uint i = 0; i < num_events; i++)
+  {
+    resolveEvent(event_list[i]);
+
+    pthread_mutex_lock(&notifier->lock);
+    notifier->refs++;
+    pthread_mutex_unlock(&notifier->lock);
+
+    cl_int err = clSetEventCallback(
+      event_list[i]->event,
+      CL_COMPLETE,
+      notifyEventComplete,
+      notifier
+    );
+    if (err != CL_SUCCESS)
+    {
+      releaseNotifier(notifier);
+      return err;
+    }
+  }
+
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clReleaseEventNotifierOIW_(cl_event_notifier_oiw notifier)
+{
+  if (!notifier)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  // Stop callbacks that are still pending from writing to the descriptor
+  pthread_mutex_lock(&notifier->lock);
+  notifier->released = CL_TRUE;
+  close(notifier->readFd);
+  if (notifier->writeFd != notifier->readFd)
+  {
+    close(notifier->writeFd);
+  }
+  pthread_mutex_unlock(&notifier->lock);
+
+  releaseNotifier(notifier);
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetCallbackStatsOIW_(cl_platform_id         platform,
+                        cl_callback_stats_oiw *stats)
+{
+  if (!stats)
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  pthread_mutex_lock(&m_callbacks.lock);
+  stats->callbacks = m_callbacks.callbacks;
+  stats->batches = m_callbacks.batches;
+  stats->threads = m_appLane.numThreads;
+  stats->mean_latency_ns = m_callbacks.callbacks ?
+    (cl_double)m_callbacks.totalLatencyNs / m_callbacks.callbacks : 0.0;
+  stats->max_latency_ns = m_callbacks.maxLatencyNs;
+  pthread_mutex_unlock(&m_callbacks.lock);
+
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_command_queue CL_API_CALL
+_clCreateSplitCommandQueueOIW_(cl_context                  context,
+                               cl_device_id                device,
+                               cl_command_queue_properties properties,
+                               cl_int *                    errcode_ret)
+{
+  cl_int err;
+  cl_command_queue queue =
+    _clCreateCommandQueue_(context, device, properties, &err);
+
+  // Create an in-order queue on every other device in the context
+  if (err == CL_SUCCESS && context->numDevices > 1)
+  {
+    cl_uint num = context->numDevices;
+    queue->splitQueues = malloc((num - 1)*sizeof(cl_command_queue));
+    queue->splitUnits = malloc(num*sizeof(cl_uint));
+    queue->splitUnits[0] = 1;
+    clGetDeviceInfo(device->device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                    sizeof(cl_uint), queue->splitUnits, NULL);
+
+    for (cl_uint i = 0; i < num && err == CL_SUCCESS; i++)
+    {
+      cl_device_id _device = context->devices[i]->device;
+      if (_device == device->device)
+      {
+        continue;
+      }
+
+      cl_uint n = queue->numSplitQueues;
+      queue->splitQueues[n] = clCreateCommandQueue(
+        context->context,
+        _device,
+        m_workStealing ?
+          CL_QUEUE_PROFILING_ENABLE : properties & CL_QUEUE_PROFILING_ENABLE,
+        &err
+      );
+      if (err == CL_SUCCESS)
+      {
+        queue->splitUnits[n+1] = 1;
+        clGetDeviceInfo(_device, CL_DEVICE_MAX_COMPUTE_UNITS,
+                        sizeof(cl_uint), queue->splitUnits + n + 1, NULL);
+        queue->numSplitQueues++;
+      }
+    }
+
+    // Feeder threads need a queue of their own on this device, since
+    // commands enqueued after the launch must not overtake its chunks
+    if (err == CL_SUCCESS && m_workStealing && queue->numSplitQueues)
+    {
+      cl_command_queue _own = clCreateCommandQueue(
+        context->context,
+        device->device,
+        CL_QUEUE_PROFILING_ENABLE,
+        &err
+      );
+      if (err == CL_SUCCESS)
+      {
+        queue->feederQueue = _own;
+        queue->scheduler = createSplitScheduler(queue, _own);
+        if (!queue->scheduler)
+        {
+          err = CL_OUT_OF_HOST_MEMORY;
+        }
+      }
+    }
+
+    if (err != CL_SUCCESS)
+    {
+      _clReleaseCommandQueue_(queue);
+      queue = NULL;
+    }
+  }
+
+  if (errcode_ret)
+  {
+    *errcode_ret = err;
+  }
+  return queue;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clSetKernelSplittableOIW_(cl_kernel kernel,
+                           cl_bool   splittable)
+{
+  kernel->splittable = splittable ? CL_TRUE : CL_FALSE;
+  return CL_SUCCESS;
+}
+
+CL_API_ENTRY cl_int CL_API_CALL
+_clGetPriorityStatsOIW_(cl_device_id            device,
+                        cl_queue_priority_oiw   priority,
+                        cl_priority_stats_oiw * stats)
+{
+  if (!stats || (priority != CL_QUEUE_PRIORITY_LOW_OIW &&
+                 priority != CL_QUEUE_PRIORITY_HIGH_OIW))
+  {
+    return CL_INVALID_VALUE;
+  }
+
+  memset(stats, 0, sizeof(cl_priority_stats_oiw));
+  struct priorityLane *lane = getPriorityLane(device->device);
+  cl_uint l = priority == CL_QUEUE_PRIORITY_HIGH_OIW;
+  pthread_mutex_lock(&lane->lock);
+  stats->commands = lane->commands[l];
+  stats->backlogged = lane->backlogged[l];
+  stats->mean_latency_ns = lane->commands[l] ?
+    (cl_double)lane->totalLatencyNs[l] / lane->commands[l] : 0.0;
+  stats->max_latency_ns = lane->maxLatencyNs[l];
+  pthread_mutex_unlock(&lane->lock);
+
+  return CL_SUCCESS;
+}
+
+void* getExtensionFunction(const char *funcname)
+{
+#define EXTENSION_FUNCTION(fn) \
+  if (strcmp(funcname, #fn) == 0) return (void*)_##fn##_;
+
+  // cl_oiw_command_graph
+  EXTENSION_FUNCTION(clBeginCommandGraphRecordingOIW);
+  EXTENSION_FUNCTION(clEndCommandGraphRecordingOIW);
+  EXTENSION_FUNCTION(clEnqueueCommandGraphOIW);
+  EXTENSION_FUNCTION(clReleaseCommandGraphOIW);
+
+  // cl_oiw_admission_control
+  EXTENSION_FUNCTION(clSetCommandQueueInFlightLimitOIW);
+  EXTENSION_FUNCTION(clGetCommandQueueStatsOIW);
+
+  // cl_oiw_event_notifier
+  EXTENSION_FUNCTION(clCreateEventNotifierOIW);
+  EXTENSION_FUNCTION(clGetEventNotifierFdOIW);
+  EXTENSION_FUNCTION(clAddEventsToNotifierOIW);
+  EXTENSION_FUNCTION(clReleaseEventNotifierOIW);
+
+  // cl_oiw_callback_dispatch
+  EXTENSION_FUNCTION(clGetCallbackStatsOIW);
+
+  // cl_oiw_split_queue
+  EXTENSION_FUNCTION(clCreateSplitCommandQueueOIW);
+  EXTENSION_FUNCTION(clSetKernelSplittableOIW);
+
+  // cl_oiw_queue_priority
+  EXTENSION_FUNCTION(clGetPriorityStatsOIW);
+
+  return NULL;
+}
+
 KHRicdVendorDispatch* createDispatchTable()
 {
   // Allocate table